@@ -774,7 +774,8 @@ public class ActivitySettings extends AppCompatActivity implements SharedPrefere
         else if ("hosts_url".equals(name))
             getPreferenceScreen().findPreference(name).setSummary(prefs.getString(name, BuildConfig.HOSTS_FILE_URI));
 
-        else if ("loglevel".equals(name))
+        else if ("loglevel".equals(name) || "dns_cache".equals(name) || "dns_cache_policy".equals(name) ||
+                "udp_offload".equals(name) || "workers".equals(name) || "io_uring".equals(name))
             ServiceSinkhole.reload("changed " + name, this, false);
     }
 
@@ -82,7 +82,6 @@ import org.json.JSONObject;
 
 import java.io.BufferedReader;
 import java.io.File;
-import java.io.FileReader;
 import java.io.IOException;
 import java.io.InputStreamReader;
 import java.math.BigInteger;
@@ -143,7 +142,7 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
     private boolean temporarilyStopped = false;
 
     private long last_hosts_modified = 0;
-    private Map<String, Boolean> mapHostsBlocked = new HashMap<>();
+    private int hostsBlocked = 0;
     private Map<Integer, Boolean> mapUidAllowed = new HashMap<>();
     private Map<Integer, Integer> mapUidKnown = new HashMap<>();
     private final Map<IPKey, Map<InetAddress, IPRule>> mapUidIPFilters = new HashMap<>();
@@ -214,6 +213,20 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
 
     private native void jni_socks5(String addr, int port, String username, String password);
 
+    private static native int jni_hosts_compile(String hosts, String image);
+
+    private native int jni_hosts(long context, String image);
+
+    private native void jni_dns(long context, int size, int policy);
+
+    private native void jni_udp_offload(long context, boolean enabled);
+
+    private native void jni_workers(long context, int count);
+
+    private native void jni_uring(long context, boolean enabled);
+
+    private native void jni_verdicts(long context, boolean log);
+
     private native void jni_done(long context);
 
     public static void setPcap(boolean enabled, Context context) {
@@ -1474,12 +1487,15 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
             lock.writeLock().lock();
             mapUidAllowed.clear();
             mapUidKnown.clear();
-            mapHostsBlocked.clear();
             mapUidIPFilters.clear();
             mapForward.clear();
             lock.writeLock().unlock();
+            hostsBlocked = jni_hosts(jni_context, null);
         }
 
+        // Invalidate cached native verdicts
+        jni_verdicts(jni_context, log || log_app);
+
         if (log_app)
             prepareNotify(listRule);
         else {
@@ -1500,6 +1516,16 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
             else
                 jni_socks5("", 0, "", "");
 
+            jni_dns(jni_context,
+                    Integer.parseInt(prefs.getString("dns_cache", "256")),
+                    Integer.parseInt(prefs.getString("dns_cache_policy", "0")));
+
+            jni_udp_offload(jni_context, prefs.getBoolean("udp_offload", false));
+
+            jni_workers(jni_context, Integer.parseInt(prefs.getString("workers", "1")));
+
+            jni_uring(jni_context, prefs.getBoolean("io_uring", false));
+
             if (tunnelThread == null) {
                 Log.i(TAG, "Starting tunnel thread context=" + jni_context);
                 jni_start(jni_context, prio);
@@ -1551,11 +1577,12 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
         lock.writeLock().lock();
         mapUidAllowed.clear();
         mapUidKnown.clear();
-        mapHostsBlocked.clear();
         mapUidIPFilters.clear();
         mapForward.clear();
         mapNotify.clear();
         lock.writeLock().unlock();
+        hostsBlocked = jni_hosts(jni_context, null);
+        jni_verdicts(jni_context, false);
     }
 
     private void prepareUidAllowed(List<Rule> listAllowed, List<Rule> listRule) {
@@ -1576,58 +1603,28 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
         SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(ServiceSinkhole.this);
         boolean use_hosts = prefs.getBoolean("filter", false) && prefs.getBoolean("use_hosts", false);
         File hosts = new File(getFilesDir(), "hosts.txt");
+        File image = new File(getFilesDir(), "hosts.bin");
         if (!use_hosts || !hosts.exists() || !hosts.canRead()) {
             Log.i(TAG, "Hosts file use=" + use_hosts + " exists=" + hosts.exists());
-            lock.writeLock().lock();
-            mapHostsBlocked.clear();
-            lock.writeLock().unlock();
+            hostsBlocked = jni_hosts(jni_context, null);
             return;
         }
 
         boolean changed = (hosts.lastModified() != last_hosts_modified);
-        if (!changed && mapHostsBlocked.size() > 0) {
+        if (!changed && hostsBlocked > 0) {
             Log.i(TAG, "Hosts file unchanged");
             return;
         }
         last_hosts_modified = hosts.lastModified();
 
-        lock.writeLock().lock();
-
-        mapHostsBlocked.clear();
-
-        int count = 0;
-        BufferedReader br = null;
-        try {
-            br = new BufferedReader(new FileReader(hosts));
-            String line;
-            while ((line = br.readLine()) != null) {
-                int hash = line.indexOf('#');
-                if (hash >= 0)
-                    line = line.substring(0, hash);
-                line = line.trim();
-                if (line.length() > 0) {
-                    String[] words = line.split("\\s+");
-                    if (words.length == 2) {
-                        count++;
-                        mapHostsBlocked.put(words[1], true);
-                    } else
-                        Log.i(TAG, "Invalid hosts file line: " + line);
-                }
-            }
-            mapHostsBlocked.put("test.netguard.me", true);
-            Log.i(TAG, count + " hosts read");
-        } catch (IOException ex) {
-            Log.e(TAG, ex.toString() + "\n" + Log.getStackTraceString(ex));
-        } finally {
-            if (br != null)
-                try {
-                    br.close();
-                } catch (IOException exex) {
-                    Log.e(TAG, exex.toString() + "\n" + Log.getStackTraceString(exex));
-                }
-        }
-
-        lock.writeLock().unlock();
+        // Compile the hosts file into an image which is mapped natively
+        if (!image.exists() || image.lastModified() < hosts.lastModified())
+            jni_hosts_compile(hosts.getAbsolutePath(), image.getAbsolutePath());
+        hostsBlocked = jni_hosts(jni_context, image.getAbsolutePath());
+        if (hostsBlocked == 0 &&
+                jni_hosts_compile(hosts.getAbsolutePath(), image.getAbsolutePath()) > 0)
+            hostsBlocked = jni_hosts(jni_context, image.getAbsolutePath()); // other version
+        Log.i(TAG, hostsBlocked + " hosts mapped");
     }
 
     private void prepareUidIPFilters(String dname) {
@@ -1880,15 +1877,10 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
         if (DatabaseHelper.getInstance(ServiceSinkhole.this).insertDns(rr)) {
             Log.i(TAG, "New IP " + rr);
             prepareUidIPFilters(rr.QName);
-        }
-    }
 
-    // Called from native code
-    private boolean isDomainBlocked(String name) {
-        lock.readLock().lock();
-        boolean blocked = (mapHostsBlocked.containsKey(name) && mapHostsBlocked.get(name));
-        lock.readLock().unlock();
-        return blocked;
+            SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(this);
+            jni_verdicts(jni_context, prefs.getBoolean("log", false) || prefs.getBoolean("log_app", false));
+        }
     }
 
     // Called from native code
@@ -2857,7 +2849,7 @@ public class ServiceSinkhole extends VpnService implements SharedPreferences.OnS
 
     private void updateEnforcingNotification(int allowed, int total) {
         // Update notification
-        Notification notification = getEnforcingNotification(allowed, total - allowed, mapHostsBlocked.size());
+        Notification notification = getEnforcingNotification(allowed, total - allowed, hostsBlocked);
         NotificationManager nm = (NotificationManager) getSystemService(NOTIFICATION_SERVICE);
         nm.notify(NOTIFY_ENFORCING, notification);
     }
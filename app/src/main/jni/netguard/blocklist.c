@@ -0,0 +1,345 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+
+#include "netguard.h"
+
+// Hosts file domains compiled into an image which is mapped into memory
+// The image has a header, entries sorted by name hash and a pool of names.
+// Names are lower case, "*.example.com" also matches all subdomains of example.com
+
+struct builder {
+    uint32_t count;
+    uint32_t size; // slots, power of two
+    struct blocklist_entry *slots;
+    char *pool;
+    size_t pool_size;
+    size_t pool_used;
+};
+
+static uint32_t hash_name(const char *name, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) tolower(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int add_name(struct builder *b, const char *name, size_t len) {
+    if (len == 0 || len > DNS_QNAME_MAX)
+        return 0;
+
+    uint8_t flags = BLOCKLIST_EXACT;
+    if (len > 2 && name[0] == '*' && name[1] == '.') {
+        flags = BLOCKLIST_SUFFIX;
+        name += 2;
+        len -= 2;
+    }
+
+    // Grow at 50% load
+    if ((b->count + 1) * 2 > b->size) {
+        uint32_t osize = b->size;
+        struct blocklist_entry *oslots = b->slots;
+        b->size = (osize == 0 ? BLOCKLIST_INIT : osize * 2);
+        b->slots = ng_calloc(b->size, sizeof(struct blocklist_entry), "blocklist");
+        for (uint32_t i = 0; i < osize; i++)
+            if (oslots[i].offset != 0) {
+                uint32_t j = oslots[i].hash & (b->size - 1);
+                while (b->slots[j].offset != 0)
+                    j = (j + 1) & (b->size - 1);
+                b->slots[j] = oslots[i];
+            }
+        if (oslots != NULL)
+            ng_free(oslots, __FILE__, __LINE__);
+    }
+
+    uint32_t hash = hash_name(name, len);
+    uint32_t mask = b->size - 1;
+    uint32_t i = hash & mask;
+    for (; b->slots[i].offset != 0; i = (i + 1) & mask)
+        if (b->slots[i].hash == hash) {
+            char *entry = b->pool + b->slots[i].offset;
+            if (strncasecmp(entry, name, len) == 0 && entry[len] == 0) {
+                entry[-1] |= flags; // duplicate
+                return 0;
+            }
+        }
+
+    // Pool entry: flags, name, terminating zero
+    if (b->pool_used + len + 2 > b->pool_size) {
+        b->pool_size = (b->pool_size == 0 ? BLOCKLIST_POOL_INIT : b->pool_size * 2);
+        while (b->pool_used + len + 2 > b->pool_size)
+            b->pool_size *= 2;
+        b->pool = ng_realloc(b->pool, b->pool_size, "blocklist pool");
+    }
+    char *entry = b->pool + b->pool_used;
+    entry[0] = flags;
+    for (size_t c = 0; c < len; c++)
+        entry[1 + c] = (char) tolower(name[c]);
+    entry[1 + len] = 0;
+
+    b->slots[i].hash = hash;
+    b->slots[i].offset = (uint32_t) (b->pool_used + 1);
+    b->pool_used += len + 2;
+    b->count++;
+    return 1;
+}
+
+static int read_hosts(struct builder *b, const char *path) {
+    FILE *fd = fopen(path, "r");
+    if (fd == NULL) {
+        log_android(ANDROID_LOG_ERROR, "Hosts %s open error %d: %s",
+                    path, errno, strerror(errno));
+        return -1;
+    }
+
+    int lines = 0;
+    char *line = NULL;
+    size_t llen = 0;
+    while (getline(&line, &llen, fd) >= 0) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = 0;
+
+        // address name
+        char *words[3];
+        int count = 0;
+        char *save = NULL;
+        for (char *w = strtok_r(line, " \t\r\n", &save);
+             w != NULL && count < 3;
+             w = strtok_r(NULL, " \t\r\n", &save))
+            words[count++] = w;
+
+        if (count == 2) {
+            lines++;
+            add_name(b, words[1], strlen(words[1]));
+        } else if (count > 0)
+            log_android(ANDROID_LOG_INFO, "Invalid hosts file line: %s", words[0]);
+    }
+    if (line != NULL)
+        free(line); // allocated by getline
+
+    int err = ferror(fd);
+    if (err)
+        log_android(ANDROID_LOG_ERROR, "Hosts %s read error %d: %s",
+                    path, errno, strerror(errno));
+    fclose(fd);
+
+    return (err ? -1 : lines);
+}
+
+static int compare_entry(const void *a, const void *b) {
+    uint32_t ha = ((const struct blocklist_entry *) a)->hash;
+    uint32_t hb = ((const struct blocklist_entry *) b)->hash;
+    return (ha < hb ? -1 : (ha > hb ? 1 : 0));
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t res = write(fd, p, len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += res;
+        len -= res;
+    }
+    return 0;
+}
+
+int compile_blocklist(const char *hosts, const char *image) {
+    struct builder b;
+    memset(&b, 0, sizeof(struct builder));
+    b.pool_used = 1; // offset zero means empty slot
+
+    int lines = read_hosts(&b, hosts);
+    if (lines >= 0) {
+        const char *test = "test.netguard.me";
+        add_name(&b, test, strlen(test));
+    }
+
+    int count = -1;
+    if (lines >= 0) {
+        // Compact and sort the slots
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < b.size; i++)
+            if (b.slots[i].offset != 0)
+                b.slots[n++] = b.slots[i];
+        qsort(b.slots, n, sizeof(struct blocklist_entry), compare_entry);
+
+        struct blocklist_header header;
+        header.magic = BLOCKLIST_MAGIC;
+        header.version = BLOCKLIST_VERSION;
+        header.count = n;
+        header.pool_size = (uint32_t) b.pool_used;
+
+        // Write aside and rename, a mapped image stays valid
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", image);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            log_android(ANDROID_LOG_ERROR, "Hosts image %s open error %d: %s",
+                        tmp, errno, strerror(errno));
+        else {
+            int err = (write_all(fd, &header, sizeof(struct blocklist_header)) ||
+                       write_all(fd, b.slots, n * sizeof(struct blocklist_entry)) ||
+                       write_all(fd, b.pool, b.pool_used) ||
+                       fsync(fd));
+            if (err)
+                log_android(ANDROID_LOG_ERROR, "Hosts image %s write error %d: %s",
+                            tmp, errno, strerror(errno));
+            if (close(fd))
+                err = 1;
+
+            if (!err && rename(tmp, image)) {
+                err = 1;
+                log_android(ANDROID_LOG_ERROR, "Hosts image %s rename error %d: %s",
+                            image, errno, strerror(errno));
+            }
+
+            if (err)
+                unlink(tmp);
+            else {
+                count = (int) n;
+                log_android(ANDROID_LOG_WARN, "Hosts %d lines compiled %d names pool %d",
+                            lines, n, b.pool_used);
+            }
+        }
+    }
+
+    if (b.slots != NULL)
+        ng_free(b.slots, __FILE__, __LINE__);
+    if (b.pool != NULL)
+        ng_free(b.pool, __FILE__, __LINE__);
+
+    return count;
+}
+
+struct blocklist *map_blocklist(const char *image) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_ERROR, "Hosts image %s open error %d: %s",
+                    image, errno, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(struct blocklist_header)) {
+        log_android(ANDROID_LOG_ERROR, "Hosts image %s invalid size", image);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_android(ANDROID_LOG_ERROR, "Hosts image %s mmap error %d: %s",
+                    image, errno, strerror(errno));
+        return NULL;
+    }
+
+    // Check header, sizes and terminating zero
+    const struct blocklist_header *header = map;
+    size_t size = sizeof(struct blocklist_header) +
+                  (size_t) header->count * sizeof(struct blocklist_entry) +
+                  header->pool_size;
+    const char *pool = (const char *) map + size - header->pool_size;
+    if (header->magic != BLOCKLIST_MAGIC || header->version != BLOCKLIST_VERSION ||
+        size != (size_t) st.st_size || header->pool_size == 0 ||
+        pool[header->pool_size - 1] != 0) {
+        log_android(ANDROID_LOG_WARN, "Hosts image %s version %d invalid",
+                    image, header->version);
+        munmap(map, (size_t) st.st_size);
+        return NULL;
+    }
+
+    struct blocklist *bl = ng_malloc(sizeof(struct blocklist), "blocklist");
+    bl->map = map;
+    bl->map_size = (size_t) st.st_size;
+    bl->count = header->count;
+    bl->entries = (const struct blocklist_entry *) (header + 1);
+    bl->pool = pool;
+    bl->pool_size = header->pool_size;
+
+    log_android(ANDROID_LOG_WARN, "Hosts image %s mapped %d names", image, bl->count);
+    return bl;
+}
+
+static int find_name(const struct blocklist *bl, const char *name, size_t len, uint8_t flags) {
+    uint32_t hash = hash_name(name, len);
+
+    // First entry with the hash
+    uint32_t lo = 0;
+    uint32_t hi = bl->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (bl->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < bl->count && bl->entries[lo].hash == hash; lo++) {
+        uint32_t offset = bl->entries[lo].offset;
+        if (offset == 0 || offset + len >= bl->pool_size)
+            continue;
+        const char *entry = bl->pool + offset;
+        if ((entry[-1] & flags) == flags &&
+            strncasecmp(entry, name, len) == 0 && entry[len] == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int is_blocklisted(const struct blocklist *bl, const char *name) {
+    if (bl == NULL || bl->count == 0)
+        return 0;
+
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '.')
+        len--; // fully qualified
+    if (find_name(bl, name, len, BLOCKLIST_EXACT))
+        return 1;
+
+    // Parent domains with a wildcard entry
+    for (size_t i = 0; i < len; i++)
+        if (name[i] == '.' &&
+            find_name(bl, name + i + 1, len - i - 1, BLOCKLIST_SUFFIX))
+            return 1;
+
+    return 0;
+}
+
+void free_blocklist(struct blocklist *bl) {
+    if (bl == NULL)
+        return;
+    if (munmap(bl->map, bl->map_size))
+        log_android(ANDROID_LOG_ERROR, "Hosts image munmap error %d: %s",
+                    errno, strerror(errno));
+    ng_free(bl, __FILE__, __LINE__);
+}
+
+jboolean is_domain_blocked(const struct arguments *args, const char *name) {
+    // Called with the worker lock held, the list is swapped with all workers locked
+    return (jboolean) is_blocklisted(args->ctx->blocklist, name);
+}
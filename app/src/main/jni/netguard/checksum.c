@@ -0,0 +1,245 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+
+#include "netguard.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CHECKSUM_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define CHECKSUM_AVX2
+#endif
+
+// Internet checksum (RFC 1071)
+// The sum of the 16 bit words in memory order, with an odd last byte as low byte.
+// Wider words are summed into a 64 bit accumulator, which is congruent modulo 0xFFFF,
+// so folding gives the same result as summing 16 bit words.
+
+static uint64_t sum_scalar(const uint8_t *buffer, size_t length, uint64_t sum) {
+    while (length >= 16) {
+        uint32_t w[4];
+        memcpy(w, buffer, sizeof(w));
+        sum += (uint64_t) w[0] + w[1] + w[2] + w[3];
+        buffer += 16;
+        length -= 16;
+    }
+
+    while (length > 1) {
+        uint16_t w;
+        memcpy(&w, buffer, sizeof(w));
+        sum += w;
+        buffer += 2;
+        length -= 2;
+    }
+
+    if (length > 0)
+        sum += *buffer;
+
+    return sum;
+}
+
+#ifdef CHECKSUM_NEON
+static uint64_t sum_neon(const uint8_t *buffer, size_t length, uint64_t sum) {
+    // Each 32 bit lane grows by at most 2 * 0xFFFF per block
+    while (length >= 32) {
+        size_t blocks = length / 32;
+        if (blocks > CHECKSUM_FLUSH)
+            blocks = CHECKSUM_FLUSH;
+        length -= blocks * 32;
+
+        uint32x4_t acc0 = vdupq_n_u32(0);
+        uint32x4_t acc1 = vdupq_n_u32(0);
+        while (blocks--) {
+            acc0 = vpadalq_u16(acc0, vreinterpretq_u16_u8(vld1q_u8(buffer)));
+            acc1 = vpadalq_u16(acc1, vreinterpretq_u16_u8(vld1q_u8(buffer + 16)));
+            buffer += 32;
+        }
+
+        uint64x2_t acc = vpaddlq_u32(acc0);
+        acc = vpadalq_u32(acc, acc1);
+        sum += vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+    }
+
+    return sum_scalar(buffer, length, sum);
+}
+#endif
+
+#ifdef CHECKSUM_SSE2
+static uint64_t sum_sse2(const uint8_t *buffer, size_t length, uint64_t sum) {
+    const __m128i zero = _mm_setzero_si128();
+    while (length >= 32) {
+        size_t blocks = length / 32;
+        if (blocks > CHECKSUM_FLUSH)
+            blocks = CHECKSUM_FLUSH;
+        length -= blocks * 32;
+
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        while (blocks--) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) buffer);
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (buffer + 16));
+            acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v0, zero));
+            acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v0, zero));
+            acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v1, zero));
+            acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v1, zero));
+            buffer += 32;
+        }
+
+        uint32_t lanes[8];
+        _mm_storeu_si128((__m128i *) lanes, acc0);
+        _mm_storeu_si128((__m128i *) (lanes + 4), acc1);
+        for (int i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    return sum_scalar(buffer, length, sum);
+}
+#endif
+
+#ifdef CHECKSUM_AVX2
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *buffer, size_t length, uint64_t sum) {
+    const __m256i zero = _mm256_setzero_si256();
+    while (length >= 64) {
+        size_t blocks = length / 64;
+        if (blocks > CHECKSUM_FLUSH)
+            blocks = CHECKSUM_FLUSH;
+        length -= blocks * 64;
+
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        while (blocks--) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *) buffer);
+            __m256i v1 = _mm256_loadu_si256((const __m256i *) (buffer + 32));
+            acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(v0, zero));
+            acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(v0, zero));
+            acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(v1, zero));
+            acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(v1, zero));
+            buffer += 64;
+        }
+
+        uint32_t lanes[16];
+        _mm256_storeu_si256((__m256i *) lanes, acc0);
+        _mm256_storeu_si256((__m256i *) (lanes + 8), acc1);
+        for (int i = 0; i < 16; i++)
+            sum += lanes[i];
+    }
+
+    return sum_scalar(buffer, length, sum);
+}
+
+static int has_avx2() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    // OS saves YMM registers
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return 0;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6)
+        return 0;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return ((ebx & bit_AVX2) != 0);
+}
+#endif
+
+static uint64_t (*sum_words)(const uint8_t *, size_t, uint64_t) = sum_scalar;
+
+int get_checksum_variants(struct checksum_variant *variant) {
+    int count = 0;
+    variant[count].name = "scalar";
+    variant[count++].sum = sum_scalar;
+
+#ifdef CHECKSUM_NEON
+    variant[count].name = "NEON";
+    variant[count++].sum = sum_neon;
+#endif
+
+#ifdef CHECKSUM_SSE2
+    variant[count].name = "SSE2";
+    variant[count++].sum = sum_sse2;
+#endif
+
+#ifdef CHECKSUM_AVX2
+    if (has_avx2()) {
+        variant[count].name = "AVX2";
+        variant[count++].sum = sum_avx2;
+    }
+#endif
+
+    return count;
+}
+
+void init_checksum() {
+    // The last variant is the fastest
+    struct checksum_variant variant[CHECKSUM_VARIANTS];
+    int count = get_checksum_variants(variant);
+    sum_words = variant[count - 1].sum;
+    log_android(ANDROID_LOG_WARN, "Checksum %s", variant[count - 1].name);
+}
+
+uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length) {
+    uint64_t sum = start;
+
+    // Headers and short payloads are not worth the vector setup
+    if (length < CHECKSUM_SIMD_MIN)
+        sum = sum_scalar(buffer, length, sum);
+    else
+        sum = sum_words(buffer, length, sum);
+
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t) sum;
+}
+
+uint16_t update_checksum(uint16_t check, const void *from, const void *to, size_t length) {
+    // RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+    uint64_t sum = (uint16_t) ~check;
+    const uint8_t *m = from;
+    const uint8_t *n = to;
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        uint16_t w;
+        memcpy(&w, m + i, sizeof(w));
+        sum += (uint16_t) ~w;
+        memcpy(&w, n + i, sizeof(w));
+        sum += w;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
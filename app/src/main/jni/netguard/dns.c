@@ -121,6 +121,7 @@ void parse_dns_response(const struct arguments *args, const struct ng_session *s
         }
 
         short svcb = 0;
+        uint32_t ttl_min = DNS_CACHE_TTL_MAX;
         int32_t aoff = off;
         for (int a = 0; a < acount; a++) {
             off = get_qname(data, *datalen, (uint16_t) off, name);
@@ -131,6 +132,9 @@ void parse_dns_response(const struct arguments *args, const struct ng_session *s
                 uint16_t rdlength = ntohs(*((uint16_t *) (data + off + 8)));
                 off += 10;
 
+                if (ttl < ttl_min)
+                    ttl_min = ttl;
+
                 if (off + rdlength <= *datalen) {
                     if (qclass == DNS_QCLASS_IN &&
                         (qtype == DNS_QTYPE_A || qtype == DNS_QTYPE_AAAA)) {
@@ -231,7 +235,11 @@ void parse_dns_response(const struct arguments *args, const struct ng_session *s
                     source, sport, dest, dport,
                     name, 0, 0);
             log_packet(args, objPacket);
-        }
+        } else if (s->protocol == IPPROTO_UDP &&
+                   dns->rcode == 0 && !dns->tc && qclass == DNS_QCLASS_IN &&
+                   (qtype == DNS_QTYPE_A || qtype == DNS_QTYPE_AAAA))
+            store_dns_response(&args->ctx->dns_cache, (const struct sockaddr *) &s->udp.target,
+                               data, *datalen, ttl_min);
     } else if (acount > 0)
         log_android(ANDROID_LOG_WARN,
                     "DNS response qr %d opcode %d qcount %d acount %d",
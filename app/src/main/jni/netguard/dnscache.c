@@ -0,0 +1,347 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+
+#include "netguard.h"
+
+// Responses to A/AAAA queries cached by server, question and the query flags which change the answer
+// A hit is the stored response with the id and question of the query and TTLs reduced by age
+
+static uint32_t hash_question(const uint8_t *q, size_t qlen) {
+    // FNV-1a, lower case name, exact type and class
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < qlen; i++) {
+        hash ^= (uint8_t) (i + 4 < qlen ? tolower(q[i]) : q[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void get_server(struct dns_server *server, const struct sockaddr *addr) {
+    memset(server, 0, sizeof(struct dns_server));
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *) addr;
+        server->version = 4;
+        server->port = addr4->sin_port;
+        memcpy(server->addr, &addr4->sin_addr, 4);
+    } else {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *) addr;
+        server->version = 6;
+        server->port = addr6->sin6_port;
+        memcpy(server->addr, &addr6->sin6_addr, 16);
+    }
+}
+
+static uint32_t hash_server(uint32_t hash, const struct dns_server *server) {
+    const uint8_t *b = (const uint8_t *) server;
+    for (size_t i = 0; i < sizeof(struct dns_server); i++) {
+        hash ^= b[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int same_question(const uint8_t *a, const uint8_t *b, size_t qlen) {
+    for (size_t i = 0; i + 4 < qlen; i++)
+        if (tolower(a[i]) != tolower(b[i]))
+            return 0;
+    return (memcmp(a + qlen - 4, b + qlen - 4, 4) == 0);
+}
+
+static size_t get_question_length(const uint8_t *data, size_t datalen) {
+    // Single uncompressed name, type and class
+    size_t off = sizeof(struct dns_header);
+    while (off < datalen && data[off] != 0) {
+        if (data[off] & 0xC0)
+            return 0;
+        off += data[off] + 1;
+    }
+    off += 1 + 4;
+    return (off <= datalen ? off - sizeof(struct dns_header) : 0);
+}
+
+static int skip_name(const uint8_t *data, size_t datalen, size_t *off) {
+    while (*off < datalen) {
+        uint8_t len = data[*off];
+        if (len == 0) {
+            *off += 1;
+            return 0;
+        } else if ((len & 0xC0) == 0xC0) {
+            *off += 2;
+            return (*off <= datalen ? 0 : -1);
+        } else if (len & 0xC0)
+            return -1;
+        *off += len + 1;
+    }
+    return -1;
+}
+
+static int age_records(uint8_t *data, size_t datalen, size_t off, int count, uint32_t age) {
+    // Returns -1 if malformed, 1 if there is an OPT record
+    int edns = 0;
+    for (int i = 0; i < count; i++) {
+        if (skip_name(data, datalen, &off) || off + 10 > datalen)
+            return -1;
+
+        uint16_t qtype = ntohs(*((uint16_t *) (data + off)));
+        uint16_t rdlength = ntohs(*((uint16_t *) (data + off + 8)));
+        if (qtype == DNS_QTYPE_OPT)
+            edns = 1; // TTL holds extended flags
+        else if (age > 0) {
+            uint32_t ttl = ntohl(*((uint32_t *) (data + off + 4)));
+            *((uint32_t *) (data + off + 4)) = htonl(ttl > age ? ttl - age : 0);
+        }
+
+        off += 10 + rdlength;
+        if (off > datalen)
+            return -1;
+    }
+    return edns;
+}
+
+static int get_records(const struct dns_header *dns) {
+    return ntohs(dns->ans_count) + ntohs(dns->auth_count) + ntohs(dns->add_count);
+}
+
+static uint16_t get_flags(const struct dns_header *dns, int edns) {
+    return (uint16_t) (dns->rd | (dns->cd << 1) | (edns << 2));
+}
+
+static struct dns_entry *find_entry(const struct dns_cache *dc, uint32_t hash,
+                                    const struct dns_server *server, uint16_t flags,
+                                    const uint8_t *question, size_t qlen) {
+    struct dns_entry *e = dc->bucket[hash & (dc->buckets - 1)];
+    for (; e != NULL; e = e->next)
+        if (e->hash == hash && e->flags == flags && e->qlen == qlen &&
+            memcmp(&e->server, server, sizeof(struct dns_server)) == 0 &&
+            same_question((uint8_t *) (e + 1) + sizeof(struct dns_header), question, qlen))
+            return e;
+    return NULL;
+}
+
+static void unlink_used(struct dns_cache *dc, struct dns_entry *e) {
+    if (e->lprev == NULL)
+        dc->first = e->lnext;
+    else
+        e->lprev->lnext = e->lnext;
+    if (e->lnext == NULL)
+        dc->last = e->lprev;
+    else
+        e->lnext->lprev = e->lprev;
+}
+
+static void link_used(struct dns_cache *dc, struct dns_entry *e) {
+    e->lprev = NULL;
+    e->lnext = dc->first;
+    if (dc->first == NULL)
+        dc->last = e;
+    else
+        dc->first->lprev = e;
+    dc->first = e;
+}
+
+static void remove_entry(struct dns_cache *dc, struct dns_entry *e) {
+    struct dns_entry **pe = &dc->bucket[e->hash & (dc->buckets - 1)];
+    while (*pe != e)
+        pe = &(*pe)->next;
+    *pe = e->next;
+
+    unlink_used(dc, e);
+    dc->count--;
+    ng_free(e, __FILE__, __LINE__);
+}
+
+static void evict_entry(struct dns_cache *dc) {
+    struct dns_entry *victim = dc->last;
+    if (dc->policy == DNS_CACHE_TTL)
+        for (struct dns_entry *e = dc->first; e != NULL; e = e->lnext)
+            if (e->expires < victim->expires)
+                victim = e;
+    remove_entry(dc, victim);
+}
+
+void set_dns_cache(struct dns_cache *dc, int size, int policy) {
+    if (size < 0)
+        size = 0;
+    if (size == dc->size && policy == dc->policy)
+        return;
+
+    free_dns_cache(dc);
+    dc->size = size;
+    dc->policy = policy;
+    if (size > 0) {
+        dc->buckets = 1;
+        while (dc->buckets < (uint32_t) size)
+            dc->buckets <<= 1;
+        dc->bucket = ng_calloc(dc->buckets, sizeof(struct dns_entry *), "dns cache");
+    }
+
+    log_android(ANDROID_LOG_WARN, "DNS cache size %d policy %d", size, policy);
+}
+
+void clear_dns_cache(struct dns_cache *dc) {
+    if (dc->count > 0 || dc->hits > 0 || dc->misses > 0)
+        log_android(ANDROID_LOG_INFO, "DNS cache clear responses %d hits %u misses %u",
+                    dc->count, dc->hits, dc->misses);
+
+    struct dns_entry *e = dc->first;
+    while (e != NULL) {
+        struct dns_entry *next = e->lnext;
+        ng_free(e, __FILE__, __LINE__);
+        e = next;
+    }
+    if (dc->bucket != NULL)
+        memset(dc->bucket, 0, dc->buckets * sizeof(struct dns_entry *));
+
+    dc->first = NULL;
+    dc->last = NULL;
+    dc->count = 0;
+    dc->hits = 0;
+    dc->misses = 0;
+}
+
+void free_dns_cache(struct dns_cache *dc) {
+    clear_dns_cache(dc);
+    if (dc->bucket != NULL)
+        ng_free(dc->bucket, __FILE__, __LINE__);
+    dc->bucket = NULL;
+    dc->buckets = 0;
+    dc->size = 0;
+}
+
+static void store_response(struct dns_cache *dc, const struct sockaddr *addr,
+                           const uint8_t *data, size_t datalen, uint32_t ttl) {
+    if (dc->size <= 0 || ttl == 0 || datalen > DNS_CACHE_LENGTH_MAX)
+        return;
+
+    const struct dns_header *dns = (const struct dns_header *) data;
+    size_t qlen = get_question_length(data, datalen);
+    if (qlen == 0 || ntohs(dns->q_count) != 1)
+        return;
+
+    // Check records, no changes with age zero
+    int edns = age_records((uint8_t *) data, datalen,
+                           sizeof(struct dns_header) + qlen, get_records(dns), 0);
+    if (edns < 0) {
+        log_android(ANDROID_LOG_WARN, "DNS cache invalid response length %d", datalen);
+        return;
+    }
+
+    struct dns_server server;
+    get_server(&server, addr);
+    const uint8_t *question = data + sizeof(struct dns_header);
+    uint32_t hash = hash_server(hash_question(question, qlen), &server);
+    uint16_t flags = get_flags(dns, edns);
+
+    struct dns_entry *e = find_entry(dc, hash, &server, flags, question, qlen);
+    if (e != NULL)
+        remove_entry(dc, e);
+    else if (dc->count >= dc->size)
+        evict_entry(dc);
+
+    e = ng_malloc(sizeof(struct dns_entry) + datalen, "dns entry");
+    e->hash = hash;
+    e->server = server;
+    e->flags = flags;
+    e->qlen = (uint16_t) qlen;
+    e->length = (uint16_t) datalen;
+    e->time = time(NULL);
+    e->expires = e->time + (ttl > DNS_CACHE_TTL_MAX ? DNS_CACHE_TTL_MAX : ttl);
+    memcpy(e + 1, data, datalen);
+
+    uint32_t b = hash & (dc->buckets - 1);
+    e->next = dc->bucket[b];
+    dc->bucket[b] = e;
+    link_used(dc, e);
+    dc->count++;
+}
+
+static size_t get_response(struct dns_cache *dc, const struct sockaddr *addr,
+                           const uint8_t *query, size_t querylen, uint8_t *response) {
+    if (dc->size <= 0 || querylen < sizeof(struct dns_header) + 1)
+        return 0;
+
+    // Standard query with a single question
+    const struct dns_header *dns = (const struct dns_header *) query;
+    if (dns->qr != 0 || dns->opcode != 0 ||
+        ntohs(dns->q_count) != 1 || dns->ans_count != 0)
+        return 0;
+
+    size_t qlen = get_question_length(query, querylen);
+    if (qlen == 0)
+        return 0;
+    const uint8_t *question = query + sizeof(struct dns_header);
+    uint16_t qtype = ntohs(*((uint16_t *) (question + qlen - 4)));
+    uint16_t qclass = ntohs(*((uint16_t *) (question + qlen - 2)));
+    if (qclass != DNS_QCLASS_IN || (qtype != DNS_QTYPE_A && qtype != DNS_QTYPE_AAAA))
+        return 0;
+
+    int edns = age_records((uint8_t *) query, querylen,
+                           sizeof(struct dns_header) + qlen, get_records(dns), 0);
+    if (edns < 0)
+        return 0;
+
+    struct dns_server server;
+    get_server(&server, addr);
+    struct dns_entry *e = find_entry(dc, hash_server(hash_question(question, qlen), &server),
+                                     &server, get_flags(dns, edns), question, qlen);
+    time_t now = time(NULL);
+    if (e != NULL && e->expires <= now) {
+        remove_entry(dc, e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        dc->misses++;
+        return 0;
+    }
+
+    // Query id and question (case), remaining TTLs
+    uint8_t *data = (uint8_t *) (e + 1);
+    memcpy(response, data, e->length);
+    memcpy(response, query, sizeof(dns->id));
+    memcpy(response + sizeof(struct dns_header), question, qlen);
+    age_records(response, e->length, sizeof(struct dns_header) + qlen,
+                get_records((struct dns_header *) data), (uint32_t) (now - e->time));
+
+    unlink_used(dc, e);
+    link_used(dc, e);
+    dc->hits++;
+
+    return e->length;
+}
+
+// Workers share the cache
+void store_dns_response(struct dns_cache *dc, const struct sockaddr *server,
+                        const uint8_t *data, size_t datalen, uint32_t ttl) {
+    if (pthread_mutex_lock(&dc->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    store_response(dc, server, data, datalen, ttl);
+    if (pthread_mutex_unlock(&dc->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+size_t get_dns_response(struct dns_cache *dc, const struct sockaddr *server,
+                        const uint8_t *query, size_t querylen, uint8_t *response) {
+    if (pthread_mutex_lock(&dc->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    size_t length = get_response(dc, server, query, querylen, response);
+    if (pthread_mutex_unlock(&dc->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    return length;
+}
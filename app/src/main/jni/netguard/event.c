@@ -0,0 +1,383 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// Session code registers its sockets through the event loop of its worker,
+// so the readiness notification can be replaced without touching the protocol handling,
+// for example by a deterministic loop replaying recorded events.
+
+static int epoll_open(struct event_loop *loop) {
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    return (loop->fd < 0 ? -1 : 0);
+}
+
+static void epoll_close(struct event_loop *loop) {
+    if (loop->fd >= 0 && close(loop->fd))
+        log_android(ANDROID_LOG_ERROR, "epoll close error %d: %s", errno, strerror(errno));
+    loop->fd = -1;
+}
+
+static int epoll_ctl_event(struct event_loop *loop, int op, int fd, uint32_t events, void *data) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = events;
+    ev.data.ptr = data;
+    loop->syscalls++;
+    return epoll_ctl(loop->fd, op, fd, &ev);
+}
+
+static int epoll_add(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    return epoll_ctl_event(loop, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int epoll_modify(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    return epoll_ctl_event(loop, EPOLL_CTL_MOD, fd, events, data);
+}
+
+static int epoll_remove(struct event_loop *loop, int fd) {
+    // Closing the socket removes it as well
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    loop->syscalls++;
+    return epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int epoll_wait_events(struct event_loop *loop, struct event *ev, int maxevents, int timeout) {
+    if (loop->size != maxevents) {
+        if (loop->buffer != NULL)
+            ng_free(loop->buffer, __FILE__, __LINE__);
+        loop->buffer = ng_malloc(maxevents * sizeof(struct epoll_event), "epoll events");
+        loop->size = maxevents;
+    }
+
+    struct epoll_event *eev = (struct epoll_event *) loop->buffer;
+    int ready = epoll_wait(loop->fd, eev, maxevents, timeout);
+    loop->syscalls++;
+    for (int i = 0; i < ready; i++) {
+        ev[i].events = eev[i].events;
+        ev[i].data = eev[i].data.ptr;
+    }
+    return ready;
+}
+
+const struct event_backend epoll_backend = {
+        .name = "epoll",
+        .open = epoll_open,
+        .close = epoll_close,
+        .add = epoll_add,
+        .modify = epoll_modify,
+        .remove = epoll_remove,
+        .release = NULL,
+        .wait = epoll_wait_events
+};
+
+// io_uring with one shot poll requests, which are armed again when a wait starts,
+// so changes of interest go with the wait in one system call instead of one epoll_ctl each.
+// The sockets are still read and written by the session code with system calls.
+// A poll request keeps its socket open, so sockets are released before closing.
+
+struct uring_poll {
+    int fd;
+    uint32_t events;
+    void *data;
+    int armed; // completion pending
+    int removed; // freed with its completion
+    int queued; // to arm
+    struct uring_poll *qnext;
+    struct uring_poll *prev;
+    struct uring_poll *next;
+};
+
+struct uring_events {
+    struct uring ring;
+    struct uring_poll **poll; // by file descriptor
+    int size;
+    struct uring_poll *all;
+    struct uring_poll *queue; // to arm
+};
+
+static struct io_uring_sqe *get_event_sqe(struct event_loop *loop) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    struct io_uring_sqe *sqe = get_uring_sqe(&ue->ring);
+    if (sqe == NULL && submit_uring(&ue->ring, 0) >= 0) {
+        loop->syscalls++;
+        sqe = get_uring_sqe(&ue->ring);
+    }
+    return sqe;
+}
+
+static void free_uring_poll(struct uring_events *ue, struct uring_poll *p) {
+    if (p->prev == NULL)
+        ue->all = p->next;
+    else
+        p->prev->next = p->next;
+    if (p->next != NULL)
+        p->next->prev = p->prev;
+    ng_free(p, __FILE__, __LINE__);
+}
+
+static void queue_uring_poll(struct uring_events *ue, struct uring_poll *p) {
+    if (!p->queued) {
+        p->queued = 1;
+        p->qnext = ue->queue;
+        ue->queue = p;
+    }
+}
+
+static int uring_open(struct event_loop *loop) {
+    struct uring_events *ue = ng_calloc(1, sizeof(struct uring_events), "uring events");
+    if (init_uring(&ue->ring, EVENT_URING)) {
+        ng_free(ue, __FILE__, __LINE__);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Waiting with a timeout needs Linux 5.11
+    if (!(ue->ring.features & IORING_FEAT_EXT_ARG) || !(ue->ring.features & IORING_FEAT_NODROP)) {
+        log_android(ANDROID_LOG_WARN, "io_uring features %x", ue->ring.features);
+        free_uring(&ue->ring);
+        ng_free(ue, __FILE__, __LINE__);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    loop->fd = ue->ring.fd;
+    loop->state = ue;
+    return 0;
+}
+
+static void uring_close(struct event_loop *loop) {
+    // Closing the ring cancels the poll requests
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    if (ue == NULL)
+        return;
+    free_uring(&ue->ring);
+    while (ue->all != NULL)
+        free_uring_poll(ue, ue->all);
+    if (ue->poll != NULL)
+        ng_free(ue->poll, __FILE__, __LINE__);
+    ng_free(ue, __FILE__, __LINE__);
+    loop->state = NULL;
+    loop->fd = -1;
+}
+
+static int uring_add(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fd < ue->size && ue->poll[fd] != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (fd >= ue->size) {
+        int size = (ue->size == 0 ? 64 : ue->size);
+        while (size <= fd)
+            size *= 2;
+        ue->poll = ng_realloc(ue->poll, size * sizeof(struct uring_poll *), "uring polls");
+        memset(ue->poll + ue->size, 0, (size - ue->size) * sizeof(struct uring_poll *));
+        ue->size = size;
+    }
+
+    struct uring_poll *p = ng_calloc(1, sizeof(struct uring_poll), "uring poll");
+    p->fd = fd;
+    p->events = events;
+    p->data = data;
+    p->next = ue->all;
+    if (ue->all != NULL)
+        ue->all->prev = p;
+    ue->all = p;
+    ue->poll[fd] = p;
+    queue_uring_poll(ue, p);
+    return 0;
+}
+
+static int uring_remove(struct event_loop *loop, int fd) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    struct uring_poll *p = (fd >= 0 && fd < ue->size ? ue->poll[fd] : NULL);
+    if (p == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    ue->poll[fd] = NULL;
+    p->removed = 1;
+
+    if (p->armed) {
+        // Cancel, the completion frees the poll
+        struct io_uring_sqe *sqe = get_event_sqe(loop);
+        if (sqe == NULL) {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) p;
+        sqe->user_data = 0;
+    } else if (!p->queued)
+        free_uring_poll(ue, p);
+    return 0;
+}
+
+static int uring_modify(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    struct uring_poll *p = (fd >= 0 && fd < ue->size ? ue->poll[fd] : NULL);
+    if (p == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Not armed polls are armed with the new interest
+    if (!p->armed) {
+        p->events = events;
+        p->data = data;
+        return 0;
+    }
+    if (uring_remove(loop, fd))
+        return -1;
+    return uring_add(loop, fd, events, data);
+}
+
+static void uring_release(struct event_loop *loop, int fd) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    if (fd >= 0 && fd < ue->size && ue->poll[fd] != NULL && uring_remove(loop, fd))
+        log_android(ANDROID_LOG_ERROR, "io_uring release %d error %d: %s",
+                    fd, errno, strerror(errno));
+}
+
+static int uring_reap(struct event_loop *loop, struct event *ev, int maxevents) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+    int ready = 0;
+    struct io_uring_cqe *cqe;
+    while (ready < maxevents && (cqe = peek_uring_cqe(&ue->ring)) != NULL) {
+        struct uring_poll *p = (struct uring_poll *) (uintptr_t) cqe->user_data;
+        int32_t res = cqe->res;
+        seen_uring_cqe(&ue->ring);
+        if (p == NULL)
+            continue; // poll remove
+
+        p->armed = 0;
+        if (p->removed) {
+            if (!p->queued)
+                free_uring_poll(ue, p);
+            continue;
+        }
+
+        if (res > 0) {
+            ev[ready].events = (uint32_t) res;
+            ev[ready].data = p->data;
+            ready++;
+        } else if (res < 0)
+            log_android(ANDROID_LOG_WARN, "io_uring poll %d error %d: %s",
+                        p->fd, -res, strerror(-res));
+        queue_uring_poll(ue, p);
+    }
+    return ready;
+}
+
+static int uring_wait(struct event_loop *loop, struct event *ev, int maxevents, int timeout) {
+    struct uring_events *ue = (struct uring_events *) loop->state;
+
+    // Arm the polls of new sockets and sockets which were ready
+    int armed = 0;
+    while (ue->queue != NULL) {
+        struct uring_poll *p = ue->queue;
+        if (p->removed) {
+            ue->queue = p->qnext;
+            p->queued = 0;
+            if (!p->armed)
+                free_uring_poll(ue, p);
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = get_event_sqe(loop);
+        if (sqe == NULL)
+            return -1;
+        ue->queue = p->qnext;
+        p->queued = 0;
+        p->armed = 1;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = p->fd;
+        sqe->poll_events = (uint16_t) (p->events & ~EVENT_ET);
+        sqe->user_data = (uint64_t) (uintptr_t) p;
+        armed++;
+    }
+
+    int ready = uring_reap(loop, ev, maxevents);
+    if (ready == 0 || armed ||
+        ue->ring.sq_local != __atomic_load_n(ue->ring.sq_head, __ATOMIC_ACQUIRE)) {
+        int res = wait_uring(&ue->ring, (ready == 0 && timeout != 0 ? 1 : 0), timeout);
+        loop->syscalls++;
+        if (res < 0)
+            return (ready > 0 ? ready : -1);
+        ready += uring_reap(loop, ev + ready, maxevents - ready);
+    }
+    return ready;
+}
+
+const struct event_backend uring_backend = {
+        .name = "io_uring",
+        .open = uring_open,
+        .close = uring_close,
+        .add = uring_add,
+        .modify = uring_modify,
+        .remove = uring_remove,
+        .release = uring_release,
+        .wait = uring_wait
+};
+
+int open_event_loop(struct event_loop *loop, const struct event_backend *backend) {
+    memset(loop, 0, sizeof(struct event_loop));
+    loop->backend = backend;
+    loop->fd = -1;
+    return backend->open(loop);
+}
+
+void close_event_loop(struct event_loop *loop) {
+    if (loop->backend == NULL)
+        return;
+    loop->backend->close(loop);
+    if (loop->buffer != NULL)
+        ng_free(loop->buffer, __FILE__, __LINE__);
+    memset(loop, 0, sizeof(struct event_loop));
+    loop->fd = -1;
+}
+
+int register_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    return loop->backend->add(loop, fd, events, data);
+}
+
+int modify_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    return loop->backend->modify(loop, fd, events, data);
+}
+
+int unregister_event(struct event_loop *loop, int fd) {
+    return loop->backend->remove(loop, fd);
+}
+
+void release_event(struct event_loop *loop, int fd) {
+    if (loop->backend != NULL && loop->backend->release != NULL)
+        loop->backend->release(loop, fd);
+}
+
+int wait_events(struct event_loop *loop, struct event *ev, int maxevents, int timeout) {
+    return loop->backend->wait(loop, ev, maxevents, timeout);
+}
@@ -19,7 +19,6 @@
 
 #include "netguard.h"
 
-extern FILE *pcap_file;
 
 int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions) {
     int timeout = ICMP_TIMEOUT;
@@ -48,6 +47,7 @@ int check_icmp_session(const struct arguments *args, struct ng_session *s,
         log_android(ANDROID_LOG_WARN, "ICMP idle %d/%d sec stop %d from %s to %s",
                     now - s->icmp.time, timeout, s->icmp.stop, dest, source);
 
+        release_event(&args->worker->loop, s->socket);
         if (close(s->socket))
             log_android(ANDROID_LOG_ERROR, "ICMP close %d error %d: %s",
                         s->socket, errno, strerror(errno));
@@ -59,11 +59,11 @@ int check_icmp_session(const struct arguments *args, struct ng_session *s,
     return 0;
 }
 
-void check_icmp_socket(const struct arguments *args, const struct epoll_event *ev) {
-    struct ng_session *s = (struct ng_session *) ev->data.ptr;
+void check_icmp_socket(const struct arguments *args, const struct event *ev) {
+    struct ng_session *s = (struct ng_session *) ev->data;
 
     // Check socket error
-    if (ev->events & EPOLLERR) {
+    if (ev->events & EVENT_ERR) {
         s->icmp.time = time(NULL);
 
         int serr = 0;
@@ -79,7 +79,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
         s->icmp.stop = 1;
     } else {
         // Check socket read
-        if (ev->events & EPOLLIN) {
+        if (ev->events & EVENT_IN) {
             s->icmp.time = time(NULL);
 
             uint16_t blen = (uint16_t) (s->icmp.version == 4 ? ICMP4_MAXMSG : ICMP6_MAXMSG);
@@ -116,21 +116,25 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
                         s->icmp.id, icmp->icmp_id, icmp->icmp_seq);
 
                 // restore original ID
+                uint16_t id = icmp->icmp_id;
                 icmp->icmp_id = s->icmp.id;
-                uint16_t csum = 0;
-                if (s->icmp.version == 6) {
+                if (s->icmp.version == 4)
+                    icmp->icmp_cksum = update_checksum(icmp->icmp_cksum,
+                                                       &id, &icmp->icmp_id, 2);
+                else {
                     // Untested
+                    // The pseudo header changes from the real to the tun address
                     struct ip6_hdr_pseudo pseudo;
                     memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
                     memcpy(&pseudo.ip6ph_src, &s->icmp.daddr.ip6, 16);
                     memcpy(&pseudo.ip6ph_dst, &s->icmp.saddr.ip6, 16);
-                    pseudo.ip6ph_len = bytes - sizeof(struct ip6_hdr);
+                    pseudo.ip6ph_len = htonl((uint32_t) bytes);
                     pseudo.ip6ph_nxt = IPPROTO_ICMPV6;
-                    csum = calc_checksum(
+                    uint16_t csum = calc_checksum(
                             0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+                    icmp->icmp_cksum = 0;
+                    icmp->icmp_cksum = ~calc_checksum(csum, buffer, (size_t) bytes);
                 }
-                icmp->icmp_cksum = 0;
-                icmp->icmp_cksum = ~calc_checksum(csum, buffer, (size_t) bytes);
 
                 // Forward to tun
                 if (write_icmp(args, &s->icmp, buffer, (size_t) bytes) < 0)
@@ -144,8 +148,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
 jboolean handle_icmp(const struct arguments *args,
                      const uint8_t *pkt, size_t length,
                      const uint8_t *payload,
-                     int uid,
-                     const int epoll_fd) {
+                     int uid) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -170,15 +173,13 @@ jboolean handle_icmp(const struct arguments *args,
     }
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !((cur->protocol == IPPROTO_ICMP || cur->protocol == IPPROTO_ICMPV6) &&
-             !cur->icmp.stop && cur->icmp.version == version &&
-             (version == 4 ? cur->icmp.saddr.ip4 == ip4->saddr &&
-                             cur->icmp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->icmp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->icmp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct session_key key;
+    get_packet_key(&key, pkt, (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6), 0, 0);
+    struct ng_session *cur = find_session(args->worker, &key);
+    if (cur != NULL && cur->icmp.stop)
+        cur = NULL;
+    if (cur != NULL)
+        activate_session(args->worker, cur); // state might change
 
     // Create new session if needed
     if (cur == NULL) {
@@ -204,6 +205,7 @@ jboolean handle_icmp(const struct arguments *args,
 
         s->icmp.stop = 0;
         s->next = NULL;
+        init_tun_header(&s->icmp.header, version, s->protocol, &s->icmp.daddr, &s->icmp.saddr);
 
         // Open UDP socket
         s->socket = open_icmp_socket(args, &s->icmp);
@@ -215,34 +217,20 @@ jboolean handle_icmp(const struct arguments *args,
         log_android(ANDROID_LOG_DEBUG, "ICMP socket %d id %x", s->socket, s->icmp.id);
 
         // Monitor events
-        memset(&s->ev, 0, sizeof(struct epoll_event));
-        s->ev.events = EPOLLIN | EPOLLERR;
-        s->ev.data.ptr = s;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
-            log_android(ANDROID_LOG_ERROR, "epoll add icmp error %d: %s", errno, strerror(errno));
+        s->events = EVENT_IN | EVENT_ERR;
+        if (register_event(&args->worker->loop, s->socket, s->events, s))
+            log_android(ANDROID_LOG_ERROR, "event add icmp error %d: %s", errno, strerror(errno));
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->worker, s);
 
         cur = s;
     }
 
     // Modify ID
     // http://lwn.net/Articles/443051/
+    uint16_t id = icmp->icmp_id;
     icmp->icmp_id = ~icmp->icmp_id;
-    uint16_t csum = 0;
-    if (version == 6) {
-        // Untested
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
-    icmp->icmp_cksum = 0;
-    icmp->icmp_cksum = ~calc_checksum(csum, (uint8_t *) icmp, icmplen);
+    icmp->icmp_cksum = update_checksum(icmp->icmp_cksum, &id, &icmp->icmp_id, 2);
 
     log_android(ANDROID_LOG_INFO,
                 "ICMP forward from tun %s to %s type %d code %d id %x seq %d data %d",
@@ -297,49 +285,15 @@ int open_icmp_socket(const struct arguments *args, const struct icmp_session *cu
 
 ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
                    uint8_t *data, size_t datalen) {
-    size_t len;
-    u_int8_t *buffer;
+    uint32_t buffer[sizeof(struct ip6_hdr) / 4];
     struct icmp *icmp = (struct icmp *) data;
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
 
-    // Build packet
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + datalen;
-        buffer = ng_malloc(len, "icmp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr), data, datalen);
-
-        // Build IP4 header
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_ICMP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        // Calculate IP4 checksum
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-    } else {
-        len = sizeof(struct ip6_hdr) + datalen;
-        buffer = ng_malloc(len, "icmp write6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr), data, datalen);
-
-        // Build IP6 header
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = 0;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_ICMPV6;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-    }
+    // Build IP header, the message is written from where it is
+    uint16_t csum;
+    size_t hlen = build_tun_header(&cur->header, (uint8_t *) buffer, datalen, &csum);
+    size_t len = hlen + datalen;
 
     inet_ntop(cur->version == 4 ? AF_INET : AF_INET6,
               cur->version == 4 ? (const void *) &cur->saddr.ip4 : (const void *) &cur->saddr.ip6,
@@ -354,17 +308,15 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
                 args->tun, dest, source, datalen,
                 icmp->icmp_type, icmp->icmp_code, icmp->icmp_id, icmp->icmp_seq);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write PCAP record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
+    struct iovec iov[2];
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = data;
+    iov[1].iov_len = datalen;
+    ssize_t res = write_tun(args, iov, 2);
+    if (res < 0)
         log_android(ANDROID_LOG_WARN, "ICMP write error %d: %s", errno, strerror(errno));
 
-    ng_free(buffer, __FILE__, __LINE__);
-
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
         return -1;
@@ -20,6 +20,8 @@
 #include "netguard.h"
 
 int max_tun_msg = 0;
+static pthread_mutex_t uid_lock = PTHREAD_MUTEX_INITIALIZER; // workers share the uid cache
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER; // and the /proc snapshots
 extern int loglevel;
 extern FILE *pcap_file;
 
@@ -34,67 +36,661 @@ uint16_t get_default_mss(int version) {
         return (uint16_t) (get_mtu() - sizeof(struct ip6_hdr) - sizeof(struct tcphdr));
 }
 
-int check_tun(const struct arguments *args,
-              const struct epoll_event *ev,
-              const int epoll_fd,
-              int sessions, int maxsessions) {
-    // Check tun error
-    if (ev->events & EPOLLERR) {
-        log_android(ANDROID_LOG_ERROR, "tun %d exception", args->tun);
-        if (fcntl(args->tun, F_GETFL) < 0) {
-            log_android(ANDROID_LOG_ERROR, "fcntl tun %d F_GETFL error %d: %s",
-                        args->tun, errno, strerror(errno));
-            report_exit(args, "fcntl tun %d F_GETFL error %d: %s",
+void init_tun_header(struct tun_header *header, int version, uint8_t protocol,
+                     const void *saddr, const void *daddr) {
+    memset(header, 0, sizeof(struct tun_header));
+    if (version == 4) {
+        struct iphdr *ip4 = &header->ip4;
+        ip4->version = 4;
+        ip4->ihl = sizeof(struct iphdr) >> 2;
+        ip4->ttl = IPDEFTTL;
+        ip4->protocol = protocol;
+        memcpy(&ip4->saddr, saddr, 4);
+        memcpy(&ip4->daddr, daddr, 4);
+        header->ipsum = calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
+
+        struct ippseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ippseudo));
+        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
+        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
+        pseudo.ippseudo_p = protocol;
+        header->pseudo = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
+    } else {
+        struct ip6_hdr *ip6 = &header->ip6;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = protocol;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
+        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
+        memcpy(&(ip6->ip6_src), saddr, 16);
+        memcpy(&(ip6->ip6_dst), daddr, 16);
+
+        struct ip6_hdr_pseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
+        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
+        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
+        pseudo.ip6ph_nxt = protocol;
+        header->pseudo = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+    }
+}
+
+size_t build_tun_header(const struct tun_header *header, uint8_t *buffer,
+                        size_t plen, uint16_t *csum) {
+    // Only the length and the checksums depend on the packet
+    uint16_t len;
+    if (header->ip4.version == 4) {
+        struct iphdr *ip4 = (struct iphdr *) buffer;
+        memcpy(ip4, &header->ip4, sizeof(struct iphdr));
+        ip4->tot_len = htons(sizeof(struct iphdr) + plen);
+        ip4->check = ~calc_checksum(header->ipsum, (uint8_t *) &ip4->tot_len, 2);
+
+        len = htons(plen);
+        *csum = calc_checksum(header->pseudo, (uint8_t *) &len, 2);
+        return sizeof(struct iphdr);
+    } else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
+        memcpy(ip6, &header->ip6, sizeof(struct ip6_hdr));
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(plen);
+
+        len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
+        *csum = calc_checksum(header->pseudo, (uint8_t *) &len, 2);
+        return sizeof(struct ip6_hdr);
+    }
+}
+
+static int is_queue_full(const struct packet_queue *q) {
+    return (q->head - __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) >= PACKET_QUEUE);
+}
+
+static int is_queue_empty(const struct packet_queue *q) {
+    return (q->head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST));
+}
+
+// Wait for the tun writer to drain the queue of the worker, or only for one free slot
+// Blocks like a blocking tun write would, packets are only given up when stopping
+static int wait_tun_writer(const struct arguments *args, int all) {
+    struct tun_writer *wr = &args->ctx->writer;
+    struct packet_queue *q = &args->worker->out;
+
+    flush_tun(args);
+
+    if (pthread_mutex_lock(&wr->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    __atomic_add_fetch(&wr->waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&wr->stalls, 1, __ATOMIC_RELAXED);
+    while ((all ? !is_queue_empty(q) : is_queue_full(q)) && !args->ctx->stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TUN_WRITE_WAIT / 1000;
+        ts.tv_nsec += (TUN_WRITE_WAIT % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wr->space, &wr->lock, &ts);
+    }
+    __atomic_sub_fetch(&wr->waiting, 1, __ATOMIC_SEQ_CST);
+    if (pthread_mutex_unlock(&wr->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+    return (all ? is_queue_empty(q) : !is_queue_full(q)) ? 0 : -1;
+}
+
+ssize_t write_tun(const struct arguments *args, const struct iovec *iov, int iovcnt) {
+    struct packet_queue *q = &args->worker->out;
+    uint16_t mtu = get_mtu();
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    ssize_t res;
+    if (!args->ctx->writer.running || len > mtu) {
+        // Write directly, after queued packets
+        if (args->ctx->writer.running && wait_tun_writer(args, 1) < 0) {
+            __atomic_add_fetch(&args->ctx->writer.dropped, 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return -1;
+        }
+        res = writev(args->tun, iov, iovcnt);
+    } else {
+        // Queue for the tun writer, wait for space
+        if (is_queue_full(q) && wait_tun_writer(args, 0) < 0) {
+            __atomic_add_fetch(&args->ctx->writer.dropped, 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return -1;
+        }
+
+        uint32_t head = q->head;
+        uint32_t slot = head & (PACKET_QUEUE - 1);
+        uint8_t *buffer = q->buffer + slot * mtu;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+            buffer += iov[i].iov_len;
+        }
+        q->length[slot] = len;
+        q->time[slot] = get_us();
+        __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+        args->worker->out_pending = 1;
+        res = len;
+    }
+
+    // Write pcap record
+    if (res >= 0 && pcap_file != NULL)
+        write_pcap_iov(iov, iovcnt, (size_t) res);
+
+    return res;
+}
+
+void flush_tun(const struct arguments *args) {
+    // Signal the tun writer once per batch of queued packets
+    if (args->worker->out_pending) {
+        args->worker->out_pending = 0;
+        uint64_t one = 1;
+        if (write(args->ctx->writer.wakefd, &one, sizeof(one)) < 0)
+            log_android(ANDROID_LOG_WARN, "tun writer wake error %d: %s",
+                        errno, strerror(errno));
+    }
+}
+
+static void release_tun_queue(struct tun_writer *wr, struct packet_queue *q, uint32_t tail) {
+    // Release the slots, then let waiting workers continue
+    if (q->tail == tail)
+        return;
+    __atomic_store_n(&q->tail, tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wr->waiting, __ATOMIC_SEQ_CST)) {
+        if (pthread_mutex_lock(&wr->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        pthread_cond_broadcast(&wr->space);
+        if (pthread_mutex_unlock(&wr->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    }
+}
+
+static int drain_tun_queue(const struct arguments *args, struct packet_queue *q) {
+    // Returns 1 if tun was not writable, the remaining packets stay queued
+    struct tun_writer *wr = &args->ctx->writer;
+    uint16_t mtu = get_mtu();
+    long long now = get_us();
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = q->tail;
+    if (tail == head)
+        return 0;
+
+    int blocked = 0;
+    while (tail != head) {
+        uint32_t slot = tail & (PACKET_QUEUE - 1);
+        ssize_t res = write(args->tun, q->buffer + slot * mtu, q->length[slot]);
+        wr->syscalls++;
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The packets were accepted already and will not be sent again
+                wr->retries++;
+                blocked = 1;
+                break;
+            }
+            log_android(ANDROID_LOG_WARN, "tun %d write error %d: %s",
                         args->tun, errno, strerror(errno));
-        } else
-            report_exit(args, "tun %d exception", args->tun);
+            __atomic_add_fetch(&wr->dropped, 1, __ATOMIC_RELAXED);
+        } else if (res != q->length[slot])
+            log_android(ANDROID_LOG_ERROR, "tun write %d/%d", res, q->length[slot]);
+
+        uint32_t delay = (uint32_t) (now > q->time[slot] ? now - q->time[slot] : 0);
+        q->delay += delay;
+        if (delay > q->delay_max)
+            q->delay_max = delay;
+        q->dequeued++;
+        wr->packets++;
+        tail++;
+    }
+
+    release_tun_queue(wr, q, tail);
+    return blocked;
+}
+
+static int fall_back_tun_writes(const struct arguments *args) {
+    // Prepared submissions go with the ring, the packets are still queued
+    struct context *ctx = args->ctx;
+    free_uring(&ctx->writer.uring);
+    ctx->writer.use_uring = 0;
+    log_android(ANDROID_LOG_WARN, "tun writer continues with write()");
+
+    int blocked = 0;
+    for (int i = 0; i < ctx->nworkers && !blocked; i++)
+        blocked = drain_tun_queue(args, &ctx->worker[i].out);
+    return blocked;
+}
+
+// All queued packets in one submission from the registered queue buffers,
+// linked per worker to keep their order, which also makes the writes sequential.
+// Returns 1 if tun was not writable, the remaining packets stay queued
+static int drain_tun_queues_uring(const struct arguments *args) {
+    struct context *ctx = args->ctx;
+    struct tun_writer *wr = &ctx->writer;
+    uint16_t mtu = get_mtu();
+
+    uint32_t head[WORKERS_MAX];
+    uint32_t first[WORKERS_MAX]; // first failed write
+    int error[WORKERS_MAX];
+    unsigned count = 0;
+    for (int i = 0; i < ctx->nworkers; i++) {
+        struct packet_queue *q = &ctx->worker[i].out;
+        head[i] = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        first[i] = head[i] - q->tail;
+        error[i] = 0;
+        for (uint32_t tail = q->tail; tail != head[i]; tail++) {
+            uint32_t slot = tail & (PACKET_QUEUE - 1);
+            struct io_uring_sqe *sqe = get_uring_sqe(&wr->uring);
+            if (sqe == NULL) {
+                log_android(ANDROID_LOG_ERROR, "io_uring submission queue full");
+                return fall_back_tun_writes(args);
+            }
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->fd = args->tun;
+            sqe->addr = (uint64_t) (uintptr_t) (q->buffer + slot * mtu);
+            sqe->len = (uint32_t) q->length[slot];
+            sqe->buf_index = (uint16_t) i;
+            sqe->flags = (tail + 1 != head[i] ? IOSQE_IO_LINK : 0);
+            sqe->user_data = ((uint64_t) i << 32) | (tail - q->tail);
+            count++;
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    // Submit and wait for the writes in one system call
+    int res = submit_uring(&wr->uring, count);
+    wr->syscalls++;
+    if (res < 0)
+        return fall_back_tun_writes(args);
+
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_cqe *cqe = peek_uring_cqe(&wr->uring);
+        if (cqe == NULL)
+            break;
+        int w = (int) (cqe->user_data >> 32);
+        uint32_t index = (uint32_t) cqe->user_data;
+        struct packet_queue *q = &ctx->worker[w].out;
+        size_t length = q->length[(q->tail + index) & (PACKET_QUEUE - 1)];
+        if (cqe->res < 0) {
+            if (index < first[w]) {
+                first[w] = index;
+                error[w] = -cqe->res;
+            }
+        } else if ((size_t) cqe->res != length)
+            log_android(ANDROID_LOG_ERROR, "tun write %d/%d", cqe->res, (int) length);
+        seen_uring_cqe(&wr->uring);
+    }
+
+    // A failed write cancels the rest of the chain, which stays queued
+    int blocked = 0;
+    long long now = get_us();
+    for (int i = 0; i < ctx->nworkers; i++) {
+        struct packet_queue *q = &ctx->worker[i].out;
+        uint32_t done = q->tail + first[i];
+        if (error[i] == EAGAIN || error[i] == EWOULDBLOCK) {
+            wr->retries++;
+            blocked = 1;
+        } else if (error[i] != 0 && error[i] != ECANCELED) {
+            log_android(ANDROID_LOG_WARN, "tun %d io_uring write error %d: %s",
+                        args->tun, error[i], strerror(error[i]));
+            __atomic_add_fetch(&wr->dropped, 1, __ATOMIC_RELAXED);
+            done++;
+        }
+
+        for (uint32_t tail = q->tail; tail != done; tail++) {
+            uint32_t slot = tail & (PACKET_QUEUE - 1);
+            uint32_t delay = (uint32_t) (now > q->time[slot] ? now - q->time[slot] : 0);
+            q->delay += delay;
+            if (delay > q->delay_max)
+                q->delay_max = delay;
+            q->dequeued++;
+            wr->packets++;
+        }
+        release_tun_queue(wr, q, done);
+    }
+    return blocked;
+}
+
+// Tun writer thread, no JNI
+static void *write_tun_queues(void *data) {
+    struct arguments *args = (struct arguments *) data;
+    struct context *ctx = args->ctx;
+    struct tun_writer *wr = &ctx->writer;
+
+    log_android(ANDROID_LOG_WARN, "Start tun writer tun=%d", args->tun);
+
+    // Optionally io_uring with the queue buffers registered
+    // and room for every queued packet, else write()
+    wr->use_uring = 0;
+    if (ctx->uring && init_uring(&wr->uring, PACKET_QUEUE * WORKERS_MAX) == 0) {
+        struct iovec iov[WORKERS_MAX];
+        for (int i = 0; i < ctx->nworkers; i++) {
+            iov[i].iov_base = ctx->worker[i].out.buffer;
+            iov[i].iov_len = PACKET_QUEUE * get_mtu();
+        }
+        if (wr->uring.sq_entries >= PACKET_QUEUE * WORKERS_MAX &&
+            register_uring_buffers(&wr->uring, iov, (unsigned) ctx->nworkers) == 0)
+            wr->use_uring = 1;
+        else
+            free_uring(&wr->uring);
+    }
+    log_android(ANDROID_LOG_WARN, "tun writer io_uring %d", wr->use_uring);
+
+    // Queued packets or, when tun was not writable, tun
+    struct pollfd pfd[2];
+    pfd[0].fd = wr->wakefd;
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLOUT;
+    int blocked = 0;
+    for (;;) {
+        // Drain once more after the workers stopped, as long as tun takes packets
+        int stop = __atomic_load_n(&wr->stop, __ATOMIC_ACQUIRE);
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+        pfd[1].fd = (blocked ? args->tun : -1);
+        if (!stop || blocked) {
+            int ready = (stop ? poll(&pfd[1], 1, TUN_WRITE_WAIT) : poll(pfd, 2, -1));
+            if (ready < 0) {
+                if (errno != EINTR)
+                    log_android(ANDROID_LOG_ERROR, "tun writer poll error %d: %s",
+                                errno, strerror(errno));
+                continue;
+            }
+            if (ready == 0) {
+                log_android(ANDROID_LOG_WARN, "tun writer stopped with tun not writable");
+                break;
+            }
+
+            uint64_t count;
+            if (pfd[0].revents &&
+                read(wr->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                log_android(ANDROID_LOG_WARN, "tun writer read error %d: %s",
+                            errno, strerror(errno));
+        }
+
+        wr->wakeups++;
+        blocked = 0;
+        if (wr->use_uring)
+            blocked = drain_tun_queues_uring(args);
+        else
+            // Starting with another worker each time, so a slow tun does not favor one
+            for (int i = 0; i < ctx->nworkers && !blocked; i++) {
+                int w = (int) ((wr->wakeups + i) % ctx->nworkers);
+                blocked = drain_tun_queue(args, &ctx->worker[w].out);
+            }
+
+        if (stop && !blocked)
+            break;
+    }
+
+    if (wr->use_uring)
+        free_uring(&wr->uring);
+    wr->use_uring = 0;
+
+    log_android(ANDROID_LOG_WARN, "Stopped tun writer tun=%d", args->tun);
+    ng_free(args, __FILE__, __LINE__);
+    return NULL;
+}
+
+int start_tun_writer(const struct arguments *args) {
+    struct context *ctx = args->ctx;
+    struct tun_writer *wr = &ctx->writer;
+    wr->stop = 0;
+    wr->waiting = 0;
+    for (int i = 0; i < ctx->nworkers; i++) {
+        init_worker(ctx, i);
+        ctx->worker[i].out.head = 0;
+        ctx->worker[i].out.tail = 0;
+        ctx->worker[i].out_pending = 0;
+    }
+
+    // No JNI, only tun and the context
+    struct arguments *wargs = ng_malloc(sizeof(struct arguments), "arguments");
+    memcpy(wargs, args, sizeof(struct arguments));
+    wargs->env = NULL;
+    wargs->instance = NULL;
+
+    int err = pthread_create(&wr->thread, NULL, write_tun_queues, wargs);
+    if (err) {
+        log_android(ANDROID_LOG_ERROR, "tun writer pthread_create error %d: %s",
+                    err, strerror(err));
+        ng_free(wargs, __FILE__, __LINE__);
         return -1;
     }
+    wr->running = 1;
+    return 0;
+}
 
-    // Check tun read
-    if (ev->events & EPOLLIN) {
-        uint8_t *buffer = ng_malloc(get_mtu(), "tun read");
-        ssize_t length = read(args->tun, buffer, get_mtu());
-        if (length < 0) {
-            ng_free(buffer, __FILE__, __LINE__);
+void stop_tun_writer(struct context *ctx) {
+    struct tun_writer *wr = &ctx->writer;
+    if (!wr->running)
+        return;
+
+    __atomic_store_n(&wr->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(wr->wakefd, &one, sizeof(one)) < 0)
+        log_android(ANDROID_LOG_WARN, "tun writer wake error %d: %s", errno, strerror(errno));
+
+    int err = pthread_join(wr->thread, NULL);
+    if (err)
+        log_android(ANDROID_LOG_ERROR, "tun writer pthread_join error %d: %s",
+                    err, strerror(err));
+    wr->running = 0;
+}
 
-            log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
+// Tun reader thread, no JNI, failures are reported by worker 0
+static void *read_tun(void *data) {
+    struct arguments *args = (struct arguments *) data;
+    struct context *ctx = args->ctx;
+    struct tun_reader *r = &ctx->reader;
+    struct worker *w = &ctx->worker[0];
+    struct packet_queue *q = &w->queue;
+    struct tun_stats *stats = &ctx->tun_stats;
+    uint16_t mtu = get_mtu();
+
+    log_android(ANDROID_LOG_WARN, "Start tun reader tun=%d", args->tun);
+
+    struct pollfd fds[2];
+    fds[0].fd = args->tun;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->wakefd;
+    fds[1].events = POLLIN;
+
+    while (!ctx->stopping) {
+        // Stop reading tun while the queue is full, the kernel queues meanwhile
+        int full = is_queue_full(q);
+        if (full) {
+            __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+            full = is_queue_full(q); // worker 0 might have drained meanwhile
+            if (!full)
+                __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+        }
+        fds[0].fd = (full ? -1 : args->tun);
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_android(ANDROID_LOG_ERROR, "tun %d poll error %d: %s",
                         args->tun, errno, strerror(errno));
-            if (errno == EINTR || errno == EAGAIN)
-                // Retry later
-                return 0;
-            else {
-                report_exit(args, "tun %d read error %d: %s",
-                            args->tun, errno, strerror(errno));
-                return -1;
-            }
-        } else if (length > 0) {
-            // Write pcap record
-            if (pcap_file != NULL)
-                write_pcap_rec(buffer, (size_t) length);
-
-            if (length > max_tun_msg) {
-                max_tun_msg = length;
-                log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
+            r->error = errno;
+            __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+            wake_worker(w);
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                log_android(ANDROID_LOG_WARN, "tun reader read error %d: %s",
+                            errno, strerror(errno));
+        }
+
+        if (fds[0].revents & (POLLERR | POLLNVAL)) {
+            r->error = -1;
+            __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+        } else if (fds[0].revents & POLLIN) {
+            // Read until drained or the queue is full
+            int count = 0;
+            while (!ctx->stopping) {
+                uint32_t head = q->head;
+                if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= PACKET_QUEUE) {
+                    stats->full++;
+                    break;
+                }
+
+                uint32_t slot = head & (PACKET_QUEUE - 1);
+                ssize_t length = read(args->tun, q->buffer + slot * mtu, mtu);
+                if (length < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break; // Drained
+
+                    r->error = errno;
+                    __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+                    break;
+                } else if (length == 0) {
+                    // tun eof
+                    r->error = 0;
+                    __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+                    break;
+                }
+
+                q->length[slot] = (size_t) length;
+                q->time[slot] = get_us();
+                __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+                // Let worker 0 start on the first batch
+                if (++count == TUN_YIELD)
+                    wake_worker(w);
             }
 
-            // Handle IP from tun
-            handle_ip(args, buffer, (size_t) length, epoll_fd, sessions, maxsessions);
+            stats->wakeups++;
+            stats->packets += count;
+            log_android(ANDROID_LOG_DEBUG, "tun read %d packets", count);
 
-            ng_free(buffer, __FILE__, __LINE__);
-        } else {
-            // tun eof
-            ng_free(buffer, __FILE__, __LINE__);
+            if (count > 0 && count != TUN_YIELD)
+                wake_worker(w);
+        }
 
-            log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
-            report_exit(args, "tun %d empty read", args->tun);
-            return -1;
+        if (__atomic_load_n(&r->failed, __ATOMIC_ACQUIRE)) {
+            wake_worker(w);
+            break;
         }
     }
 
+    log_android(ANDROID_LOG_WARN, "Stopped tun reader tun=%d", args->tun);
+    ng_free(args, __FILE__, __LINE__);
+    return NULL;
+}
+
+int start_tun_reader(const struct arguments *args) {
+    struct context *ctx = args->ctx;
+    struct tun_reader *r = &ctx->reader;
+    r->waiting = 0;
+    r->failed = 0;
+    r->error = 0;
+    ctx->worker[0].queue.head = 0;
+    ctx->worker[0].queue.tail = 0;
+
+    // No JNI, only tun and the context
+    struct arguments *rargs = ng_malloc(sizeof(struct arguments), "arguments");
+    memcpy(rargs, args, sizeof(struct arguments));
+    rargs->env = NULL;
+    rargs->instance = NULL;
+
+    int err = pthread_create(&r->thread, NULL, read_tun, rargs);
+    if (err) {
+        log_android(ANDROID_LOG_ERROR, "tun reader pthread_create error %d: %s",
+                    err, strerror(err));
+        ng_free(rargs, __FILE__, __LINE__);
+        return -1;
+    }
+    r->running = 1;
     return 0;
 }
 
+void stop_tun_reader(struct context *ctx) {
+    struct tun_reader *r = &ctx->reader;
+    if (!r->running)
+        return;
+
+    ctx->stopping = 1;
+    uint64_t one = 1;
+    if (write(r->wakefd, &one, sizeof(one)) < 0)
+        log_android(ANDROID_LOG_WARN, "tun reader wake error %d: %s", errno, strerror(errno));
+
+    int err = pthread_join(r->thread, NULL);
+    if (err)
+        log_android(ANDROID_LOG_ERROR, "tun reader pthread_join error %d: %s",
+                    err, strerror(err));
+    r->running = 0;
+}
+
+void handle_tun(const struct arguments *args,
+                const uint8_t *pkt, size_t length,
+                int sessions, int maxsessions,
+                int *wake) {
+    // Write pcap record
+    if (pcap_file != NULL)
+        write_pcap_rec(pkt, length);
+
+    if (length > max_tun_msg) {
+        max_tun_msg = length;
+        log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
+    }
+
+    // Handle IP from tun, or pass it on to the worker of the flow
+    int shard = get_shard(args->ctx, pkt, length);
+    if (shard == args->worker->id)
+        handle_ip(args, pkt, length, sessions, maxsessions);
+    else if (queue_packet(&args->ctx->worker[shard], pkt, length) == 0)
+        wake[shard] = 1;
+    else
+        log_android(ANDROID_LOG_WARN, "Worker %d queue full, dropping packet", shard);
+}
+
+void resume_tun_reader(struct context *ctx) {
+    // Called after releasing queue slots, the reader might wait for space
+    struct tun_reader *r = &ctx->reader;
+    if (__atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(r->wakefd, &one, sizeof(one)) < 0)
+            log_android(ANDROID_LOG_WARN, "tun reader wake error %d: %s",
+                        errno, strerror(errno));
+    }
+}
+
+int check_tun(const struct arguments *args) {
+    struct tun_reader *r = &args->ctx->reader;
+
+    // Report a failed read of the reader after the queued packets were handled
+    if (!__atomic_load_n(&r->failed, __ATOMIC_ACQUIRE))
+        return 0;
+
+    if (r->error < 0) {
+        log_android(ANDROID_LOG_ERROR, "tun %d exception", args->tun);
+        if (fcntl(args->tun, F_GETFL) < 0) {
+            log_android(ANDROID_LOG_ERROR, "fcntl tun %d F_GETFL error %d: %s",
+                        args->tun, errno, strerror(errno));
+            report_exit(args, "fcntl tun %d F_GETFL error %d: %s",
+                        args->tun, errno, strerror(errno));
+        } else
+            report_exit(args, "tun %d exception", args->tun);
+    } else if (r->error == 0) {
+        log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
+        report_exit(args, "tun %d empty read", args->tun);
+    } else {
+        log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
+                    args->tun, r->error, strerror(r->error));
+        report_exit(args, "tun %d read error %d: %s",
+                    args->tun, r->error, strerror(r->error));
+    }
+    return -1;
+}
+
 // https://en.wikipedia.org/wiki/IPv6_packet#Extension_headers
 // http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml
 int is_lower_layer(int protocol) {
@@ -116,9 +712,36 @@ int is_upper_layer(int protocol) {
             protocol == IPPROTO_ICMPV6);
 }
 
+size_t get_ip6_payload(const uint8_t *pkt, size_t length, uint8_t *protocol) {
+    // Skip extension headers, returns the offset of the upper layer header,
+    // or of the first extension header if there is none (ESP, later fragments)
+    const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *) pkt;
+    size_t off = sizeof(struct ip6_hdr);
+    uint8_t next = ip6hdr->ip6_nxt;
+    while (is_lower_layer(next) && next != IPPROTO_ESP && off + 8 <= length) {
+        const struct ip6_ext *ext = (const struct ip6_ext *) (pkt + off);
+        if (next == IPPROTO_FRAGMENT) {
+            const struct ip6_frag *frag = (const struct ip6_frag *) (pkt + off);
+            if (frag->ip6f_offlg & IP6F_OFF_MASK)
+                break;
+            off += sizeof(struct ip6_frag);
+        } else if (next == IPPROTO_AH)
+            off += (ext->ip6e_len + 2) * 4;
+        else
+            off += (ext->ip6e_len + 1) * 8;
+        next = ext->ip6e_nxt;
+    }
+
+    if (is_upper_layer(next) && off <= length) {
+        *protocol = next;
+        return off;
+    }
+    *protocol = ip6hdr->ip6_nxt;
+    return sizeof(struct ip6_hdr);
+}
+
 void handle_ip(const struct arguments *args,
                const uint8_t *pkt, const size_t length,
-               const int epoll_fd,
                int sessions, int maxsessions) {
     uint8_t protocol;
     void *saddr;
@@ -174,30 +797,15 @@ void handle_ip(const struct arguments *args,
         struct ip6_hdr *ip6hdr = (struct ip6_hdr *) pkt;
 
         // Skip extension headers
-        uint16_t off = 0;
-        protocol = ip6hdr->ip6_nxt;
-        if (!is_upper_layer(protocol)) {
-            log_android(ANDROID_LOG_WARN, "IP6 extension %d", protocol);
-            off = sizeof(struct ip6_hdr);
-            struct ip6_ext *ext = (struct ip6_ext *) (pkt + off);
-            while (is_lower_layer(ext->ip6e_nxt) && !is_upper_layer(protocol)) {
-                protocol = ext->ip6e_nxt;
-                log_android(ANDROID_LOG_WARN, "IP6 extension %d", protocol);
-
-                off += (8 + ext->ip6e_len);
-                ext = (struct ip6_ext *) (pkt + off);
-            }
-            if (!is_upper_layer(protocol)) {
-                off = 0;
-                protocol = ip6hdr->ip6_nxt;
-                log_android(ANDROID_LOG_WARN, "IP6 final extension %d", protocol);
-            }
-        }
+        size_t off = get_ip6_payload(pkt, length, &protocol);
+        if (ip6hdr->ip6_nxt != protocol)
+            log_android(ANDROID_LOG_WARN, "IP6 extension %d protocol %d offset %d",
+                        ip6hdr->ip6_nxt, protocol, off);
 
         saddr = &ip6hdr->ip6_src;
         daddr = &ip6hdr->ip6_dst;
 
-        payload = (uint8_t *) (pkt + sizeof(struct ip6_hdr) + off);
+        payload = (uint8_t *) (pkt + off);
 
         // TODO checksum
     } else {
@@ -269,10 +877,13 @@ void handle_ip(const struct arguments *args,
 
     flags[flen] = 0;
 
+    // Lookup session once
+    int udp_session = (protocol == IPPROTO_UDP && has_udp_session(args, pkt, payload));
+
     // Limit number of sessions
     if (sessions >= maxsessions) {
         if ((protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6) ||
-            (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+            (protocol == IPPROTO_UDP && !udp_session) ||
             (protocol == IPPROTO_TCP && syn)) {
             log_android(ANDROID_LOG_ERROR,
                         "%d of max %d sessions, dropping version %d protocol %d",
@@ -284,12 +895,28 @@ void handle_ip(const struct arguments *args,
     // Get uid
     jint uid = -1;
     if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6 ||
-        (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+        (protocol == IPPROTO_UDP && !udp_session) ||
         (protocol == IPPROTO_TCP && syn)) {
-        if (args->ctx->sdk <= 28) // Android 9 Pie
-            uid = get_uid(version, protocol, saddr, sport, daddr, dport);
-        else
-            uid = get_uid_q(args, version, protocol, source, sport, dest, dport);
+        if (pthread_mutex_lock(&uid_lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        uid = get_cached_uid(version, protocol, saddr, sport, daddr, dport);
+        if (pthread_mutex_unlock(&uid_lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+        // Look up without the lock, other workers should not wait for a slow lookup
+        if (uid < 0) {
+            if (args->ctx->sdk <= 28) // Android 9 Pie
+                uid = get_uid(args->worker, version, protocol, saddr, sport, daddr, dport);
+            else
+                uid = get_uid_q(args, version, protocol, source, sport, dest, dport);
+            if (uid >= 0) {
+                if (pthread_mutex_lock(&uid_lock))
+                    log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+                put_cached_uid(version, protocol, saddr, sport, daddr, dport, uid);
+                if (pthread_mutex_unlock(&uid_lock))
+                    log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+            }
+        }
     }
 
     log_android(ANDROID_LOG_DEBUG,
@@ -298,16 +925,30 @@ void handle_ip(const struct arguments *args,
 
     // Check if allowed
     int allowed = 0;
+    struct allowed verdict;
     struct allowed *redirect = NULL;
-    if (protocol == IPPROTO_UDP && has_udp_session(args, pkt, payload))
+    if (udp_session)
         allowed = 1; // could be a lingering/blocked session
     else if (protocol == IPPROTO_TCP && (!syn || (uid == 0 && dport == 53)))
         allowed = 1; // assume existing session
     else {
-        jobject objPacket = create_packet(
-                args, version, protocol, flags, source, sport, dest, dport, data, uid, 0);
-        redirect = is_address_allowed(args, objPacket);
-        allowed = (redirect != NULL);
+        // Upcall only if there is no cached verdict
+        struct verdict_key key;
+        uint32_t generation;
+        get_verdict_key(&key, version, protocol, daddr, dport, uid);
+        struct verdict *v = get_verdict(&args->worker->verdicts, &key, &generation);
+        if (v != NULL) {
+            allowed = v->allowed;
+            redirect = (allowed ? &v->redirect : NULL);
+            queue_verdict_log(args, v, flags, source, sport, data);
+        } else {
+            jobject objPacket = create_packet(
+                    args, version, protocol, flags, source, sport, dest, dport, data, uid, 0);
+            redirect = is_address_allowed(args, objPacket, &verdict);
+            allowed = (redirect != NULL);
+            if (uid != getuid()) // not logged
+                put_verdict(&args->worker->verdicts, &key, generation, redirect);
+        }
         if (redirect != NULL && (*redirect->raddr == 0 || redirect->rport == 0))
             redirect = NULL;
     }
@@ -315,11 +956,11 @@ void handle_ip(const struct arguments *args,
     // Handle allowed traffic
     if (allowed) {
         if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
-            handle_icmp(args, pkt, length, payload, uid, epoll_fd);
+            handle_icmp(args, pkt, length, payload, uid);
         else if (protocol == IPPROTO_UDP)
-            handle_udp(args, pkt, length, payload, uid, redirect, epoll_fd);
+            handle_udp(args, pkt, length, payload, uid, redirect);
         else if (protocol == IPPROTO_TCP)
-            handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd);
+            handle_tcp(args, pkt, length, payload, uid, allowed, redirect);
     } else {
         if (protocol == IPPROTO_UDP)
             block_udp(args, pkt, length, payload, uid);
@@ -329,7 +970,96 @@ void handle_ip(const struct arguments *args,
     }
 }
 
-jint get_uid(const int version, const int protocol,
+int uid_backend = UID_BACKEND_NONE;
+struct uid_cache uid_cache;
+
+static struct uid_cache_entry *get_uid_set(const int version, const int protocol,
+                                           const void *saddr, const uint16_t sport,
+                                           const void *daddr, const uint16_t dport) {
+    // FNV-1a
+    size_t alen = (version == 4 ? 4 : 16);
+    uint8_t key[6 + 2 * 16];
+    key[0] = (uint8_t) version;
+    key[1] = (uint8_t) protocol;
+    memcpy(key + 2, &sport, 2);
+    memcpy(key + 4, &dport, 2);
+    memcpy(key + 6, saddr, alen);
+    memcpy(key + 6 + alen, daddr, alen);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < 6 + 2 * alen; i++)
+        hash = (hash ^ key[i]) * 16777619u;
+    return uid_cache.entries[hash & (UID_CACHE_SETS - 1)];
+}
+
+static int is_uid_entry(const struct uid_cache_entry *e,
+                        const int version, const int protocol,
+                        const void *saddr, const uint16_t sport,
+                        const void *daddr, const uint16_t dport) {
+    size_t alen = (version == 4 ? 4 : 16);
+    return (e->time != 0 &&
+            e->sport == sport && e->dport == dport &&
+            e->version == version && e->protocol == protocol &&
+            memcmp(e->saddr, saddr, alen) == 0 && memcmp(e->daddr, daddr, alen) == 0);
+}
+
+jint get_cached_uid(const int version, const int protocol,
+                    const void *saddr, const uint16_t sport,
+                    const void *daddr, const uint16_t dport) {
+    long long now = get_ms();
+    struct uid_cache_entry *set = get_uid_set(version, protocol, saddr, sport, daddr, dport);
+    for (int w = 0; w < UID_CACHE_WAYS; w++) {
+        struct uid_cache_entry *e = &set[w];
+        if (is_uid_entry(e, version, protocol, saddr, sport, daddr, dport)) {
+            if (now - e->time > UID_MAX_AGE) {
+                e->time = 0;
+                break;
+            }
+            e->used = 1;
+            uid_cache.hits++;
+            return e->uid;
+        }
+    }
+    uid_cache.misses++;
+    return -1;
+}
+
+void put_cached_uid(const int version, const int protocol,
+                    const void *saddr, const uint16_t sport,
+                    const void *daddr, const uint16_t dport,
+                    jint uid) {
+    long long now = get_ms();
+    struct uid_cache_entry *set = get_uid_set(version, protocol, saddr, sport, daddr, dport);
+    size_t si = (set - uid_cache.entries[0]) / UID_CACHE_WAYS;
+
+    // Empty or expired way, else second chance
+    struct uid_cache_entry *e = NULL;
+    for (int w = 0; w < UID_CACHE_WAYS && e == NULL; w++)
+        if (set[w].time == 0 || now - set[w].time > UID_MAX_AGE)
+            e = &set[w];
+    while (e == NULL) {
+        struct uid_cache_entry *c = &set[uid_cache.hand[si]];
+        uid_cache.hand[si] = (uint8_t) ((uid_cache.hand[si] + 1) % UID_CACHE_WAYS);
+        if (c->used)
+            c->used = 0;
+        else {
+            e = c;
+            uid_cache.evictions++;
+        }
+    }
+
+    size_t alen = (version == 4 ? 4 : 16);
+    e->version = (uint8_t) version;
+    e->protocol = (uint8_t) protocol;
+    e->used = 0;
+    e->sport = sport;
+    e->dport = dport;
+    memcpy(e->saddr, saddr, alen);
+    memcpy(e->daddr, daddr, alen);
+    e->uid = uid;
+    e->time = now;
+}
+
+jint get_uid(struct worker *w, const int version, const int protocol,
              const void *saddr, const uint16_t sport,
              const void *daddr, const uint16_t dport) {
     jint uid = -1;
@@ -339,10 +1069,26 @@ jint get_uid(const int version, const int protocol,
     inet_ntop(version == 4 ? AF_INET : AF_INET6, saddr, source, sizeof(source));
     inet_ntop(version == 4 ? AF_INET : AF_INET6, daddr, dest, sizeof(dest));
 
+    // Query the socket, an IPv4 lookup also finds dual stack sockets
+    if (uid_backend != UID_BACKEND_PROC &&
+        (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP)) {
+        uid = get_uid_diag(w, version, protocol, saddr, sport, daddr, dport);
+        if (uid >= 0) {
+            log_android(ANDROID_LOG_INFO, "uid v%d p%d %s/%u > %s/%u => %d (diag)",
+                        version, protocol, source, sport, dest, dport, uid);
+            return uid;
+        }
+        uid = -1; // closed already or no diag, check /proc
+    }
+
     struct timeval time;
     gettimeofday(&time, NULL);
     long now = (time.tv_sec * 1000) + (time.tv_usec / 1000);
 
+    // Workers share the snapshots
+    if (pthread_mutex_lock(&snapshot_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
     // Check IPv6 table first
     if (version == 4) {
         int8_t saddr128[16];
@@ -368,6 +1114,9 @@ jint get_uid(const int version, const int protocol,
                     version, protocol, source, sport, dest, dport, uid);
     }
 
+    if (pthread_mutex_unlock(&snapshot_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
     if (uid == -1)
         log_android(ANDROID_LOG_WARN, "uid v%d p%d %s/%u > %s/%u => not found",
                     version, protocol, source, sport, dest, dport);
@@ -378,136 +1127,321 @@ jint get_uid(const int version, const int protocol,
     return uid;
 }
 
-int uid_cache_size = 0;
-struct uid_cache_entry *uid_cache = NULL;
-
-jint get_uid_sub(const int version, const int protocol,
-                 const void *saddr, const uint16_t sport,
-                 const void *daddr, const uint16_t dport,
-                 const char *source, const char *dest,
-                 long now) {
-    // NETLINK is not available on Android due to SELinux policies :-(
-    // http://stackoverflow.com/questions/27148536/netlink-implementation-for-the-android-ndk
-    // https://android.googlesource.com/platform/system/sepolicy/+/master/private/app.te (netlink_tcpdiag_socket)
+struct uid_snapshot uid_snapshots[UID_FILES];
 
-    static uint8_t zero[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static uint32_t uid_bucket(const struct uid_snapshot *snap, uint16_t sport) {
+    return (sport * 2654435761u) & (snap->buckets - 1);
+}
 
-    int ws = (version == 4 ? 1 : 4);
+static const char *parse_hex(const char *p, const char *end, uint32_t *value) {
+    uint32_t v = 0;
+    const char *start = p;
+    for (; p < end; p++) {
+        char c = *p;
+        if (c >= '0' && c <= '9')
+            v = (v << 4) | (uint32_t) (c - '0');
+        else if (c >= 'A' && c <= 'F')
+            v = (v << 4) | (uint32_t) (c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f')
+            v = (v << 4) | (uint32_t) (c - 'a' + 10);
+        else
+            break;
+    }
+    *value = v;
+    return (p == start ? NULL : p);
+}
 
-    // Check cache
-    for (int i = 0; i < uid_cache_size; i++)
-        if (now - uid_cache[i].time <= UID_MAX_AGE &&
-            uid_cache[i].version == version &&
-            uid_cache[i].protocol == protocol &&
-            uid_cache[i].sport == sport &&
-            (uid_cache[i].dport == dport || uid_cache[i].dport == 0) &&
-            (memcmp(uid_cache[i].saddr, saddr, (size_t) (ws * 4)) == 0 ||
-             memcmp(uid_cache[i].saddr, zero, (size_t) (ws * 4)) == 0) &&
-            (memcmp(uid_cache[i].daddr, daddr, (size_t) (ws * 4)) == 0 ||
-             memcmp(uid_cache[i].daddr, zero, (size_t) (ws * 4)) == 0)) {
+static const char *parse_endpoint(const char *p, const char *end,
+                                  int ws, uint8_t *addr, uint16_t *port) {
+    // Words of the address in host order, then the port: 0100007F:0035
+    if (end - p < ws * 8 + 2)
+        return NULL;
+    for (int w = 0; w < ws; w++) {
+        uint32_t word;
+        if (parse_hex(p, p + 8, &word) != p + 8)
+            return NULL;
+        memcpy(addr + w * 4, &word, 4);
+        p += 8;
+    }
+    if (*p++ != ':')
+        return NULL;
+    uint32_t value;
+    p = parse_hex(p, end, &value);
+    *port = (uint16_t) value;
+    return p;
+}
 
-            log_android(ANDROID_LOG_INFO, "uid v%d p%d %s/%u > %s/%u => %d (from cache)",
-                        version, protocol, source, sport, dest, dport, uid_cache[i].uid);
+static const char *skip_field(const char *p, const char *end) {
+    while (p < end && *p == ' ')
+        p++;
+    while (p < end && *p != ' ')
+        p++;
+    return p;
+}
 
-            return uid_cache[i].uid;
-        }
+static int parse_uid_line(struct uid_snapshot *snap, const char *p, const char *end, int ws) {
+    // sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid ...
+    struct uid_entry e;
+    memset(&e, 0, sizeof(struct uid_entry));
 
-    // Get proc file name
-    char *fn = NULL;
-    if (protocol == IPPROTO_ICMP && version == 4)
-        fn = "/proc/net/icmp";
-    else if (protocol == IPPROTO_ICMPV6 && version == 6)
-        fn = "/proc/net/icmp6";
-    else if (protocol == IPPROTO_TCP)
-        fn = (version == 4 ? "/proc/net/tcp" : "/proc/net/tcp6");
-    else if (protocol == IPPROTO_UDP)
-        fn = (version == 4 ? "/proc/net/udp" : "/proc/net/udp6");
-    else
+    p = skip_field(p, end);
+    while (p < end && *p == ' ')
+        p++;
+    if ((p = parse_endpoint(p, end, ws, e.saddr, &e.sport)) == NULL || *p++ != ' ')
+        return -1;
+    if ((p = parse_endpoint(p, end, ws, e.daddr, &e.dport)) == NULL)
         return -1;
+    for (int f = 0; f < 4; f++)
+        p = skip_field(p, end);
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        e.uid = e.uid * 10 + (*p - '0');
 
-    // Open proc file
-    FILE *fd = fopen(fn, "r");
-    if (fd == NULL) {
-        log_android(ANDROID_LOG_ERROR, "fopen %s error %d: %s", fn, errno, strerror(errno));
-        return -2;
+    if (snap->count == snap->size) {
+        snap->size = (snap->size == 0 ? UID_SNAPSHOT_INIT : snap->size * 2);
+        snap->entries = ng_realloc(snap->entries,
+                                   snap->size * sizeof(struct uid_entry), "uid snapshot");
     }
+    snap->entries[snap->count++] = e;
+    return 0;
+}
 
-    jint uid = -1;
+static int read_uid_snapshot(struct uid_snapshot *snap, const char *fn, int version) {
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_ERROR, "open %s error %d: %s", fn, errno, strerror(errno));
+        return -1;
+    }
 
-    char line[250];
-    int fields;
+    // Parse lines in place from large chunks, skipping the header line
+    int ws = (version == 4 ? 1 : 4);
+    char chunk[UID_CHUNK];
+    size_t used = 0;
+    int line = 0;
+    int rc = 0;
+    snap->count = 0;
+    while (rc == 0) {
+        ssize_t len = read(fd, chunk + used, sizeof(chunk) - used);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            log_android(ANDROID_LOG_ERROR, "read %s error %d: %s", fn, errno, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (len == 0 && used == 0)
+            break;
+        used += len;
+
+        char *p = chunk;
+        char *end = chunk + used;
+        char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL ||
+               (len == 0 && p < end && (nl = end) != NULL)) {
+            if (line++ && parse_uid_line(snap, p, nl, ws)) {
+                log_android(ANDROID_LOG_ERROR, "Invalid line %s: %.*s", fn, (int) (nl - p), p);
+                rc = -1;
+                break;
+            }
+            p = (nl < end ? nl + 1 : end);
+        }
 
-    char shex[16 * 2 + 1];
-    uint8_t _saddr[16];
-    int _sport;
+        if (len == 0)
+            break;
+        used = end - p;
+        if (used == sizeof(chunk)) {
+            log_android(ANDROID_LOG_ERROR, "Line too long %s", fn);
+            rc = -1;
+            break;
+        }
+        memmove(chunk, p, used);
+    }
 
-    char dhex[16 * 2 + 1];
-    uint8_t _daddr[16];
-    int _dport;
+    if (close(fd))
+        log_android(ANDROID_LOG_ERROR, "close %s error %d: %s", fn, errno, strerror(errno));
+    if (rc < 0)
+        snap->count = 0;
+
+    // Index by source port, chains in reverse file order
+    uint32_t buckets = UID_SNAPSHOT_INIT;
+    while (buckets < (uint32_t) snap->count * 2)
+        buckets <<= 1;
+    if (buckets != snap->buckets) {
+        snap->buckets = buckets;
+        snap->bucket = ng_realloc(snap->bucket, buckets * sizeof(int32_t), "uid index");
+    }
+    memset(snap->bucket, 0xFF, buckets * sizeof(int32_t));
+    for (int i = 0; i < snap->count; i++) {
+        uint32_t b = uid_bucket(snap, snap->entries[i].sport);
+        snap->entries[i].next = snap->bucket[b];
+        snap->bucket[b] = i;
+    }
 
-    jint _uid;
+    return rc;
+}
 
-    // Scan proc file
-    int l = 0;
-    *line = 0;
-    int c = 0;
-    const char *fmt = (version == 4
-                       ? "%*d: %8s:%X %8s:%X %*X %*lX:%*lX %*X:%*X %*X %d %*d %*ld"
-                       : "%*d: %32s:%X %32s:%X %*X %*lX:%*lX %*X:%*X %*X %d %*d %*ld");
-    while (fgets(line, sizeof(line), fd) != NULL) {
-        if (!l++)
-            continue;
+static jint find_uid(const struct uid_snapshot *snap, const int version,
+                     const void *saddr, const uint16_t sport,
+                     const void *daddr, const uint16_t dport) {
+    static uint8_t zero[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    size_t alen = (version == 4 ? 4 : 16);
+
+    // Last matching line of the file
+    int32_t i = snap->bucket[uid_bucket(snap, sport)];
+    for (; i >= 0; i = snap->entries[i].next) {
+        const struct uid_entry *e = &snap->entries[i];
+        if (e->sport == sport &&
+            (e->dport == dport || e->dport == 0) &&
+            (memcmp(e->saddr, saddr, alen) == 0 || memcmp(e->saddr, zero, alen) == 0) &&
+            (memcmp(e->daddr, daddr, alen) == 0 || memcmp(e->daddr, zero, alen) == 0))
+            return e->uid;
+    }
+    return -1;
+}
 
-        fields = sscanf(line, fmt, shex, &_sport, dhex, &_dport, &_uid);
-        if (fields == 5 && strlen(shex) == ws * 8 && strlen(dhex) == ws * 8) {
-            hex2bytes(shex, _saddr);
-            hex2bytes(dhex, _daddr);
+void clear_uid_cache() {
+    for (int f = 0; f < UID_FILES; f++) {
+        if (uid_snapshots[f].entries != NULL)
+            ng_free(uid_snapshots[f].entries, __FILE__, __LINE__);
+        if (uid_snapshots[f].bucket != NULL)
+            ng_free(uid_snapshots[f].bucket, __FILE__, __LINE__);
+    }
+    memset(uid_snapshots, 0, sizeof(uid_snapshots));
+    memset(&uid_cache, 0, sizeof(struct uid_cache));
+}
 
-            for (int w = 0; w < ws; w++)
-                ((uint32_t *) _saddr)[w] = htonl(((uint32_t *) _saddr)[w]);
+jint get_uid_diag(struct worker *w, const int version, const int protocol,
+                  const void *saddr, const uint16_t sport,
+                  const void *daddr, const uint16_t dport) {
+    // Returns -1 if not found, -2 on failure
+    // Apps might not be allowed netlink_tcpdiag_socket, in which case /proc is used
+    // Each worker has its own socket, so answers are not mixed up
+    if (w->uid_diag < 0) {
+        w->uid_diag = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+        if (w->uid_diag < 0) {
+            log_android(ANDROID_LOG_WARN, "uid diag socket error %d: %s",
+                        errno, strerror(errno));
+            uid_backend = UID_BACKEND_PROC;
+            return -2;
+        }
 
-            for (int w = 0; w < ws; w++)
-                ((uint32_t *) _daddr)[w] = htonl(((uint32_t *) _daddr)[w]);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = UID_DIAG_TIMEOUT * 1000;
+        if (setsockopt(w->uid_diag, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+            log_android(ANDROID_LOG_ERROR, "uid diag SO_RCVTIMEO error %d: %s",
+                        errno, strerror(errno));
+    }
 
-            if (_sport == sport &&
-                (_dport == dport || _dport == 0) &&
-                (memcmp(_saddr, saddr, (size_t) (ws * 4)) == 0 ||
-                 memcmp(_saddr, zero, (size_t) (ws * 4)) == 0) &&
-                (memcmp(_daddr, daddr, (size_t) (ws * 4)) == 0 ||
-                 memcmp(_daddr, zero, (size_t) (ws * 4)) == 0))
-                uid = _uid;
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.nlh.nlmsg_len = sizeof(msg);
+    msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    msg.nlh.nlmsg_flags = NLM_F_REQUEST; // single socket, no dump
+    msg.req.sdiag_family = (uint8_t) (version == 4 ? AF_INET : AF_INET6);
+    msg.req.sdiag_protocol = (uint8_t) protocol;
+    msg.req.idiag_states = 0xFFFFFFFF;
+    msg.req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    msg.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    // The UDP lookup has source and destination swapped
+    size_t alen = (version == 4 ? 4 : 16);
+    int local = (protocol == IPPROTO_UDP);
+    memcpy(local ? msg.req.id.idiag_dst : msg.req.id.idiag_src, saddr, alen);
+    memcpy(local ? msg.req.id.idiag_src : msg.req.id.idiag_dst, daddr, alen);
+    msg.req.id.idiag_sport = htons(local ? dport : sport);
+    msg.req.id.idiag_dport = htons(local ? sport : dport);
+
+    struct sockaddr_nl nladdr;
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+    if (sendto(w->uid_diag, &msg, sizeof(msg), 0,
+               (struct sockaddr *) &nladdr, sizeof(nladdr)) != sizeof(msg)) {
+        log_android(ANDROID_LOG_WARN, "uid diag send error %d: %s", errno, strerror(errno));
+        if (errno == EACCES || errno == EPERM)
+            uid_backend = UID_BACKEND_PROC;
+        return -2;
+    }
 
-            for (; c < uid_cache_size; c++)
-                if (now - uid_cache[c].time > UID_MAX_AGE)
-                    break;
+    uint32_t buffer[1024];
+    ssize_t len = recv(w->uid_diag, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+        log_android(ANDROID_LOG_WARN, "uid diag recv error %d: %s", errno, strerror(errno));
+        // Discard a late answer
+        close(w->uid_diag);
+        w->uid_diag = -1;
+        return -2;
+    }
 
-            if (c >= uid_cache_size) {
-                if (uid_cache_size == 0)
-                    uid_cache = ng_malloc(sizeof(struct uid_cache_entry), "uid_cache init");
-                else
-                    uid_cache = ng_realloc(uid_cache,
-                                           sizeof(struct uid_cache_entry) *
-                                           (uid_cache_size + 1), "uid_cache extend");
-                c = uid_cache_size;
-                uid_cache_size++;
+    jint uid = -1;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *) buffer;
+         NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            int err = -((struct nlmsgerr *) NLMSG_DATA(nlh))->error;
+            if (err == EACCES || err == EPERM || err == EOPNOTSUPP || err == EINVAL) {
+                log_android(ANDROID_LOG_WARN, "uid diag error %d: %s", err, strerror(err));
+                uid_backend = UID_BACKEND_PROC;
+                return -2;
             }
+            // ENOENT: not found
+        } else if (nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY &&
+                   nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct inet_diag_msg)))
+            uid = (jint) ((struct inet_diag_msg *) NLMSG_DATA(nlh))->idiag_uid;
 
-            uid_cache[c].version = (uint8_t) version;
-            uid_cache[c].protocol = (uint8_t) protocol;
-            memcpy(uid_cache[c].saddr, _saddr, (size_t) (ws * 4));
-            uid_cache[c].sport = (uint16_t) _sport;
-            memcpy(uid_cache[c].daddr, _daddr, (size_t) (ws * 4));
-            uid_cache[c].dport = (uint16_t) _dport;
-            uid_cache[c].uid = _uid;
-            uid_cache[c].time = now;
-        } else {
-            log_android(ANDROID_LOG_ERROR, "Invalid field #%d: %s", fields, line);
-            return -2;
+    if (uid >= 0)
+        uid_backend = UID_BACKEND_DIAG;
+    return uid;
+}
+
+jint get_uid_sub(const int version, const int protocol,
+                 const void *saddr, const uint16_t sport,
+                 const void *daddr, const uint16_t dport,
+                 const char *source, const char *dest,
+                 long now) {
+    // Used when NETLINK is not available due to SELinux policies :-(
+    // http://stackoverflow.com/questions/27148536/netlink-implementation-for-the-android-ndk
+    // https://android.googlesource.com/platform/system/sepolicy/+/master/private/app.te (netlink_tcpdiag_socket)
+
+    // Get proc file name
+    char *fn = NULL;
+    int file;
+    if (protocol == IPPROTO_ICMP && version == 4) {
+        fn = "/proc/net/icmp";
+        file = 4;
+    } else if (protocol == IPPROTO_ICMPV6 && version == 6) {
+        fn = "/proc/net/icmp6";
+        file = 5;
+    } else if (protocol == IPPROTO_TCP) {
+        fn = (version == 4 ? "/proc/net/tcp" : "/proc/net/tcp6");
+        file = (version == 4 ? 0 : 1);
+    } else if (protocol == IPPROTO_UDP) {
+        fn = (version == 4 ? "/proc/net/udp" : "/proc/net/udp6");
+        file = (version == 4 ? 2 : 3);
+    } else
+        return -1;
+
+    // Check the snapshot, it might not have a new socket yet
+    struct uid_snapshot *snap = &uid_snapshots[file];
+    if (snap->time != 0 && now - snap->time <= UID_MAX_AGE) {
+        jint uid = find_uid(snap, version, saddr, sport, daddr, dport);
+        if (uid != -1) {
+            log_android(ANDROID_LOG_INFO, "uid v%d p%d %s/%u > %s/%u => %d (from cache)",
+                        version, protocol, source, sport, dest, dport, uid);
+            return uid;
         }
     }
 
-    if (fclose(fd))
-        log_android(ANDROID_LOG_ERROR, "fclose %s error %d: %s", fn, errno, strerror(errno));
+    if (read_uid_snapshot(snap, fn, version) < 0) {
+        snap->time = 0;
+        return -2;
+    }
+    snap->time = now;
 
-    return uid;
+    return find_uid(snap, version, saddr, sport, daddr, dport);
 }
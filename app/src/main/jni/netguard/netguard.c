@@ -36,8 +36,8 @@ extern FILE *pcap_file;
 extern size_t pcap_record_size;
 extern long pcap_file_size;
 
-extern int uid_cache_size;
-extern struct uid_cache_entry *uid_cache;
+extern int uid_backend;
+extern struct uid_cache uid_cache;
 
 // JNI
 
@@ -49,6 +49,8 @@ jclass clsUsage;
 jint JNI_OnLoad(JavaVM *vm, void *reserved) {
     log_android(ANDROID_LOG_INFO, "JNI load");
 
+    init_checksum();
+
     JNIEnv *env;
     if ((*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_6) != JNI_OK) {
         log_android(ANDROID_LOG_INFO, "JNI load GetEnv failed");
@@ -112,6 +114,15 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1init(
         JNIEnv *env, jobject instance, jint sdk) {
     struct context *ctx = ng_calloc(1, sizeof(struct context), "init");
     ctx->sdk = sdk;
+    ctx->reader.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->reader.wakefd < 0)
+        log_android(ANDROID_LOG_ERROR, "tun reader eventfd error %d: %s", errno, strerror(errno));
+    ctx->writer.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->writer.wakefd < 0)
+        log_android(ANDROID_LOG_ERROR, "tun writer eventfd error %d: %s", errno, strerror(errno));
+    ctx->workers = 1;
+    ctx->nworkers = 1;
+    init_worker(ctx, 0);
 
     loglevel = ANDROID_LOG_WARN;
 
@@ -121,8 +132,15 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1init(
     *socks5_password = 0;
     pcap_file = NULL;
 
-    if (pthread_mutex_init(&ctx->lock, NULL))
+    for (int i = 0; i < WORKERS_MAX; i++)
+        if (pthread_mutex_init(&ctx->worker[i].lock, NULL))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    if (pthread_mutex_init(&ctx->dns_cache.lock, NULL))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    if (pthread_mutex_init(&ctx->writer.lock, NULL))
         log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    if (pthread_cond_init(&ctx->writer.space, NULL))
+        log_android(ANDROID_LOG_ERROR, "pthread_cond_init failed");
 
     // Create signal pipe
     if (pipe(ctx->pipefds))
@@ -145,6 +163,24 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1start(
 
     loglevel = loglevel_;
     max_tun_msg = 0;
+    memset(&ctx->tun_stats, 0, sizeof(struct tun_stats));
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct worker *w = &ctx->worker[i];
+        memset(&w->epoll_stats, 0, sizeof(struct epoll_stats));
+        w->queue.dequeued = 0;
+        w->queue.delay = 0;
+        w->queue.delay_max = 0;
+        w->out.dequeued = 0;
+        w->out.delay = 0;
+        w->out.delay_max = 0;
+    }
+    ctx->writer.wakeups = 0;
+    ctx->writer.packets = 0;
+    ctx->writer.stalls = 0;
+    ctx->writer.retries = 0;
+    ctx->writer.dropped = 0;
+    ctx->writer.syscalls = 0;
+    clear_dns_cache(&ctx->dns_cache); // network might have changed
     ctx->stopping = 0;
 
     log_android(ANDROID_LOG_WARN, "Starting level %d", loglevel);
@@ -158,10 +194,11 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1run(
 
     log_android(ANDROID_LOG_WARN, "Running tun %d fwd53 %d level %d", tun, fwd53, loglevel);
 
-    // Set blocking
+    // Set non blocking for the reader to read batches until drained
+    // and for the writer to not block on a slow reader at the other side
     int flags = fcntl(tun, F_GETFL, 0);
-    if (flags < 0 || fcntl(tun, F_SETFL, flags & ~O_NONBLOCK) < 0)
-        log_android(ANDROID_LOG_ERROR, "fcntl tun ~O_NONBLOCK error %d: %s",
+    if (flags < 0 || fcntl(tun, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_android(ANDROID_LOG_ERROR, "fcntl tun O_NONBLOCK error %d: %s",
                     errno, strerror(errno));
 
     // Get arguments
@@ -172,7 +209,33 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1run(
     args->fwd53 = fwd53;
     args->rcode = rcode;
     args->ctx = ctx;
-    handle_events(args);
+    args->worker = &ctx->worker[0];
+
+    // Sessions are sharded by the number of workers
+    if (ctx->workers != ctx->nworkers) {
+        log_android(ANDROID_LOG_WARN, "Workers %d > %d", ctx->nworkers, ctx->workers);
+        for (int i = 0; i < ctx->nworkers; i++)
+            clear(&ctx->worker[i]);
+        ctx->nworkers = ctx->workers;
+    }
+
+    if ((*env)->GetJavaVM(env, &ctx->jvm) != JNI_OK)
+        ctx->nworkers = 1;
+
+    // Write tun on its own thread, written directly when it could not be started
+    start_tun_writer(args);
+    start_workers(args);
+
+    // Read tun on its own thread
+    if (start_tun_reader(args) < 0) {
+        report_exit(args, "tun reader start failed");
+        ng_free(args, __FILE__, __LINE__);
+    } else
+        handle_events(args);
+
+    stop_tun_reader(ctx);
+    stop_workers(ctx);
+    stop_tun_writer(ctx);
 }
 
 JNIEXPORT void JNICALL
@@ -190,7 +253,8 @@ JNIEXPORT void JNICALL
 Java_eu_faircode_netguard_ServiceSinkhole_jni_1clear(
         JNIEnv *env, jobject instance, jlong context) {
     struct context *ctx = (struct context *) context;
-    clear(ctx);
+    for (int i = 0; i < WORKERS_MAX; i++)
+        clear(&ctx->worker[i]);
 }
 
 JNIEXPORT jint JNICALL
@@ -203,30 +267,17 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1get_1stats(
         JNIEnv *env, jobject instance, jlong context) {
     struct context *ctx = (struct context *) context;
 
-    if (pthread_mutex_lock(&ctx->lock))
-        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
-
-    jintArray jarray = (*env)->NewIntArray(env, 5);
+    jintArray jarray = (*env)->NewIntArray(env, 26 + EPOLL_HIST);
     jint *jcount = (*env)->GetIntArrayElements(env, jarray, NULL);
 
-    struct ng_session *s = ctx->ng_session;
-    while (s != NULL) {
-        if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-            if (!s->icmp.stop)
-                jcount[0]++;
-        } else if (s->protocol == IPPROTO_UDP) {
-            if (s->udp.state == UDP_ACTIVE)
-                jcount[1]++;
-        } else if (s->protocol == IPPROTO_TCP) {
-            if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                jcount[2]++;
-        }
-        s = s->next;
+    // Counted by the workers, so no worker needs to be locked
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct session_count *active = &ctx->worker[i].active;
+        jcount[0] += (jint) __atomic_load_n(&active->icmp, __ATOMIC_RELAXED);
+        jcount[1] += (jint) __atomic_load_n(&active->udp, __ATOMIC_RELAXED);
+        jcount[2] += (jint) __atomic_load_n(&active->tcp, __ATOMIC_RELAXED);
     }
 
-    if (pthread_mutex_unlock(&ctx->lock))
-        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
-
     jcount[3] = 0;
     DIR *d = opendir("/proc/self/fd");
     if (d) {
@@ -242,6 +293,64 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1get_1stats(
     getrlimit(RLIMIT_NOFILE, &rlim);
     jcount[4] = (jint) rlim.rlim_cur;
 
+    // Packets per tun wakeup
+    jcount[5] = (jint) ctx->tun_stats.wakeups;
+    jcount[6] = (jint) ctx->tun_stats.packets;
+    jcount[7] = (jint) ctx->tun_stats.full;
+
+    // Uid lookup
+    jcount[8] = uid_backend;
+    jcount[9] = (jint) uid_cache.hits;
+    jcount[10] = (jint) uid_cache.misses;
+    jcount[11] = (jint) uid_cache.evictions;
+
+    // Events per epoll wakeup, of all workers
+    for (int w = 0; w < ctx->nworkers; w++) {
+        jcount[12] += (jint) ctx->worker[w].epoll_stats.size;
+        for (int i = 0; i < EPOLL_HIST; i++)
+            jcount[13 + i] += (jint) ctx->worker[w].epoll_stats.hist[i];
+    }
+
+    // Queueing delay in microseconds of packets from tun, of worker 0 and of the other workers
+    uint64_t delay = 0;
+    uint32_t dequeued = 0;
+    for (int w = 0; w < ctx->nworkers; w++) {
+        struct packet_queue *q = &ctx->worker[w].queue;
+        if (w == 0) {
+            jcount[13 + EPOLL_HIST] = (jint) (q->dequeued ? q->delay / q->dequeued : 0);
+            jcount[14 + EPOLL_HIST] = (jint) q->delay_max;
+        } else {
+            delay += q->delay;
+            dequeued += q->dequeued;
+            if (q->delay_max > jcount[16 + EPOLL_HIST])
+                jcount[16 + EPOLL_HIST] = (jint) q->delay_max;
+        }
+    }
+    jcount[15 + EPOLL_HIST] = (jint) (dequeued ? delay / dequeued : 0);
+
+    // Tun writer
+    jcount[17 + EPOLL_HIST] = (jint) ctx->writer.wakeups;
+    jcount[18 + EPOLL_HIST] = (jint) ctx->writer.packets;
+    jcount[19 + EPOLL_HIST] = (jint) ctx->writer.stalls;
+    jcount[20 + EPOLL_HIST] = (jint) ctx->writer.dropped;
+    delay = 0;
+    dequeued = 0;
+    for (int w = 0; w < ctx->nworkers; w++) {
+        struct packet_queue *q = &ctx->worker[w].out;
+        delay += q->delay;
+        dequeued += q->dequeued;
+        if (q->delay_max > jcount[22 + EPOLL_HIST])
+            jcount[22 + EPOLL_HIST] = (jint) q->delay_max;
+    }
+    jcount[21 + EPOLL_HIST] = (jint) (dequeued ? delay / dequeued : 0);
+
+    // System calls of the tun writer, to compare write() and io_uring
+    jcount[23 + EPOLL_HIST] = ctx->writer.use_uring;
+    jcount[24 + EPOLL_HIST] = (jint) ctx->writer.syscalls;
+
+    // Tun not writable
+    jcount[25 + EPOLL_HIST] = (jint) ctx->writer.retries;
+
     (*env)->ReleaseIntArrayElements(env, jarray, jcount, 0);
     return jarray;
 }
@@ -331,25 +440,124 @@ Java_eu_faircode_netguard_ServiceSinkhole_jni_1socks5(JNIEnv *env, jobject insta
     ng_delete_alloc(password, __FILE__, __LINE__);
 }
 
+JNIEXPORT jint JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1hosts_1compile(
+        JNIEnv *env, jclass type, jstring hosts_, jstring image_) {
+    const char *hosts = (*env)->GetStringUTFChars(env, hosts_, 0);
+    const char *image = (*env)->GetStringUTFChars(env, image_, 0);
+    ng_add_alloc(hosts, "hosts");
+    ng_add_alloc(image, "image");
+
+    int count = compile_blocklist(hosts, image);
+
+    (*env)->ReleaseStringUTFChars(env, hosts_, hosts);
+    (*env)->ReleaseStringUTFChars(env, image_, image);
+    ng_delete_alloc(hosts, __FILE__, __LINE__);
+    ng_delete_alloc(image, __FILE__, __LINE__);
+
+    return count;
+}
+
+JNIEXPORT jint JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1hosts(
+        JNIEnv *env, jobject instance, jlong context, jstring path_) {
+    struct context *ctx = (struct context *) context;
+
+    struct blocklist *bl = NULL;
+    if (path_ != NULL) {
+        const char *path = (*env)->GetStringUTFChars(env, path_, 0);
+        ng_add_alloc(path, "path");
+
+        bl = map_blocklist(path);
+
+        (*env)->ReleaseStringUTFChars(env, path_, path);
+        ng_delete_alloc(path, __FILE__, __LINE__);
+    }
+
+    // Swap
+    lock_workers(ctx);
+    struct blocklist *old = ctx->blocklist;
+    ctx->blocklist = bl;
+    clear_dns_cache(&ctx->dns_cache);
+    unlock_workers(ctx);
+
+    free_blocklist(old);
+
+    return (jint) (bl == NULL ? 0 : bl->count);
+}
+
+JNIEXPORT void JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1dns(
+        JNIEnv *env, jobject instance, jlong context, jint size, jint policy) {
+    struct context *ctx = (struct context *) context;
+
+    lock_workers(ctx);
+    set_dns_cache(&ctx->dns_cache, size, policy);
+    unlock_workers(ctx);
+}
+
+JNIEXPORT void JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1udp_1offload(
+        JNIEnv *env, jobject instance, jlong context, jboolean enabled) {
+    struct context *ctx = (struct context *) context;
+    ctx->udp_offload = enabled; // applies to new sessions
+}
+
+JNIEXPORT void JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1uring(
+        JNIEnv *env, jobject instance, jlong context, jboolean enabled) {
+    struct context *ctx = (struct context *) context;
+    ctx->uring = enabled; // applies to the next run
+}
+
+JNIEXPORT void JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1workers(
+        JNIEnv *env, jobject instance, jlong context, jint count) {
+    struct context *ctx = (struct context *) context;
+    ctx->workers = (count < 1 ? 1 : (count > WORKERS_MAX ? WORKERS_MAX : count)); // next run
+}
+
+JNIEXPORT void JNICALL
+Java_eu_faircode_netguard_ServiceSinkhole_jni_1verdicts(
+        JNIEnv *env, jobject instance, jlong context, jboolean log) {
+    struct context *ctx = (struct context *) context;
+    for (int i = 0; i < WORKERS_MAX; i++)
+        update_verdicts(&ctx->worker[i].verdicts, log); // no lock, can be called from upcalls
+}
+
 JNIEXPORT void JNICALL
 Java_eu_faircode_netguard_ServiceSinkhole_jni_1done(
         JNIEnv *env, jobject instance, jlong context) {
     struct context *ctx = (struct context *) context;
     log_android(ANDROID_LOG_INFO, "Done");
 
-    clear(ctx);
-
-    if (pthread_mutex_destroy(&ctx->lock))
+    if (ctx->reader.wakefd >= 0 && close(ctx->reader.wakefd))
+        log_android(ANDROID_LOG_ERROR, "Close tun reader eventfd error %d: %s",
+                    errno, strerror(errno));
+    if (ctx->writer.wakefd >= 0 && close(ctx->writer.wakefd))
+        log_android(ANDROID_LOG_ERROR, "Close tun writer eventfd error %d: %s",
+                    errno, strerror(errno));
+    if (pthread_mutex_destroy(&ctx->writer.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_destroy failed");
+    if (pthread_cond_destroy(&ctx->writer.space))
+        log_android(ANDROID_LOG_ERROR, "pthread_cond_destroy failed");
+    free_blocklist(ctx->blocklist);
+    free_dns_cache(&ctx->dns_cache);
+
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        free_worker(&ctx->worker[i]);
+        if (pthread_mutex_destroy(&ctx->worker[i].lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_destroy failed");
+    }
+    if (pthread_mutex_destroy(&ctx->dns_cache.lock))
         log_android(ANDROID_LOG_ERROR, "pthread_mutex_destroy failed");
 
     for (int i = 0; i < 2; i++)
         if (close(ctx->pipefds[i]))
             log_android(ANDROID_LOG_ERROR, "Close pipe error %d: %s", errno, strerror(errno));
 
-    if (uid_cache != NULL)
-        ng_free(uid_cache, __FILE__, __LINE__);
-    uid_cache_size = 0;
-    uid_cache = NULL;
+    clear_uid_cache();
+    uid_backend = UID_BACKEND_NONE;
 
     ng_free(ctx, __FILE__, __LINE__);
 }
@@ -649,45 +857,6 @@ void dns_resolved(const struct arguments *args,
 #endif
 }
 
-static jmethodID midIsDomainBlocked = NULL;
-
-jboolean is_domain_blocked(const struct arguments *args, const char *name) {
-#ifdef PROFILE_JNI
-    float mselapsed;
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-#endif
-
-    jclass clsService = (*args->env)->GetObjectClass(args->env, args->instance);
-    ng_add_alloc(clsService, "clsService");
-
-    const char *signature = "(Ljava/lang/String;)Z";
-    if (midIsDomainBlocked == NULL)
-        midIsDomainBlocked = jniGetMethodID(args->env, clsService, "isDomainBlocked", signature);
-
-    jstring jname = (*args->env)->NewStringUTF(args->env, name);
-    ng_add_alloc(jname, "jname");
-
-    jboolean jallowed = (*args->env)->CallBooleanMethod(
-            args->env, args->instance, midIsDomainBlocked, jname);
-    jniCheckException(args->env);
-
-    (*args->env)->DeleteLocalRef(args->env, jname);
-    (*args->env)->DeleteLocalRef(args->env, clsService);
-    ng_delete_alloc(jname, __FILE__, __LINE__);
-    ng_delete_alloc(clsService, __FILE__, __LINE__);
-
-#ifdef PROFILE_JNI
-    gettimeofday(&end, NULL);
-    mselapsed = (end.tv_sec - start.tv_sec) * 1000.0 +
-                (end.tv_usec - start.tv_usec) / 1000.0;
-    if (mselapsed > PROFILE_JNI)
-        log_android(ANDROID_LOG_WARN, "is_domain_blocked %f", mselapsed);
-#endif
-
-    return jallowed;
-}
-
 static jmethodID midGetUidQ = NULL;
 
 jint get_uid_q(const struct arguments *args,
@@ -738,9 +907,9 @@ jint get_uid_q(const struct arguments *args,
 static jmethodID midIsAddressAllowed = NULL;
 jfieldID fidRaddr = NULL;
 jfieldID fidRport = NULL;
-struct allowed allowed;
 
-struct allowed *is_address_allowed(const struct arguments *args, jobject jpacket) {
+struct allowed *is_address_allowed(const struct arguments *args, jobject jpacket,
+                                   struct allowed *allowed) {
 #ifdef PROFILE_JNI
     float mselapsed;
     struct timeval start, end;
@@ -769,15 +938,15 @@ struct allowed *is_address_allowed(const struct arguments *args, jobject jpacket
         jstring jraddr = (*args->env)->GetObjectField(args->env, jallowed, fidRaddr);
         ng_add_alloc(jraddr, "jraddr");
         if (jraddr == NULL)
-            *allowed.raddr = 0;
+            *allowed->raddr = 0;
         else {
             const char *raddr = (*args->env)->GetStringUTFChars(args->env, jraddr, NULL);
             ng_add_alloc(raddr, "raddr");
-            strcpy(allowed.raddr, raddr);
+            strcpy(allowed->raddr, raddr);
             (*args->env)->ReleaseStringUTFChars(args->env, jraddr, raddr);
             ng_delete_alloc(raddr, __FILE__, __LINE__);
         }
-        allowed.rport = (uint16_t) (*args->env)->GetIntField(args->env, jallowed, fidRport);
+        allowed->rport = (uint16_t) (*args->env)->GetIntField(args->env, jallowed, fidRport);
 
         (*args->env)->DeleteLocalRef(args->env, jraddr);
         ng_delete_alloc(jraddr, __FILE__, __LINE__);
@@ -799,7 +968,7 @@ struct allowed *is_address_allowed(const struct arguments *args, jobject jpacket
         log_android(ANDROID_LOG_WARN, "is_address_allowed %f", mselapsed);
 #endif
 
-    return (jallowed == NULL ? NULL : &allowed);
+    return (jallowed == NULL ? NULL : allowed);
 }
 
 jmethodID midInitPacket = NULL;
@@ -987,7 +1156,7 @@ void account_usage(const struct arguments *args, jint version, jint protocol,
 struct alloc_record {
     const char *tag;
     time_t time;
-    void *ptr;
+    const void *ptr;
 };
 
 int allocs = 0;
@@ -995,7 +1164,7 @@ int balance = 0;
 struct alloc_record *alloc = NULL;
 pthread_mutex_t *alock = NULL;
 
-void ng_add_alloc(void *ptr, const char *tag) {
+void ng_add_alloc(const void *ptr, const char *tag) {
 #ifdef PROFILE_MEMORY
     if (ptr == NULL)
         return;
@@ -1033,7 +1202,7 @@ void ng_add_alloc(void *ptr, const char *tag) {
 #endif
 }
 
-void ng_delete_alloc(void *ptr, const char *file, int line) {
+void ng_delete_alloc(const void *ptr, const char *file, int line) {
 #ifdef PROFILE_MEMORY
     if (ptr == NULL)
         return;
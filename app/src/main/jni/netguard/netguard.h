@@ -15,9 +15,13 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -30,6 +34,11 @@
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
 
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/io_uring.h>
+
 #include <android/log.h>
 #include <sys/system_properties.h>
 
@@ -39,10 +48,25 @@
 // #define PROFILE_MEMORY
 
 #define EPOLL_TIMEOUT 3600 // seconds
-#define EPOLL_EVENTS 20
+#define EPOLL_EVENTS 32 // initial and minimum events per wait
+#define EPOLL_EVENTS_MAX 1024
+#define EPOLL_SHRINK 64 // wakeups using less than a quarter before shrinking
+#define EPOLL_HIST 11 // events per wakeup buckets 1, 2-3, 4-7, .., 1024
 #define EPOLL_MIN_CHECK 100 // milliseconds
 
-#define TUN_YIELD 10 // packets
+// Event masks, the epoll bits so the epoll backend passes them unchanged
+#define EVENT_IN EPOLLIN
+#define EVENT_OUT EPOLLOUT
+#define EVENT_ERR EPOLLERR
+#define EVENT_HUP EPOLLHUP
+#define EVENT_ET EPOLLET // edge triggered, handlers drain the socket
+#define EVENT_URING 256 // submission queue entries of the io_uring backend
+
+#define TUN_YIELD 16 // packets handled per batch
+
+#define WORKERS_MAX 8
+#define PACKET_QUEUE 64 // packets from or to tun per worker, power of two
+#define TUN_WRITE_WAIT 100 // milliseconds, between checks for stopping while waiting for tun
 
 #define ICMP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)
 #define ICMP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)
@@ -54,7 +78,49 @@
 #define UDP_TIMEOUT_53 15 // seconds
 #define UDP_TIMEOUT_ANY 300 // seconds
 #define UDP_KEEP_TIMEOUT 60 // seconds
-#define UDP_YIELD 10 // packets
+#define UDP_YIELD 10 // packets per recvmmsg, udp buffers
+#define UDP_SLOT UDP4_MAXMSG // bytes per udp buffer, the largest datagram
+#define UDP_GRO_BUFFER 65536 // bytes, coalesced datagrams
+
+#define UDP_OFFLOAD_UNKNOWN 0 // not probed yet
+#define UDP_OFFLOAD_SUPPORTED 1 // UDP_SEGMENT and UDP_GRO
+#define UDP_OFFLOAD_UNSUPPORTED 2
+
+#define URING_UNKNOWN 0 // not tried yet
+#define URING_SUPPORTED 1
+#define URING_UNSUPPORTED 2 // not allowed for the app or no kernel support
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425 // Linux 5.1, same number on all architectures
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#ifndef IOSQE_IO_LINK
+#define IOSQE_IO_LINK (1U << 2) // Linux 5.3
+#endif
+#ifndef IORING_FEAT_NODROP
+#define IORING_FEAT_NODROP (1U << 1) // Linux 5.5
+#endif
+#ifndef IORING_FEAT_EXT_ARG
+#define IORING_FEAT_EXT_ARG (1U << 8) // Linux 5.11
+#endif
+#ifndef IORING_ENTER_EXT_ARG
+#define IORING_ENTER_EXT_ARG (1U << 3)
+#endif
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // Linux 4.18
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104 // Linux 5.0
+#endif
 
 #define TCP_INIT_TIMEOUT 20 // seconds ~net.inet.tcp.keepinit
 #define TCP_IDLE_TIMEOUT 3600 // seconds ~net.inet.tcp.keepidle
@@ -65,9 +131,53 @@
 #define SESSION_LIMIT 40 // percent
 #define SESSION_MAX (1024 * SESSION_LIMIT / 100) // number
 
+#define SESSION_TABLE_INIT 256 // slots, power of two
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS) // per level
+#define TIMER_LEVELS 3 // 1 s, 64 s and 4096 s slots
+#define TIMER_SPAN(level) (1 << (TIMER_BITS * (level))) // seconds per slot
+#define TIMER_RANGE TIMER_SPAN(TIMER_LEVELS) // seconds
+#define TIMER_RESCAN 10 // percent of max sessions
+
+#define CHECKSUM_SIMD_MIN 256 // bytes
+#define CHECKSUM_FLUSH 16384 // vector blocks before 32 bit lanes could overflow
+#define CHECKSUM_VARIANTS 4 // scalar and vector implementations
+
+#define BLOCKLIST_INIT 1024 // slots, power of two
+#define BLOCKLIST_POOL_INIT 65536 // bytes
+#define BLOCKLIST_EXACT 1
+#define BLOCKLIST_SUFFIX 2 // wildcard
+#define BLOCKLIST_MAGIC 0x4c42474e // "NGBL"
+#define BLOCKLIST_VERSION 1
+
+#define DNS_CACHE_SIZE 256 // responses
+#define DNS_CACHE_LRU 0 // evict least recently used
+#define DNS_CACHE_TTL 1 // evict first to expire
+#define DNS_CACHE_TTL_MAX 3600 // seconds
+#define DNS_CACHE_LENGTH_MAX 1232 // bytes, https://www.dnsflagday.net/2020/
+
+#define VERDICT_SLOTS 512 // power of two
+#define VERDICT_TTL 60 // seconds
+#define VERDICT_LOG 32 // coalesced hits logged per batch
+
 #define SEND_BUF_DEFAULT 163840 // bytes
 
+#define TCP_RING_INIT 16384 // bytes, power of two
+#define TCP_RING_MAX 2097152 // bytes, power of two, caps the receive window
+#define TCP_RING_RANGES 8 // out of order ranges
+
 #define UID_MAX_AGE 30000 // milliseconds
+#define UID_DIAG_TIMEOUT 100 // milliseconds
+#define UID_FILES 6 // tcp, tcp6, udp, udp6, icmp, icmp6
+#define UID_CHUNK 16384 // bytes read at once
+#define UID_SNAPSHOT_INIT 64 // entries and buckets, power of two
+#define UID_CACHE_SETS 256 // power of two
+#define UID_CACHE_WAYS 4 // entries per set, clock eviction
+
+#define UID_BACKEND_NONE 0 // not tried yet
+#define UID_BACKEND_DIAG 1 // sock_diag netlink query
+#define UID_BACKEND_PROC 2 // /proc/net scan
 
 #define SOCKS5_NONE 1
 #define SOCKS5_HELLO 2
@@ -75,12 +185,302 @@
 #define SOCKS5_CONNECT 4
 #define SOCKS5_CONNECTED 5
 
-struct context {
+struct session_key {
+    uint8_t version;
+    uint8_t protocol;
+    __be16 source; // network notation
+    __be16 dest; // network notation
+    uint16_t pad;
+    uint8_t saddr[16]; // network notation, IPv4 zero padded
+    uint8_t daddr[16]; // network notation, IPv4 zero padded
+};
+
+struct session_slot {
+    uint32_t hash;
+    struct session_key key;
+    struct ng_session *session; // NULL = empty
+};
+
+struct session_table {
+    uint32_t size; // slots, power of two
+    uint32_t count;
+    struct session_slot *slots;
+};
+
+struct checksum_variant {
+    const char *name;
+    uint64_t (*sum)(const uint8_t *buffer, size_t length, uint64_t sum); // congruent modulo 0xFFFF
+};
+
+struct timer_wheel {
+    time_t next; // first second not processed yet
+    struct ng_session *due; // expired before next
+    struct ng_session *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+struct blocklist_entry {
+    uint32_t hash;
+    uint32_t offset; // name in pool, 0 = empty
+};
+
+// Compiled image: header, entries sorted by hash, pool
+struct blocklist_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; // entries
+    uint32_t pool_size; // bytes
+};
+
+struct blocklist {
+    void *map;
+    size_t map_size;
+    uint32_t count;
+    const struct blocklist_entry *entries;
+    const char *pool; // flags byte, lower case name, zero
+    uint32_t pool_size;
+};
+
+struct dns_server {
+    uint8_t addr[16]; // network notation, IPv4 zero padded
+    __be16 port; // network notation
+    uint8_t version;
+    uint8_t pad;
+};
+
+struct dns_entry {
+    uint32_t hash;
+    struct dns_server server; // answered by
+    uint16_t flags; // query flags the response depends on
+    uint16_t qlen; // question bytes
+    uint16_t length; // response bytes, following the entry
+    time_t time; // stored
+    time_t expires;
+    struct dns_entry *next; // bucket
+    struct dns_entry *lprev; // recently used first
+    struct dns_entry *lnext;
+};
+
+struct dns_cache {
+    int size; // responses, 0 = disabled
+    int policy;
+    int count;
+    uint32_t buckets; // power of two
+    struct dns_entry **bucket;
+    struct dns_entry *first; // most recently used
+    struct dns_entry *last;
+    uint32_t hits;
+    uint32_t misses;
+    pthread_mutex_t lock; // workers share the cache
+};
+
+struct allowed {
+    char raddr[INET6_ADDRSTRLEN + 1];
+    uint16_t rport; // host notation
+};
+
+struct verdict_key {
+    jint uid;
+    uint8_t version;
+    uint8_t protocol;
+    uint16_t dport; // host notation
+    uint8_t daddr[16]; // network notation, IPv4 zero padded
+};
+
+struct verdict {
+    struct verdict_key key;
+    uint32_t generation; // 0 = empty
+    time_t expires;
+    jboolean allowed;
+    struct allowed redirect;
+};
+
+struct verdict_log {
+    struct verdict_key key;
+    jboolean allowed;
+    char flags[10];
+    char source[INET6_ADDRSTRLEN + 1];
+    uint16_t sport;
+    char data[INET6_ADDRSTRLEN + 10];
+};
+
+struct verdict_cache {
+    struct verdict *slots; // direct mapped
+    uint32_t generation; // bumped by Java when rules change
+    int log; // log hits, set by Java
+    int pending;
+    struct verdict_log queue[VERDICT_LOG];
+};
+
+// Datagram from tun, sent at the end of the batch
+struct udp_send {
+    struct ng_session *session;
+    const uint8_t *data; // in tun buffer
+    size_t datalen;
+};
+
+struct tun_stats {
+    uint32_t wakeups;
+    uint32_t packets;
+    uint32_t full; // wakeups which filled the queue of worker 0
+};
+
+// Active sessions of a worker, read by jni_get_stats without locking
+struct session_count {
+    uint32_t icmp; // not stopped
+    uint32_t udp; // UDP_ACTIVE
+    uint32_t tcp; // not closing or closed
+};
+
+struct epoll_stats {
+    uint32_t size; // current event array size
+    uint32_t hist[EPOLL_HIST]; // wakeups by log2 of the number of events
+};
+
+// Packets from tun for a worker or to tun from a worker, single producer single consumer
+struct packet_queue {
+    uint8_t *buffer; // PACKET_QUEUE buffers of get_mtu() bytes
+    size_t length[PACKET_QUEUE];
+    long long time[PACKET_QUEUE]; // queued, microseconds
+    uint32_t head; // written by the producer
+    uint32_t tail; // written by the consumer
+    uint32_t dropped;
+    uint32_t dequeued;
+    uint32_t delay_max; // microseconds
+    uint64_t delay; // total, microseconds
+};
+
+// Reads tun on its own thread into the queue of worker 0
+struct tun_reader {
+    pthread_t thread;
+    int running;
+    int wakefd; // eventfd, space in the queue or stopping
+    int waiting; // for space in the queue
+    int failed;
+    int error; // errno of the failed read, 0 = empty read, -1 = exception
+};
+
+// struct io_uring_getevents_arg and struct __kernel_timespec, Linux 5.11
+struct uring_wait_arg {
+    uint64_t sigmask;
+    uint32_t sigmask_sz;
+    uint32_t pad;
+    uint64_t ts;
+};
+
+struct uring_timespec {
+    int64_t tv_sec;
+    long long tv_nsec;
+};
+
+struct uring {
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    struct io_uring_sqe *sqes;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local; // tail of prepared entries
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned features; // IORING_FEAT_*
+};
+
+// Writes the packets workers queued for tun on its own thread
+struct tun_writer {
+    pthread_t thread;
+    int running;
+    int stop; // after the workers stopped
+    int wakefd; // eventfd, queued packets or stopping
     pthread_mutex_t lock;
+    pthread_cond_t space; // signalled after draining when workers wait
+    int waiting; // workers
+    int use_uring; // write with io_uring from registered buffers
+    struct uring uring;
+    uint32_t wakeups;
+    uint32_t packets;
+    uint32_t stalls; // workers waiting for space
+    uint32_t retries; // tun not writable, packets kept for the next attempt
+    uint32_t dropped; // write errors or stopping
+    uint32_t syscalls;
+};
+
+struct event {
+    uint32_t events;
+    void *data; // as registered
+};
+
+struct event_loop;
+
+// Readiness notification for the sockets of a worker,
+// releasing and then closing a socket unregisters it
+struct event_backend {
+    const char *name;
+    int (*open)(struct event_loop *loop);
+    void (*close)(struct event_loop *loop);
+    int (*add)(struct event_loop *loop, int fd, uint32_t events, void *data);
+    int (*modify)(struct event_loop *loop, int fd, uint32_t events, void *data);
+    int (*remove)(struct event_loop *loop, int fd);
+    void (*release)(struct event_loop *loop, int fd); // optional, socket will be closed
+    int (*wait)(struct event_loop *loop, struct event *ev, int maxevents, int timeout);
+};
+
+struct event_loop {
+    const struct event_backend *backend;
+    int fd; // backend handle, -1 = closed
+    void *buffer; // backend events
+    int size;
+    void *state; // backend
+    uint32_t syscalls;
+};
+
+// Shard of the sessions with its own thread and event loop
+struct worker {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock; // held while handling events
+    int wakefd; // eventfd, signals queued packets
+    int uid_diag; // sock_diag socket, -1 = not opened
+    struct packet_queue queue; // from tun
+    struct packet_queue out; // to tun
+    int out_pending; // tun writer not signalled yet
+    struct ng_session *ng_session; // iteration order for housekeeping
+    struct session_table table; // lookup by 5-tuple
+    struct timer_wheel wheel; // session expiry
+    int timer_sessions; // session count timeouts were scaled with
+    struct session_count active; // updated when changed sessions are checked
+    struct event_loop loop;
+    struct ng_session *watch; // TCP sessions to update the event interest of
+    uint8_t *udp_buffer; // UDP_YIELD buffers of UDP_SLOT bytes
+    uint8_t *gro_buffer; // UDP_GRO_BUFFER bytes
+    int udp_pending;
+    struct udp_send udp_queue[TUN_YIELD];
+    struct epoll_stats epoll_stats;
+    struct verdict_cache verdicts; // is_address_allowed
+};
+
+struct context {
     int pipefds[2];
     int stopping;
     int sdk;
-    struct ng_session *ng_session;
+    JavaVM *jvm; // to attach worker threads
+    int workers; // set by Java, applies to the next run
+    int nworkers; // running, sessions are sharded by this number
+    struct worker worker[WORKERS_MAX]; // worker 0 runs on the Java thread and reads tun
+    struct tun_reader reader;
+    struct tun_writer writer;
+    int udp_offload; // set by Java
+    int uring; // set by Java, applies to the next run
+    struct tun_stats tun_stats;
+    struct blocklist *blocklist; // swapped with all workers locked
+    struct dns_cache dns_cache; // flushed when the blocklist changes
 };
 
 struct arguments {
@@ -90,20 +490,31 @@ struct arguments {
     jboolean fwd53;
     jint rcode;
     struct context *ctx;
+    struct worker *worker;
 };
 
-struct allowed {
-    char raddr[INET6_ADDRSTRLEN + 1];
-    uint16_t rport; // host notation
+struct tcp_range {
+    uint32_t seq;
+    uint32_t end; // exclusive
 };
 
-struct segment {
-    uint32_t seq;
-    uint16_t len;
-    uint16_t sent;
-    int psh;
-    uint8_t *data;
-    struct segment *next;
+// Data from tun to forward to the socket, stored at seq modulo size
+struct tcp_ring {
+    uint8_t *data; // allocated with the first data
+    uint32_t size; // power of two
+    uint32_t queued; // bytes in ranges
+    uint32_t push; // sequence number after the last PSH
+    int ranges;
+    struct tcp_range range[TCP_RING_RANGES]; // sorted, not adjacent, from remote_seq
+};
+
+struct tun_header {
+    union {
+        struct iphdr ip4;
+        struct ip6_hdr ip6;
+    }; // length and checksum zero
+    uint16_t ipsum; // IPv4 header checksum without length
+    uint16_t pseudo; // pseudo header checksum without length
 };
 
 struct icmp_session {
@@ -124,6 +535,7 @@ struct icmp_session {
     uint16_t id;
 
     uint8_t stop;
+    struct tun_header header; // packets to tun
 };
 
 #define UDP_ACTIVE 0
@@ -152,7 +564,17 @@ struct udp_session {
     } daddr;
     __be16 dest; // network notation
 
+    // Destination or redirect target, resolved once
+    union {
+        struct sockaddr_in addr4;
+        struct sockaddr_in6 addr6;
+    } target;
+    socklen_t target_len;
+    uint8_t connected; // send without address
+    uint8_t offload; // UDP_SEGMENT on send, UDP_GRO on receive
+
     uint8_t state;
+    struct tun_header header; // packets to tun
 };
 
 struct tcp_session {
@@ -174,6 +596,9 @@ struct tcp_session {
     uint32_t acked; // host notation
     long long last_keep_alive;
 
+    uint32_t sndbuf; // socket send buffer size, cached
+    uint32_t unsent; // upper bound of unsent socket data
+
     uint64_t sent;
     uint64_t received;
 
@@ -191,7 +616,8 @@ struct tcp_session {
 
     uint8_t state;
     uint8_t socks5;
-    struct segment *forward;
+    struct tcp_ring forward;
+    struct tun_header header; // packets to tun
 };
 
 struct ng_session {
@@ -202,19 +628,57 @@ struct ng_session {
         struct tcp_session tcp;
     };
     jint socket;
-    struct epoll_event ev;
+    uint32_t events; // registered interest
+    uint8_t counted; // in the active sessions of the worker
     struct ng_session *next;
+    struct ng_session *prev;
+
+    time_t expires; // timer wheel
+    struct ng_session *tnext;
+    struct ng_session **tpprev; // NULL = not scheduled
+
+    struct ng_session *wnext; // event interest to update
+    struct ng_session **wpprev; // NULL = not watched
+};
+
+struct uid_entry {
+    uint8_t saddr[16];
+    uint8_t daddr[16];
+    uint16_t sport;
+    uint16_t dport;
+    jint uid;
+    int32_t next; // same bucket, -1 = end
 };
 
+// Resolved uids by 5-tuple, fixed size
 struct uid_cache_entry {
     uint8_t version;
     uint8_t protocol;
-    uint8_t saddr[16];
+    uint8_t used; // clock reference
     uint16_t sport;
-    uint8_t daddr[16];
     uint16_t dport;
+    uint8_t saddr[16];
+    uint8_t daddr[16];
     jint uid;
-    long time;
+    long long time; // milliseconds, 0 = empty
+};
+
+struct uid_cache {
+    struct uid_cache_entry entries[UID_CACHE_SETS][UID_CACHE_WAYS];
+    uint8_t hand[UID_CACHE_SETS];
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+};
+
+// Parsed /proc/net file indexed by source port
+struct uid_snapshot {
+    long time; // milliseconds, 0 = none
+    int count;
+    int size; // entries allocated
+    struct uid_entry *entries;
+    uint32_t buckets; // power of two
+    int32_t *bucket; // first entry, -1 = empty
 };
 
 // IPv6
@@ -259,6 +723,8 @@ typedef struct pcaprec_hdr_s {
 #define DNS_QTYPE_A 1 // IPv4
 #define DNS_QTYPE_AAAA 28 // IPv6
 
+#define DNS_QTYPE_OPT 41 // EDNS
+
 #define DNS_SVCB 64
 #define DNS_HTTPS 65
 
@@ -345,7 +811,39 @@ void report_error(const struct arguments *args, jint error, const char *fmt, ...
 
 void check_allowed(const struct arguments *args);
 
-void clear(struct context *ctx);
+void clear(struct worker *w);
+
+void get_session_key(struct session_key *key,
+                     uint8_t version, uint8_t protocol,
+                     const void *saddr, __be16 source,
+                     const void *daddr, __be16 dest);
+
+void get_packet_key(struct session_key *key,
+                    const uint8_t *pkt, uint8_t protocol, __be16 source, __be16 dest);
+
+struct ng_session *find_session(const struct worker *w, const struct session_key *key);
+
+void add_session(struct worker *w, struct ng_session *s);
+
+void delete_session(struct worker *w, struct ng_session *s);
+
+void schedule_session(struct worker *w, struct ng_session *s, time_t expires);
+
+void activate_session(struct worker *w, struct ng_session *s);
+
+void count_session(struct worker *w, struct ng_session *s);
+
+struct ng_session *get_due_sessions(struct worker *w, time_t now);
+
+time_t get_next_timer(const struct worker *w);
+
+void watch_session(struct worker *w, struct ng_session *s);
+
+int update_watched(const struct arguments *args);
+
+time_t get_session_expiry(const struct ng_session *s, int sessions, int maxsessions);
+
+void free_sessions(struct worker *w);
 
 int check_icmp_session(const struct arguments *args,
                        struct ng_session *s,
@@ -359,7 +857,7 @@ int check_tcp_session(const struct arguments *args,
                       struct ng_session *s,
                       int sessions, int maxsessions);
 
-int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd);
+int monitor_tcp_session(const struct arguments *args, struct ng_session *s);
 
 int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions);
 
@@ -371,14 +869,92 @@ uint16_t get_mtu();
 
 uint16_t get_default_mss(int version);
 
-int check_tun(const struct arguments *args,
-              const struct epoll_event *ev,
-              const int epoll_fd,
-              int sessions, int maxsessions);
+void init_tun_header(struct tun_header *header, int version, uint8_t protocol,
+                     const void *saddr, const void *daddr);
+
+size_t build_tun_header(const struct tun_header *header, uint8_t *buffer,
+                        size_t plen, uint16_t *csum);
+
+ssize_t write_tun(const struct arguments *args, const struct iovec *iov, int iovcnt);
+
+void flush_tun(const struct arguments *args);
+
+int start_tun_writer(const struct arguments *args);
+
+void stop_tun_writer(struct context *ctx);
+
+int init_uring(struct uring *u, unsigned entries);
+
+void free_uring(struct uring *u);
+
+int register_uring_buffers(struct uring *u, const struct iovec *iov, unsigned count);
+
+struct io_uring_sqe *get_uring_sqe(struct uring *u);
+
+int submit_uring(struct uring *u, unsigned wait);
+
+struct io_uring_cqe *peek_uring_cqe(struct uring *u);
+
+void seen_uring_cqe(struct uring *u);
+
+int wait_uring(struct uring *u, unsigned wait, int timeout);
+
+int start_tun_reader(const struct arguments *args);
 
-void check_icmp_socket(const struct arguments *args, const struct epoll_event *ev);
+void stop_tun_reader(struct context *ctx);
 
-void check_udp_socket(const struct arguments *args, const struct epoll_event *ev);
+void handle_tun(const struct arguments *args,
+                const uint8_t *pkt, size_t length,
+                int sessions, int maxsessions,
+                int *wake);
+
+void resume_tun_reader(struct context *ctx);
+
+int check_tun(const struct arguments *args);
+
+void check_icmp_socket(const struct arguments *args, const struct event *ev);
+
+void check_udp_socket(const struct arguments *args, const struct event *ev);
+
+void flush_udp(const struct arguments *args);
+
+void init_worker(struct context *ctx, int id);
+
+void free_worker(struct worker *w);
+
+void lock_workers(struct context *ctx);
+
+void unlock_workers(struct context *ctx);
+
+void start_workers(const struct arguments *args);
+
+void stop_workers(struct context *ctx);
+
+int get_shard(const struct context *ctx, const uint8_t *pkt, size_t length);
+
+int queue_packet(struct worker *w, const uint8_t *pkt, size_t length);
+
+void wake_worker(struct worker *w);
+
+int check_queue(const struct arguments *args, int sessions, int maxsessions);
+
+extern const struct event_backend epoll_backend;
+
+extern const struct event_backend uring_backend;
+
+int open_event_loop(struct event_loop *loop, const struct event_backend *backend);
+
+void close_event_loop(struct event_loop *loop);
+
+int register_event(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+int modify_event(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+int unregister_event(struct event_loop *loop, int fd);
+
+void release_event(struct event_loop *loop, int fd);
+
+int wait_events(struct event_loop *loop, struct event *ev, int maxevents, int timeout);
 
 int32_t get_qname(const uint8_t *data, const size_t datalen, uint16_t off, char *qname);
 
@@ -387,28 +963,26 @@ void parse_dns_response(const struct arguments *args, const struct ng_session *s
 
 uint32_t get_send_window(const struct tcp_session *cur);
 
-uint32_t get_receive_buffer(const struct ng_session *cur);
+uint32_t get_receive_buffer(struct ng_session *cur);
 
-uint32_t get_receive_window(const struct ng_session *cur);
+uint32_t get_receive_window(struct ng_session *cur);
 
-void check_tcp_socket(const struct arguments *args,
-                      const struct epoll_event *ev,
-                      const int epoll_fd);
+void check_tcp_socket(const struct arguments *args, const struct event *ev);
 
 int is_lower_layer(int protocol);
 
 int is_upper_layer(int protocol);
 
+size_t get_ip6_payload(const uint8_t *pkt, size_t length, uint8_t *protocol);
+
 void handle_ip(const struct arguments *args,
                const uint8_t *buffer, size_t length,
-               const int epoll_fd,
                int sessions, int maxsessions);
 
 jboolean handle_icmp(const struct arguments *args,
                      const uint8_t *pkt, size_t length,
                      const uint8_t *payload,
-                     int uid,
-                     const int epoll_fd);
+                     int uid);
 
 int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload);
 
@@ -420,19 +994,19 @@ void block_udp(const struct arguments *args,
 jboolean handle_udp(const struct arguments *args,
                     const uint8_t *pkt, size_t length,
                     const uint8_t *payload,
-                    int uid, struct allowed *redirect,
-                    const int epoll_fd);
+                    int uid, struct allowed *redirect);
 
 int check_dhcp(const struct arguments *args, const struct udp_session *u,
                const uint8_t *data, const size_t datalen);
 
 void clear_tcp_data(struct tcp_session *cur);
 
+uint32_t get_tcp_data(const struct tcp_session *cur);
+
 jboolean handle_tcp(const struct arguments *args,
                     const uint8_t *pkt, size_t length,
                     const uint8_t *payload,
-                    int uid, int allowed, struct allowed *redirect,
-                    const int epoll_fd);
+                    int uid, int allowed, struct allowed *redirect);
 
 void queue_tcp(const struct arguments *args,
                const struct tcphdr *tcphdr,
@@ -441,8 +1015,7 @@ void queue_tcp(const struct arguments *args,
 
 int open_icmp_socket(const struct arguments *args, const struct icmp_session *cur);
 
-int open_udp_socket(const struct arguments *args,
-                    const struct udp_session *cur, const struct allowed *redirect);
+int open_udp_socket(const struct arguments *args, struct udp_session *cur);
 
 int open_tcp_socket(const struct arguments *args,
                     const struct tcp_session *cur, const struct allowed *redirect);
@@ -476,10 +1049,25 @@ uint8_t char2nible(const char c);
 
 void hex2bytes(const char *hex, uint8_t *buffer);
 
-jint get_uid(const int version, const int protocol,
+jint get_uid(struct worker *w, const int version, const int protocol,
              const void *saddr, const uint16_t sport,
              const void *daddr, const uint16_t dport);
 
+jint get_uid_diag(struct worker *w, const int version, const int protocol,
+                  const void *saddr, const uint16_t sport,
+                  const void *daddr, const uint16_t dport);
+
+jint get_cached_uid(const int version, const int protocol,
+                    const void *saddr, const uint16_t sport,
+                    const void *daddr, const uint16_t dport);
+
+void put_cached_uid(const int version, const int protocol,
+                    const void *saddr, const uint16_t sport,
+                    const void *daddr, const uint16_t dport,
+                    jint uid);
+
+void clear_uid_cache();
+
 jint get_uid_sub(const int version, const int protocol,
                  const void *saddr, const uint16_t sport,
                  const void *daddr, const uint16_t dport,
@@ -488,8 +1076,14 @@ jint get_uid_sub(const int version, const int protocol,
 
 int protect_socket(const struct arguments *args, int socket);
 
+int get_checksum_variants(struct checksum_variant *variant);
+
+void init_checksum();
+
 uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length);
 
+uint16_t update_checksum(uint16_t check, const void *from, const void *to, size_t length);
+
 jobject jniGlobalRef(JNIEnv *env, jobject cls);
 
 jclass jniFindClass(JNIEnv *env, const char *name);
@@ -511,8 +1105,28 @@ void log_packet(const struct arguments *args, jobject jpacket);
 void dns_resolved(const struct arguments *args,
                   const char *qname, const char *aname, const char *resource, int ttl);
 
+int compile_blocklist(const char *hosts, const char *image);
+
+struct blocklist *map_blocklist(const char *image);
+
+int is_blocklisted(const struct blocklist *bl, const char *name);
+
+void free_blocklist(struct blocklist *bl);
+
 jboolean is_domain_blocked(const struct arguments *args, const char *name);
 
+void set_dns_cache(struct dns_cache *dc, int size, int policy);
+
+void clear_dns_cache(struct dns_cache *dc);
+
+void free_dns_cache(struct dns_cache *dc);
+
+void store_dns_response(struct dns_cache *dc, const struct sockaddr *server,
+                        const uint8_t *data, size_t datalen, uint32_t ttl);
+
+size_t get_dns_response(struct dns_cache *dc, const struct sockaddr *server,
+                        const uint8_t *query, size_t querylen, uint8_t *response);
+
 jint get_uid_q(const struct arguments *args,
                jint version,
                jint protocol,
@@ -521,7 +1135,30 @@ jint get_uid_q(const struct arguments *args,
                const char *dest,
                jint dport);
 
-struct allowed *is_address_allowed(const struct arguments *args, jobject objPacket);
+// Fills and returns the caller's allowed, NULL if not allowed
+struct allowed *is_address_allowed(const struct arguments *args, jobject objPacket,
+                                   struct allowed *allowed);
+
+void init_verdicts(struct verdict_cache *vc);
+
+void free_verdicts(struct verdict_cache *vc);
+
+void update_verdicts(struct verdict_cache *vc, int log);
+
+void get_verdict_key(struct verdict_key *key,
+                     int version, int protocol, const void *daddr, uint16_t dport, jint uid);
+
+struct verdict *get_verdict(struct verdict_cache *vc,
+                            const struct verdict_key *key, uint32_t *generation);
+
+void put_verdict(struct verdict_cache *vc,
+                 const struct verdict_key *key, uint32_t generation,
+                 const struct allowed *allowed);
+
+void queue_verdict_log(const struct arguments *args, const struct verdict *v,
+                       const char *flags, const char *source, uint16_t sport, const char *data);
+
+void flush_verdict_log(const struct arguments *args);
 
 jobject create_packet(const struct arguments *args,
                       jint version,
@@ -542,6 +1179,8 @@ void write_pcap_hdr();
 
 void write_pcap_rec(const uint8_t *buffer, size_t len);
 
+void write_pcap_iov(const struct iovec *iov, int iovcnt, size_t len);
+
 void write_pcap(const void *ptr, size_t len);
 
 int compare_u32(uint32_t seq1, uint32_t seq2);
@@ -556,9 +1195,11 @@ int is_writable(int fd);
 
 long long get_ms();
 
-void ng_add_alloc(void *ptr, const char *tag);
+long long get_us();
+
+void ng_add_alloc(const void *ptr, const char *tag);
 
-void ng_delete_alloc(void *ptr, const char *file, int line);
+void ng_delete_alloc(const void *ptr, const char *file, int line);
 
 void *ng_malloc(size_t __byte_count, const char *tag);
 
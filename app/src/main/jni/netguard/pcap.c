@@ -22,6 +22,7 @@
 FILE *pcap_file = NULL;
 size_t pcap_record_size = 64;
 long pcap_file_size = 2 * 1024 * 1024;
+static pthread_mutex_t pcap_lock = PTHREAD_MUTEX_INITIALIZER; // workers write records
 
 void write_pcap_hdr() {
     struct pcap_hdr_s pcap_hdr;
@@ -56,7 +57,37 @@ void write_pcap_rec(const uint8_t *buffer, size_t length) {
     ng_free(pcap_rec, __FILE__, __LINE__);
 }
 
+void write_pcap_iov(const struct iovec *iov, int iovcnt, size_t length) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts))
+        log_android(ANDROID_LOG_ERROR, "clock_gettime error %d: %s", errno, strerror(errno));
+
+    size_t plen = (length < pcap_record_size ? length : pcap_record_size);
+    size_t rlen = sizeof(struct pcaprec_hdr_s) + plen;
+    struct pcaprec_hdr_s *pcap_rec = ng_malloc(rlen, "pcap");
+
+    pcap_rec->ts_sec = (guint32_t) ts.tv_sec;
+    pcap_rec->ts_usec = (guint32_t) (ts.tv_nsec / 1000);
+    pcap_rec->incl_len = (guint32_t) plen;
+    pcap_rec->orig_len = (guint32_t) length;
+
+    uint8_t *rec = ((uint8_t *) pcap_rec) + sizeof(struct pcaprec_hdr_s);
+    for (int i = 0; i < iovcnt && plen > 0; i++) {
+        size_t clen = (iov[i].iov_len < plen ? iov[i].iov_len : plen);
+        memcpy(rec, iov[i].iov_base, clen);
+        rec += clen;
+        plen -= clen;
+    }
+
+    write_pcap(pcap_rec, rlen);
+
+    ng_free(pcap_rec, __FILE__, __LINE__);
+}
+
 void write_pcap(const void *ptr, size_t len) {
+    if (pthread_mutex_lock(&pcap_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
     if (fwrite(ptr, len, 1, pcap_file) < 1)
         log_android(ANDROID_LOG_ERROR, "PCAP fwrite error %d: %s", errno, strerror(errno));
     else {
@@ -75,4 +106,7 @@ void write_pcap(const void *ptr, size_t len) {
             }
         }
     }
+
+    if (pthread_mutex_unlock(&pcap_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
 }
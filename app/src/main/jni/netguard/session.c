@@ -19,8 +19,8 @@
 
 #include "netguard.h"
 
-void clear(struct context *ctx) {
-    struct ng_session *s = ctx->ng_session;
+void clear(struct worker *w) {
+    struct ng_session *s = w->ng_session;
     while (s != NULL) {
         if (s->socket >= 0 && close(s->socket))
             log_android(ANDROID_LOG_ERROR, "close %d error %d: %s",
@@ -31,12 +31,450 @@ void clear(struct context *ctx) {
         s = s->next;
         ng_free(p, __FILE__, __LINE__);
     }
-    ctx->ng_session = NULL;
+    w->ng_session = NULL;
+
+    if (w->table.slots != NULL)
+        memset(w->table.slots, 0, w->table.size * sizeof(struct session_slot));
+    w->table.count = 0;
+    __atomic_store_n(&w->active.icmp, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->active.udp, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->active.tcp, 0, __ATOMIC_RELAXED);
+
+    memset(&w->wheel, 0, sizeof(struct timer_wheel));
+    w->timer_sessions = 0;
+    w->watch = NULL;
+}
+
+// Session table
+// Open addressing with linear probing and backward shift deletion
+
+void get_session_key(struct session_key *key,
+                     uint8_t version, uint8_t protocol,
+                     const void *saddr, __be16 source,
+                     const void *daddr, __be16 dest) {
+    memset(key, 0, sizeof(struct session_key));
+    key->version = version;
+    key->protocol = protocol;
+    key->source = source;
+    key->dest = dest;
+    memcpy(key->saddr, saddr, version == 4 ? 4 : 16);
+    memcpy(key->daddr, daddr, version == 4 ? 4 : 16);
+}
+
+void get_packet_key(struct session_key *key,
+                    const uint8_t *pkt, uint8_t protocol, __be16 source, __be16 dest) {
+    const uint8_t version = (*pkt) >> 4;
+    if (version == 4) {
+        const struct iphdr *ip4 = (struct iphdr *) pkt;
+        get_session_key(key, version, protocol, &ip4->saddr, source, &ip4->daddr, dest);
+    } else {
+        const struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+        get_session_key(key, version, protocol, &ip6->ip6_src, source, &ip6->ip6_dst, dest);
+    }
+}
+
+static void get_key(const struct ng_session *s, struct session_key *key) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        get_session_key(key, (uint8_t) s->icmp.version, s->protocol,
+                        &s->icmp.saddr, 0, &s->icmp.daddr, 0);
+    else if (s->protocol == IPPROTO_UDP)
+        get_session_key(key, (uint8_t) s->udp.version, s->protocol,
+                        &s->udp.saddr, s->udp.source, &s->udp.daddr, s->udp.dest);
+    else
+        get_session_key(key, (uint8_t) s->tcp.version, s->protocol,
+                        &s->tcp.saddr, s->tcp.source, &s->tcp.daddr, s->tcp.dest);
+}
+
+static uint32_t hash_key(const struct session_key *key) {
+    // Word wise multiplicative hashing, the key is a multiple of four bytes
+    const uint8_t *k = (const uint8_t *) key;
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < sizeof(struct session_key); i += sizeof(uint32_t)) {
+        uint32_t w;
+        memcpy(&w, k + i, sizeof(uint32_t));
+        h ^= w;
+        h *= 0x9E3779B1;
+        h ^= h >> 15;
+    }
+    return h;
+}
+
+static void insert_slot(struct session_table *t,
+                        uint32_t hash, const struct session_key *key, struct ng_session *s) {
+    uint32_t mask = t->size - 1;
+    uint32_t i = hash & mask;
+    while (t->slots[i].session != NULL) {
+        if (t->slots[i].hash == hash &&
+            memcmp(&t->slots[i].key, key, sizeof(struct session_key)) == 0) {
+            // Replace lingering session with the same key
+            t->slots[i].session = s;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    t->slots[i].hash = hash;
+    memcpy(&t->slots[i].key, key, sizeof(struct session_key));
+    t->slots[i].session = s;
+    t->count++;
+}
+
+static void grow_table(struct session_table *t) {
+    uint32_t osize = t->size;
+    struct session_slot *oslots = t->slots;
+
+    t->size = (osize == 0 ? SESSION_TABLE_INIT : osize * 2);
+    t->count = 0;
+    t->slots = ng_calloc(t->size, sizeof(struct session_slot), "session table");
+
+    for (uint32_t i = 0; i < osize; i++)
+        if (oslots[i].session != NULL)
+            insert_slot(t, oslots[i].hash, &oslots[i].key, oslots[i].session);
+
+    if (oslots != NULL)
+        ng_free(oslots, __FILE__, __LINE__);
+
+    log_android(ANDROID_LOG_DEBUG, "Session table size %u count %u", t->size, t->count);
+}
+
+struct ng_session *find_session(const struct worker *w, const struct session_key *key) {
+    const struct session_table *t = &w->table;
+    if (t->count == 0)
+        return NULL;
+
+    uint32_t hash = hash_key(key);
+    uint32_t mask = t->size - 1;
+    uint32_t i = hash & mask;
+    while (t->slots[i].session != NULL) {
+        if (t->slots[i].hash == hash &&
+            memcmp(&t->slots[i].key, key, sizeof(struct session_key)) == 0)
+            return t->slots[i].session;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+void add_session(struct worker *w, struct ng_session *s) {
+    struct session_key key;
+    get_key(s, &key);
+
+    // Keep load factor at or below 50%
+    if ((w->table.count + 1) * 2 > w->table.size)
+        grow_table(&w->table);
+    insert_slot(&w->table, hash_key(&key), &key, s);
+
+    s->prev = NULL;
+    s->next = w->ng_session;
+    if (s->next != NULL)
+        s->next->prev = s;
+    w->ng_session = s;
+
+    s->tpprev = NULL;
+    s->wpprev = NULL;
+    s->counted = 0;
+    count_session(w, s);
+    activate_session(w, s);
+}
+
+static void remove_session(struct worker *w, struct ng_session *s) {
+    struct session_table *t = &w->table;
+    if (t->count == 0)
+        return;
+
+    struct session_key key;
+    get_key(s, &key);
+
+    uint32_t hash = hash_key(&key);
+    uint32_t mask = t->size - 1;
+    uint32_t i = hash & mask;
+    while (t->slots[i].session != NULL && t->slots[i].session != s)
+        i = (i + 1) & mask;
+
+    // Not indexed, for example replaced by a newer session
+    if (t->slots[i].session == NULL)
+        return;
+
+    // Shift back following entries of the same probe sequence
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (t->slots[j].session == NULL)
+            break;
+        uint32_t k = t->slots[j].hash & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].session = NULL;
+    t->count--;
+}
+
+static uint32_t *get_session_count(struct worker *w, const struct ng_session *s) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        return &w->active.icmp;
+    else if (s->protocol == IPPROTO_UDP)
+        return &w->active.udp;
+    else
+        return &w->active.tcp;
+}
+
+static int is_active_session(const struct ng_session *s) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        return !s->icmp.stop;
+    else if (s->protocol == IPPROTO_UDP)
+        return (s->udp.state == UDP_ACTIVE);
+    else if (s->protocol == IPPROTO_TCP)
+        return (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE);
+    return 0;
+}
+
+void count_session(struct worker *w, struct ng_session *s) {
+    // Sessions which might change state are activated, so they are counted again when checked
+    uint8_t active = (uint8_t) is_active_session(s);
+    if (active != s->counted) {
+        s->counted = active;
+        if (active)
+            __atomic_add_fetch(get_session_count(w, s), 1, __ATOMIC_RELAXED);
+        else
+            __atomic_sub_fetch(get_session_count(w, s), 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void unwatch_session(struct ng_session *s) {
+    if (s->wpprev == NULL)
+        return;
+    *s->wpprev = s->wnext;
+    if (s->wnext != NULL)
+        s->wnext->wpprev = s->wpprev;
+    s->wnext = NULL;
+    s->wpprev = NULL;
+}
+
+void watch_session(struct worker *w, struct ng_session *s) {
+    // Update the event interest at the start of the next loop
+    if (s->protocol != IPPROTO_TCP || s->wpprev != NULL)
+        return;
+    s->wnext = w->watch;
+    if (s->wnext != NULL)
+        s->wnext->wpprev = &s->wnext;
+    s->wpprev = &w->watch;
+    w->watch = s;
+}
+
+int update_watched(const struct arguments *args) {
+    // Only sessions which changed, or which wait for a window, are checked
+    int recheck = 0;
+    struct ng_session *s = args->worker->watch;
+    args->worker->watch = NULL;
+    while (s != NULL) {
+        // The rest of the detached list stays marked as watched
+        struct ng_session *n = s->wnext;
+        if (n != NULL)
+            n->wpprev = &n;
+        s->wnext = NULL;
+        s->wpprev = NULL;
+
+        if (s->socket >= 0 && monitor_tcp_session(args, s)) {
+            recheck = 1;
+            watch_session(args->worker, s);
+        }
+
+        s = n;
+    }
+    return recheck;
+}
+
+void delete_session(struct worker *w, struct ng_session *s) {
+    if (s->prev == NULL)
+        w->ng_session = s->next;
+    else
+        s->prev->next = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    remove_session(w, s);
+    schedule_session(w, s, -1);
+    unwatch_session(s);
+    if (s->counted) {
+        s->counted = 0;
+        __atomic_sub_fetch(get_session_count(w, s), 1, __ATOMIC_RELAXED);
+    }
+
+    if (s->protocol == IPPROTO_TCP)
+        clear_tcp_data(&s->tcp);
+    ng_free(s, __FILE__, __LINE__);
+}
+
+// Hierarchical timer wheel
+// Level n has TIMER_SLOTS slots of 2^(n * TIMER_BITS) seconds,
+// entries move down a level when the wheel reaches their slot
+
+static void link_timer(struct timer_wheel *w, struct ng_session *s) {
+    struct ng_session **head;
+    time_t expires = s->expires;
+    if (expires < w->next)
+        head = &w->due;
+    else {
+        // Far away timers are placed again when cascaded
+        if (expires - w->next >= TIMER_RANGE - TIMER_SPAN(TIMER_LEVELS - 1))
+            expires = w->next + TIMER_RANGE - TIMER_SPAN(TIMER_LEVELS - 1);
+
+        time_t delta = expires - w->next;
+        int level = 0;
+        while (level < TIMER_LEVELS - 1 && delta >= TIMER_SPAN(level + 1))
+            level++;
+
+        head = &w->slots[level][(expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    }
+
+    s->tnext = *head;
+    if (s->tnext != NULL)
+        s->tnext->tpprev = &s->tnext;
+    s->tpprev = head;
+    *head = s;
+}
+
+static void unlink_timer(struct ng_session *s) {
+    if (s->tpprev == NULL)
+        return;
+    *s->tpprev = s->tnext;
+    if (s->tnext != NULL)
+        s->tnext->tpprev = s->tpprev;
+    s->tnext = NULL;
+    s->tpprev = NULL;
+}
+
+void schedule_session(struct worker *w, struct ng_session *s, time_t expires) {
+    unlink_timer(s);
+    if (expires < 0)
+        return; // cancel
+
+    if (w->wheel.next == 0)
+        w->wheel.next = time(NULL);
+
+    s->expires = expires;
+    link_timer(&w->wheel, s);
+}
+
+void activate_session(struct worker *w, struct ng_session *s) {
+    // Check at the next housekeeping pass
+    if (s->tpprev == NULL || s->expires >= w->wheel.next)
+        schedule_session(w, s, 0);
+    watch_session(w, s);
+}
+
+static struct ng_session *move_slot(struct ng_session **head, struct ng_session *due) {
+    struct ng_session *s = *head;
+    while (s != NULL) {
+        struct ng_session *n = s->tnext;
+        s->tpprev = NULL;
+        s->tnext = due;
+        due = s;
+        s = n;
+    }
+    *head = NULL;
+    return due;
+}
+
+struct ng_session *get_due_sessions(struct worker *w, time_t now) {
+    struct timer_wheel *tw = &w->wheel;
+    struct ng_session *due = move_slot(&tw->due, NULL);
+    if (tw->next == 0 || now + 1 == tw->next)
+        return due;
+
+    if (now - tw->next >= TIMER_RANGE || now + 1 < tw->next) {
+        // Wheel fell behind a full revolution or the clock went back
+        for (int l = 0; l < TIMER_LEVELS; l++)
+            for (int i = 0; i < TIMER_SLOTS; i++)
+                due = move_slot(&tw->slots[l][i], due);
+        tw->next = now + 1;
+        return due;
+    }
+
+    for (; tw->next <= now; tw->next++) {
+        // Cascade higher levels at their slot boundaries
+        for (int l = 1; l < TIMER_LEVELS; l++) {
+            if (tw->next & (TIMER_SPAN(l) - 1))
+                break;
+            struct ng_session *c = move_slot(
+                    &tw->slots[l][(tw->next >> (TIMER_BITS * l)) & (TIMER_SLOTS - 1)], NULL);
+            while (c != NULL) {
+                struct ng_session *n = c->tnext;
+                link_timer(tw, c);
+                c = n;
+            }
+        }
+
+        due = move_slot(&tw->slots[0][tw->next & (TIMER_SLOTS - 1)], due);
+    }
+
+    return due;
+}
+
+time_t get_next_timer(const struct worker *w) {
+    const struct timer_wheel *tw = &w->wheel;
+    if (tw->next == 0)
+        return 0;
+    if (tw->due != NULL)
+        return tw->next - 1;
+
+    for (int i = 0; i < TIMER_SLOTS; i++)
+        if (tw->slots[0][(tw->next + i) & (TIMER_SLOTS - 1)] != NULL)
+            return tw->next + i;
+
+    // Entries of higher levels are due no earlier than their cascade
+    time_t next = 0;
+    for (int l = 1; l < TIMER_LEVELS; l++) {
+        int shift = TIMER_BITS * l;
+        time_t first = (tw->next + TIMER_SPAN(l) - 1) >> shift;
+        for (int i = 0; i < TIMER_SLOTS; i++) {
+            time_t index = first + i;
+            if (tw->slots[l][index & (TIMER_SLOTS - 1)] != NULL) {
+                time_t cascade = index << shift;
+                if (next == 0 || cascade < next)
+                    next = cascade;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+time_t get_session_expiry(const struct ng_session *s, int sessions, int maxsessions) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+        if (s->icmp.stop)
+            return 0;
+        return s->icmp.time + get_icmp_timeout(&s->icmp, sessions, maxsessions) + 1;
+
+    } else if (s->protocol == IPPROTO_UDP) {
+        if (s->udp.state == UDP_ACTIVE)
+            return s->udp.time + get_udp_timeout(&s->udp, sessions, maxsessions) + 1;
+        else if (s->udp.state == UDP_FINISHING)
+            return 0;
+        else
+            return s->udp.time + UDP_KEEP_TIMEOUT + 1;
+
+    } else {
+        if (s->tcp.state == TCP_CLOSING)
+            return 0;
+        else if (s->tcp.state == TCP_CLOSE)
+            return s->tcp.time + TCP_KEEP_TIMEOUT + 1;
+        else
+            return s->tcp.time + get_tcp_timeout(&s->tcp, sessions, maxsessions) + 1;
+    }
+}
+
+void free_sessions(struct worker *w) {
+    if (w->table.slots != NULL)
+        ng_free(w->table.slots, __FILE__, __LINE__);
+    w->table.slots = NULL;
+    w->table.size = 0;
+    w->table.count = 0;
 }
 
 void *handle_events(void *a) {
     struct arguments *args = (struct arguments *) a;
-    log_android(ANDROID_LOG_WARN, "Start events tun=%d", args->tun);
+    log_android(ANDROID_LOG_WARN, "Start events tun=%d worker %d", args->tun, args->worker->id);
 
     // Get max number of sessions
     int maxsessions = SESSION_MAX;
@@ -50,161 +488,169 @@ void *handle_events(void *a) {
         log_android(ANDROID_LOG_WARN, "getrlimit soft %d hard %d max sessions %d",
                     rlim.rlim_cur, rlim.rlim_max, maxsessions);
     }
+    maxsessions /= args->ctx->nworkers; // per shard
 
     // Terminate existing sessions not allowed anymore
     check_allowed(args);
 
-    // Open epoll file
-    int epoll_fd = epoll_create(1);
-    if (epoll_fd < 0) {
-        log_android(ANDROID_LOG_ERROR, "epoll create error %d: %s", errno, strerror(errno));
-        report_exit(args, "epoll create error %d: %s", errno, strerror(errno));
+    // Open event loop, io_uring if enabled and available, else epoll
+    struct event_loop *loop = &args->worker->loop;
+    int err = -1;
+    if (args->ctx->uring) {
+        err = open_event_loop(loop, &uring_backend);
+        if (err) {
+            log_android(ANDROID_LOG_WARN, "%s not available error %d: %s",
+                        loop->backend->name, errno, strerror(errno));
+            close_event_loop(loop);
+        }
+    }
+    if (err && open_event_loop(loop, &epoll_backend)) {
+        log_android(ANDROID_LOG_ERROR, "%s create error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
+        report_exit(args, "%s create error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
         args->ctx->stopping = 1;
     }
+    log_android(ANDROID_LOG_WARN, "Events worker %d %s", args->worker->id, loop->backend->name);
 
     // Monitor stop events
-    struct epoll_event ev_pipe;
-    memset(&ev_pipe, 0, sizeof(struct epoll_event));
-    ev_pipe.events = EPOLLIN | EPOLLERR;
-    ev_pipe.data.ptr = &ev_pipe;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->ctx->pipefds[0], &ev_pipe)) {
-        log_android(ANDROID_LOG_ERROR, "epoll add pipe error %d: %s", errno, strerror(errno));
-        report_exit(args, "epoll add pipe error %d: %s", errno, strerror(errno));
+    int pipe_data;
+    if (args->worker->id == 0 &&
+        register_event(loop, args->ctx->pipefds[0], EVENT_IN | EVENT_ERR, &pipe_data)) {
+        log_android(ANDROID_LOG_ERROR, "%s add pipe error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
+        report_exit(args, "%s add pipe error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
         args->ctx->stopping = 1;
     }
 
-    // Monitor tun events
-    struct epoll_event ev_tun;
-    memset(&ev_tun, 0, sizeof(struct epoll_event));
-    ev_tun.events = EPOLLIN | EPOLLERR;
-    ev_tun.data.ptr = NULL;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
-        log_android(ANDROID_LOG_ERROR, "epoll add tun error %d: %s", errno, strerror(errno));
-        report_exit(args, "epoll add tun error %d: %s", errno, strerror(errno));
+    // Monitor packets queued by the tun reader or worker 0
+    if (register_event(loop, args->worker->wakefd, EVENT_IN | EVENT_ERR, NULL)) {
+        log_android(ANDROID_LOG_ERROR, "%s add queue error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
+        report_exit(args, "%s add queue error %d: %s",
+                    loop->backend->name, errno, strerror(errno));
         args->ctx->stopping = 1;
     }
 
+    // Event array, sized to the load
+    int nevents = EPOLL_EVENTS;
+    int underused = 0;
+    struct event *ev = ng_malloc(nevents * sizeof(struct event), "events");
+    args->worker->epoll_stats.size = (uint32_t) nevents;
+
     // Loop
     long long last_check = 0;
     while (!args->ctx->stopping) {
         log_android(ANDROID_LOG_DEBUG, "Loop");
 
-        int recheck = 0;
         int timeout = EPOLL_TIMEOUT;
 
-        // Count sessions
-        int isessions = 0;
-        int usessions = 0;
-        int tsessions = 0;
-        struct ng_session *s = args->ctx->ng_session;
-        while (s != NULL) {
-            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                if (!s->icmp.stop)
-                    isessions++;
-            } else if (s->protocol == IPPROTO_UDP) {
-                if (s->udp.state == UDP_ACTIVE)
-                    usessions++;
-            } else if (s->protocol == IPPROTO_TCP) {
-                if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                    tsessions++;
-                if (s->socket >= 0)
-                    recheck = recheck | monitor_tcp_session(args, s, epoll_fd);
-            }
-            s = s->next;
-        }
-        int sessions = isessions + usessions + tsessions;
-
         // Check sessions
+        struct ng_session *s;
+        time_t now = time(NULL);
         long long ms = get_ms();
-        if (ms - last_check > EPOLL_MIN_CHECK) {
+        int check = (ms - last_check > EPOLL_MIN_CHECK);
+
+        // Active sessions, counted when added or checked
+        struct session_count *active = &args->worker->active;
+        int sessions = (int) (active->icmp + active->udp + active->tcp);
+
+        if (check) {
             last_check = ms;
 
-            time_t now = time(NULL);
-            struct ng_session *sl = NULL;
-            s = args->ctx->ng_session;
+            // Timeouts shrink with the number of sessions
+            // so reschedule all sessions when their number grew substantially
+            if (sessions > args->worker->timer_sessions + maxsessions * TIMER_RESCAN / 100) {
+                log_android(ANDROID_LOG_DEBUG, "Rescheduling sessions %d > %d",
+                            sessions, args->worker->timer_sessions);
+                for (s = args->worker->ng_session; s != NULL; s = s->next)
+                    activate_session(args->worker, s);
+                args->worker->timer_sessions = sessions;
+            } else if (sessions < args->worker->timer_sessions)
+                args->worker->timer_sessions = sessions;
+
+            // Only sessions which are due
+            s = get_due_sessions(args->worker, now);
             while (s != NULL) {
+                struct ng_session *n = s->tnext;
+                s->tnext = NULL;
+
                 int del = 0;
-                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
                     del = check_icmp_session(args, s, sessions, maxsessions);
-                    if (!s->icmp.stop && !del) {
-                        int stimeout = s->icmp.time +
-                                       get_icmp_timeout(&s->icmp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_UDP) {
+                else if (s->protocol == IPPROTO_UDP)
                     del = check_udp_session(args, s, sessions, maxsessions);
-                    if (s->udp.state == UDP_ACTIVE && !del) {
-                        int stimeout = s->udp.time +
-                                       get_udp_timeout(&s->udp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_TCP) {
+                else if (s->protocol == IPPROTO_TCP)
                     del = check_tcp_session(args, s, sessions, maxsessions);
-                    if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE && !del) {
-                        int stimeout = s->tcp.time +
-                                       get_tcp_timeout(&s->tcp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                }
-
-                if (del) {
-                    if (sl == NULL)
-                        args->ctx->ng_session = s->next;
-                    else
-                        sl->next = s->next;
 
-                    struct ng_session *c = s;
-                    s = s->next;
-                    if (c->protocol == IPPROTO_TCP)
-                        clear_tcp_data(&c->tcp);
-                    ng_free(c, __FILE__, __LINE__);
-                } else {
-                    sl = s;
-                    s = s->next;
+                if (del)
+                    delete_session(args->worker, s);
+                else {
+                    count_session(args->worker, s);
+                    schedule_session(args->worker, s,
+                                     get_session_expiry(s, sessions, maxsessions));
+                    watch_session(args->worker, s);
                 }
+
+                s = n;
             }
-        } else {
-            recheck = 1;
+        } else
             log_android(ANDROID_LOG_DEBUG, "Skipped session checks");
+
+        // Update the event interest of sessions which changed
+        int recheck = update_watched(args);
+
+        time_t next = get_next_timer(args->worker);
+        if (next > 0) {
+            if (next <= now)
+                recheck = 1;
+            else if (next - now < timeout)
+                timeout = (int) (next - now);
         }
 
         log_android(ANDROID_LOG_DEBUG,
                     "sessions ICMP %d UDP %d TCP %d max %d/%d timeout %d recheck %d",
-                    isessions, usessions, tsessions, sessions, maxsessions, timeout, recheck);
+                    active->icmp, active->udp, active->tcp, sessions, maxsessions,
+                    timeout, recheck);
+
+        // Let the tun writer write what was queued meanwhile
+        flush_tun(args);
 
         // Poll
-        struct epoll_event ev[EPOLL_EVENTS];
-        int ready = epoll_wait(epoll_fd, ev, EPOLL_EVENTS,
-                               recheck ? EPOLL_MIN_CHECK : timeout * 1000);
+        int ready = wait_events(loop, ev, nevents,
+                                recheck ? EPOLL_MIN_CHECK : timeout * 1000);
 
         if (ready < 0) {
             if (errno == EINTR) {
-                log_android(ANDROID_LOG_DEBUG, "epoll interrupted tun %d", args->tun);
+                log_android(ANDROID_LOG_DEBUG, "%s interrupted tun %d",
+                            loop->backend->name, args->tun);
                 continue;
             } else {
                 log_android(ANDROID_LOG_ERROR,
-                            "epoll tun %d error %d: %s",
-                            args->tun, errno, strerror(errno));
-                report_exit(args, "epoll tun %d error %d: %s",
-                            args->tun, errno, strerror(errno));
+                            "%s tun %d error %d: %s",
+                            loop->backend->name, args->tun, errno, strerror(errno));
+                report_exit(args, "%s tun %d error %d: %s",
+                            loop->backend->name, args->tun, errno, strerror(errno));
                 break;
             }
         }
 
         if (ready == 0)
-            log_android(ANDROID_LOG_DEBUG, "epoll timeout");
+            log_android(ANDROID_LOG_DEBUG, "%s timeout", loop->backend->name);
         else {
+            int bucket = 0;
+            while (bucket < EPOLL_HIST - 1 && (ready >> (bucket + 1)) > 0)
+                bucket++;
+            args->worker->epoll_stats.hist[bucket]++;
 
-            if (pthread_mutex_lock(&args->ctx->lock))
+            if (pthread_mutex_lock(&args->worker->lock))
                 log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
 
             int error = 0;
 
             for (int i = 0; i < ready; i++) {
-                if (ev[i].data.ptr == &ev_pipe) {
+                if (ev[i].data == &pipe_data) {
                     // Check pipe
                     uint8_t buffer[1];
                     if (read(args->ctx->pipefds[0], buffer, 1) < 0)
@@ -213,81 +659,90 @@ void *handle_events(void *a) {
                     else
                         log_android(ANDROID_LOG_WARN, "Read pipe");
 
-                } else if (ev[i].data.ptr == NULL) {
-                    // Check upstream
-                    log_android(ANDROID_LOG_DEBUG, "epoll ready %d/%d in %d out %d err %d hup %d",
-                                i, ready,
-                                (ev[i].events & EPOLLIN) != 0,
-                                (ev[i].events & EPOLLOUT) != 0,
-                                (ev[i].events & EPOLLERR) != 0,
-                                (ev[i].events & EPOLLHUP) != 0);
-
-                    int count = 0;
-                    while (count < TUN_YIELD && !error && !args->ctx->stopping &&
-                           is_readable(args->tun)) {
-                        count++;
-                        if (check_tun(args, &ev[i], epoll_fd, sessions, maxsessions) < 0)
-                            error = 1;
-                    }
+                } else if (ev[i].data == NULL) {
+                    // Check packets from tun
+                    log_android(ANDROID_LOG_DEBUG, "ready %d/%d queue", i, ready);
+                    if (check_queue(args, sessions, maxsessions) < 0)
+                        error = 1;
 
                 } else {
                     // Check downstream
                     log_android(ANDROID_LOG_DEBUG,
-                                "epoll ready %d/%d in %d out %d err %d hup %d prot %d sock %d",
+                                "ready %d/%d in %d out %d err %d hup %d prot %d sock %d",
                                 i, ready,
-                                (ev[i].events & EPOLLIN) != 0,
-                                (ev[i].events & EPOLLOUT) != 0,
-                                (ev[i].events & EPOLLERR) != 0,
-                                (ev[i].events & EPOLLHUP) != 0,
-                                ((struct ng_session *) ev[i].data.ptr)->protocol,
-                                ((struct ng_session *) ev[i].data.ptr)->socket);
-
-                    struct ng_session *session = (struct ng_session *) ev[i].data.ptr;
+                                (ev[i].events & EVENT_IN) != 0,
+                                (ev[i].events & EVENT_OUT) != 0,
+                                (ev[i].events & EVENT_ERR) != 0,
+                                (ev[i].events & EVENT_HUP) != 0,
+                                ((struct ng_session *) ev[i].data)->protocol,
+                                ((struct ng_session *) ev[i].data)->socket);
+
+                    struct ng_session *session = (struct ng_session *) ev[i].data;
                     if (session->protocol == IPPROTO_ICMP ||
                         session->protocol == IPPROTO_ICMPV6)
                         check_icmp_socket(args, &ev[i]);
-                    else if (session->protocol == IPPROTO_UDP) {
-                        int count = 0;
-                        while (count < UDP_YIELD && !args->ctx->stopping &&
-                               !(ev[i].events & EPOLLERR) && (ev[i].events & EPOLLIN) &&
-                               is_readable(session->socket)) {
-                            count++;
-                            check_udp_socket(args, &ev[i]);
-                        }
-                    } else if (session->protocol == IPPROTO_TCP)
-                        check_tcp_socket(args, &ev[i], epoll_fd);
+                    else if (session->protocol == IPPROTO_UDP)
+                        check_udp_socket(args, &ev[i]);
+                    else if (session->protocol == IPPROTO_TCP)
+                        check_tcp_socket(args, &ev[i]);
+
+                    activate_session(args->worker, session);
                 }
 
                 if (error)
                     break;
             }
 
-            if (pthread_mutex_unlock(&args->ctx->lock))
+            if (pthread_mutex_unlock(&args->worker->lock))
                 log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
 
             if (error)
                 break;
         }
+
+        // Grow toward the number of sockets (sessions, queue and pipe) when full,
+        // shrink when mostly unused for a while
+        int size = nevents;
+        if (ready == nevents) {
+            underused = 0;
+            if (nevents < EPOLL_EVENTS_MAX && (uint32_t) nevents < args->worker->table.count + 2)
+                size = nevents * 2;
+        } else if (ready < nevents / 4 && nevents > EPOLL_EVENTS) {
+            if (++underused >= EPOLL_SHRINK) {
+                underused = 0;
+                size = nevents / 2;
+            }
+        } else
+            underused = 0;
+
+        if (size != nevents) {
+            log_android(ANDROID_LOG_DEBUG, "events %d > %d", nevents, size);
+            ng_free(ev, __FILE__, __LINE__);
+            nevents = size;
+            ev = ng_malloc(nevents * sizeof(struct event), "events");
+            args->worker->epoll_stats.size = (uint32_t) nevents;
+        }
     }
 
-    // Close epoll file
-    if (epoll_fd >= 0 && close(epoll_fd))
-        log_android(ANDROID_LOG_ERROR,
-                    "epoll close error %d: %s", errno, strerror(errno));
+    ng_free(ev, __FILE__, __LINE__);
+
+    // Close event loop
+    close_event_loop(loop);
+
+    log_android(ANDROID_LOG_WARN, "Stopped events tun=%d worker %d", args->tun, args->worker->id);
 
     // Cleanup
     ng_free(args, __FILE__, __LINE__);
 
-    log_android(ANDROID_LOG_WARN, "Stopped events tun=%d", args->tun);
     return NULL;
 }
 
 void check_allowed(const struct arguments *args) {
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
+    struct allowed allowed;
 
-    struct ng_session *l = NULL;
-    struct ng_session *s = args->ctx->ng_session;
+    struct ng_session *s = args->worker->ng_session;
     while (s != NULL) {
         if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
             if (!s->icmp.stop) {
@@ -302,8 +757,9 @@ void check_allowed(const struct arguments *args) {
                 jobject objPacket = create_packet(
                         args, s->icmp.version, IPPROTO_ICMP, "",
                         source, 0, dest, 0, "", s->icmp.uid, 0);
-                if (is_address_allowed(args, objPacket) == NULL) {
+                if (is_address_allowed(args, objPacket, &allowed) == NULL) {
                     s->icmp.stop = 1;
+                    activate_session(args->worker, s);
                     log_android(ANDROID_LOG_WARN, "ICMP terminate %d uid %d",
                                 s->socket, s->icmp.uid);
                 }
@@ -322,22 +778,18 @@ void check_allowed(const struct arguments *args) {
                 jobject objPacket = create_packet(
                         args, s->udp.version, IPPROTO_UDP, "",
                         source, ntohs(s->udp.source), dest, ntohs(s->udp.dest), "", s->udp.uid, 0);
-                if (is_address_allowed(args, objPacket) == NULL) {
+                if (is_address_allowed(args, objPacket, &allowed) == NULL) {
                     s->udp.state = UDP_FINISHING;
+                    activate_session(args->worker, s);
                     log_android(ANDROID_LOG_WARN, "UDP terminate session socket %d uid %d",
                                 s->socket, s->udp.uid);
                 }
             } else if (s->udp.state == UDP_BLOCKED) {
                 log_android(ANDROID_LOG_WARN, "UDP remove blocked session uid %d", s->udp.uid);
 
-                if (l == NULL)
-                    args->ctx->ng_session = s->next;
-                else
-                    l->next = s->next;
-
                 struct ng_session *c = s;
                 s = s->next;
-                ng_free(c, __FILE__, __LINE__);
+                delete_session(args->worker, c);
                 continue;
             }
 
@@ -354,8 +806,9 @@ void check_allowed(const struct arguments *args) {
                 jobject objPacket = create_packet(
                         args, s->tcp.version, IPPROTO_TCP, "",
                         source, ntohs(s->tcp.source), dest, ntohs(s->tcp.dest), "", s->tcp.uid, 0);
-                if (is_address_allowed(args, objPacket) == NULL) {
+                if (is_address_allowed(args, objPacket, &allowed) == NULL) {
                     write_rst(args, &s->tcp);
+                    activate_session(args->worker, s);
                     log_android(ANDROID_LOG_WARN, "TCP terminate socket %d uid %d",
                                 s->socket, s->tcp.uid);
                 }
@@ -363,7 +816,6 @@ void check_allowed(const struct arguments *args) {
 
         }
 
-        l = s;
         s = s->next;
     }
 }
@@ -24,15 +24,79 @@ extern int socks5_port;
 extern char socks5_username[127 + 1];
 extern char socks5_password[127 + 1];
 
-extern FILE *pcap_file;
 
 void clear_tcp_data(struct tcp_session *cur) {
-    struct segment *s = cur->forward;
-    while (s != NULL) {
-        struct segment *p = s;
-        s = s->next;
-        ng_free(p->data, __FILE__, __LINE__);
-        ng_free(p, __FILE__, __LINE__);
+    if (cur->forward.data != NULL)
+        ng_free(cur->forward.data, __FILE__, __LINE__);
+    memset(&cur->forward, 0, sizeof(struct tcp_ring));
+}
+
+uint32_t get_tcp_data(const struct tcp_session *cur) {
+    // Bytes that can be forwarded in order
+    const struct tcp_ring *r = &cur->forward;
+    if (r->ranges > 0 && r->range[0].seq == cur->remote_seq)
+        return r->range[0].end - r->range[0].seq;
+    return 0;
+}
+
+static int get_ring_iov(const struct tcp_ring *r, uint32_t seq, uint32_t len,
+                        struct iovec *iov) {
+    uint32_t off = seq & (r->size - 1);
+    uint32_t first = (len < r->size - off ? len : r->size - off);
+    iov[0].iov_base = r->data + off;
+    iov[0].iov_len = first;
+    if (first == len)
+        return 1;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+static void write_ring(struct tcp_ring *r, uint32_t seq, const uint8_t *data, uint32_t len) {
+    struct iovec iov[2];
+    int count = get_ring_iov(r, seq, len, iov);
+    memcpy(iov[0].iov_base, data, iov[0].iov_len);
+    if (count > 1)
+        memcpy(iov[1].iov_base, data + iov[0].iov_len, iov[1].iov_len);
+}
+
+static int grow_ring(struct tcp_ring *r, uint32_t need) {
+    if (need > TCP_RING_MAX)
+        return -1;
+
+    struct tcp_ring n = *r;
+    n.size = (r->size ? r->size : TCP_RING_INIT);
+    while (n.size < need)
+        n.size <<= 1;
+    n.data = ng_malloc(n.size, "tcp ring");
+    if (n.data == NULL)
+        return -1;
+
+    // Positions depend on the size
+    for (int i = 0; i < r->ranges; i++) {
+        struct iovec iov[2];
+        uint32_t seq = r->range[i].seq;
+        int count = get_ring_iov(r, seq, r->range[i].end - seq, iov);
+        for (int v = 0; v < count; v++) {
+            write_ring(&n, seq, iov[v].iov_base, (uint32_t) iov[v].iov_len);
+            seq += iov[v].iov_len;
+        }
+    }
+
+    if (r->data != NULL)
+        ng_free(r->data, __FILE__, __LINE__);
+    *r = n;
+    return 0;
+}
+
+static void consume_ring(struct tcp_session *cur, uint32_t len) {
+    struct tcp_ring *r = &cur->forward;
+    cur->remote_seq += len;
+    r->queued -= len;
+    r->range[0].seq += len;
+    if (r->range[0].seq == r->range[0].end) {
+        r->ranges--;
+        memmove(&r->range[0], &r->range[1], r->ranges * sizeof(struct tcp_range));
     }
 }
 
@@ -54,6 +118,14 @@ int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions)
 int check_tcp_session(const struct arguments *args, struct ng_session *s,
                       int sessions, int maxsessions) {
     time_t now = time(NULL);
+    int timeout = get_tcp_timeout(&s->tcp, sessions, maxsessions);
+
+    // Nothing to do
+    if (s->tcp.state == TCP_CLOSE) {
+        if (!s->tcp.sent && !s->tcp.received && s->tcp.time + TCP_KEEP_TIMEOUT >= now)
+            return 0;
+    } else if (s->tcp.state != TCP_CLOSING && s->tcp.time + timeout >= now)
+        return 0;
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -70,8 +142,6 @@ int check_tcp_session(const struct arguments *args, struct ng_session *s,
             source, ntohs(s->tcp.source), dest, ntohs(s->tcp.dest),
             strstate(s->tcp.state), s->socket);
 
-    int timeout = get_tcp_timeout(&s->tcp, sessions, maxsessions);
-
     // Check session timeout
     if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE &&
         s->tcp.time + timeout < now) {
@@ -87,6 +157,7 @@ int check_tcp_session(const struct arguments *args, struct ng_session *s,
     if (s->tcp.state == TCP_CLOSING) {
         // eof closes socket
         if (s->socket >= 0) {
+            release_event(&args->worker->loop, s->socket);
             if (close(s->socket))
                 log_android(ANDROID_LOG_ERROR, "%s close error %d: %s",
                             session, errno, strerror(errno));
@@ -114,21 +185,21 @@ int check_tcp_session(const struct arguments *args, struct ng_session *s,
     return 0;
 }
 
-int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd) {
+int monitor_tcp_session(const struct arguments *args, struct ng_session *s) {
     int recheck = 0;
-    unsigned int events = EPOLLERR;
+    uint32_t events = EVENT_ERR;
 
     if (s->tcp.state == TCP_LISTEN) {
         // Check for connected = writable
         if (s->tcp.socks5 == SOCKS5_NONE)
-            events = events | EPOLLOUT;
+            events = events | EVENT_OUT;
         else
-            events = events | EPOLLIN;
+            events = events | EVENT_IN;
     } else if (s->tcp.state == TCP_ESTABLISHED || s->tcp.state == TCP_CLOSE_WAIT) {
 
         // Check for incoming data
         if (get_send_window(&s->tcp) > 0)
-            events = events | EPOLLIN;
+            events = events | EVENT_IN;
         else {
             recheck = 1;
 
@@ -143,24 +214,23 @@ int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int
         }
 
         // Check for outgoing data
-        if (s->tcp.forward != NULL) {
-            uint32_t buffer_size = get_receive_buffer(s);
-            if (s->tcp.forward->seq == s->tcp.remote_seq &&
-                s->tcp.forward->len - s->tcp.forward->sent < buffer_size)
-                events = events | EPOLLOUT;
+        if (s->tcp.forward.queued > 0) {
+            if (get_tcp_data(&s->tcp) > 0 && get_receive_buffer(s) > 0)
+                events = events | EVENT_OUT;
             else
                 recheck = 1;
         }
     }
 
-    if (events != s->ev.events) {
-        s->ev.events = events;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->socket, &s->ev)) {
+    if (events != s->events) {
+        s->events = events;
+        if (modify_event(&args->worker->loop, s->socket, events, s)) {
             s->tcp.state = TCP_CLOSING;
-            log_android(ANDROID_LOG_ERROR, "epoll mod tcp error %d: %s", errno, strerror(errno));
+            activate_session(args->worker, s);
+            log_android(ANDROID_LOG_ERROR, "event mod tcp error %d: %s", errno, strerror(errno));
         } else
-            log_android(ANDROID_LOG_DEBUG, "epoll mod tcp socket %d in %d out %d",
-                        s->socket, (events & EPOLLIN) != 0, (events & EPOLLOUT) != 0);
+            log_android(ANDROID_LOG_DEBUG, "event mod tcp socket %d in %d out %d",
+                        s->socket, (events & EVENT_IN) != 0, (events & EVENT_OUT) != 0);
     }
 
     return recheck;
@@ -182,45 +252,50 @@ uint32_t get_send_window(const struct tcp_session *cur) {
     return total;
 }
 
-uint32_t get_receive_buffer(const struct ng_session *cur) {
+uint32_t get_receive_buffer(struct ng_session *cur) {
     if (cur->socket < 0)
         return 0;
 
-    // Get send buffer size
-    // /proc/sys/net/core/wmem_default
-    int sendbuf = 0;
-    int sendbufsize = sizeof(sendbuf);
-    if (getsockopt(cur->socket, SOL_SOCKET, SO_SNDBUF, &sendbuf, (socklen_t *) &sendbufsize) < 0)
-        log_android(ANDROID_LOG_WARN, "getsockopt SO_RCVBUF %d: %s", errno, strerror(errno));
-
-    if (sendbuf == 0)
-        sendbuf = SEND_BUF_DEFAULT;
-
-    // Get unsent data size
-    int unsent = 0;
-    if (ioctl(cur->socket, SIOCOUTQ, &unsent))
-        log_android(ANDROID_LOG_WARN, "ioctl SIOCOUTQ %d: %s", errno, strerror(errno));
+    // The unsent estimate grows with what was sent and can only be too high,
+    // so the socket is queried only when the window would otherwise close
+    struct tcp_session *t = &cur->tcp;
+    if (t->sndbuf == 0 || t->unsent + t->forward.queued >= t->sndbuf) {
+        // Get send buffer size, which can be auto tuned
+        // /proc/sys/net/core/wmem_default
+        int sendbuf = 0;
+        int sendbufsize = sizeof(sendbuf);
+        if (getsockopt(cur->socket, SOL_SOCKET, SO_SNDBUF,
+                       &sendbuf, (socklen_t *) &sendbufsize) < 0)
+            log_android(ANDROID_LOG_WARN, "getsockopt SO_SNDBUF %d: %s", errno, strerror(errno));
+
+        if (sendbuf == 0)
+            sendbuf = SEND_BUF_DEFAULT;
+        t->sndbuf = (uint32_t) sendbuf;
+
+        // Get unsent data size
+        int unsent = 0;
+        if (ioctl(cur->socket, SIOCOUTQ, &unsent))
+            log_android(ANDROID_LOG_WARN, "ioctl SIOCOUTQ %d: %s", errno, strerror(errno));
+        t->unsent = (uint32_t) unsent;
+    }
 
-    uint32_t total = (uint32_t) (unsent < sendbuf ? sendbuf - unsent : 0);
+    uint32_t total = (t->unsent < t->sndbuf ? t->sndbuf - t->unsent : 0);
 
     log_android(ANDROID_LOG_DEBUG, "Send buffer %u unsent %u total %u",
-                sendbuf, unsent, total);
+                t->sndbuf, t->unsent, total);
 
     return total;
 }
 
-uint32_t get_receive_window(const struct ng_session *cur) {
+uint32_t get_receive_window(struct ng_session *cur) {
     // Get data to forward size
-    uint32_t toforward = 0;
-    struct segment *q = cur->tcp.forward;
-    while (q != NULL) {
-        toforward += (q->len - q->sent);
-        q = q->next;
-    }
+    uint32_t toforward = cur->tcp.forward.queued;
 
     uint32_t window = get_receive_buffer(cur);
 
     uint32_t max = ((uint32_t) 0xFFFF) << cur->tcp.recv_scale;
+    if (max > TCP_RING_MAX)
+        max = TCP_RING_MAX;
     if (window > max) {
         log_android(ANDROID_LOG_DEBUG, "Receive window %u > max %u", window, max);
         window = max;
@@ -234,10 +309,8 @@ uint32_t get_receive_window(const struct ng_session *cur) {
     return total;
 }
 
-void check_tcp_socket(const struct arguments *args,
-                      const struct epoll_event *ev,
-                      const int epoll_fd) {
-    struct ng_session *s = (struct ng_session *) ev->data.ptr;
+void check_tcp_socket(const struct arguments *args, const struct event *ev) {
+    struct ng_session *s = (struct ng_session *) ev->data;
 
     int oldstate = s->tcp.state;
     uint32_t oldlocal = s->tcp.local_seq;
@@ -260,7 +333,7 @@ void check_tcp_socket(const struct arguments *args,
             s->tcp.remote_seq - s->tcp.remote_start);
 
     // Check socket error
-    if (ev->events & EPOLLERR) {
+    if (ev->events & EVENT_ERR) {
         s->tcp.time = time(NULL);
 
         int serr = 0;
@@ -298,6 +371,9 @@ void check_tcp_socket(const struct arguments *args,
                     memcpy(&sicmp.saddr.ip6, &s->tcp.saddr.ip6, 16);
                     memcpy(&sicmp.daddr.ip6, &s->tcp.daddr.ip6, 16);
                 }
+                init_tun_header(&sicmp.header, sicmp.version,
+                                (uint8_t) (sicmp.version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6),
+                                &sicmp.daddr, &sicmp.saddr);
 
                 write_icmp(args, &sicmp, (uint8_t *) &icmp, 8);
             }
@@ -306,7 +382,7 @@ void check_tcp_socket(const struct arguments *args,
         if (s->tcp.state == TCP_LISTEN) {
             // Check socket connect
             if (s->tcp.socks5 == SOCKS5_NONE) {
-                if (ev->events & EPOLLOUT) {
+                if (ev->events & EVENT_OUT) {
                     log_android(ANDROID_LOG_INFO, "%s connected", session);
 
                     // https://tools.ietf.org/html/rfc1928
@@ -318,7 +394,7 @@ void check_tcp_socket(const struct arguments *args,
                         s->tcp.socks5 = SOCKS5_CONNECTED;
                 }
             } else {
-                if (ev->events & EPOLLIN) {
+                if (ev->events & EVENT_IN) {
                     uint8_t buffer[32];
                     ssize_t bytes = recv(s->socket, buffer, sizeof(buffer), 0);
                     if (bytes < 0) {
@@ -467,24 +543,33 @@ void check_tcp_socket(const struct arguments *args,
 
             // Always forward data
             int fwd = 0;
-            if (ev->events & EPOLLOUT) {
-                // Forward data
+            if (ev->events & EVENT_OUT) {
+                // Forward data straight from the ring
+                struct tcp_ring *r = &s->tcp.forward;
                 uint32_t buffer_size = get_receive_buffer(s);
-                while (s->tcp.forward != NULL &&
-                       s->tcp.forward->seq == s->tcp.remote_seq &&
-                       s->tcp.forward->len - s->tcp.forward->sent < buffer_size) {
-                    log_android(ANDROID_LOG_DEBUG, "%s fwd %u...%u sent %u",
+                uint32_t len;
+                while (buffer_size > 0 && (len = get_tcp_data(&s->tcp)) > 0) {
+                    // Hold back a partial frame unless pushed
+                    int more = 1;
+                    if (len > buffer_size)
+                        len = buffer_size;
+                    else if (compare_u32(r->push, s->tcp.remote_seq) > 0 &&
+                             compare_u32(r->push, s->tcp.remote_seq + len) <= 0)
+                        more = 0;
+
+                    log_android(ANDROID_LOG_DEBUG, "%s fwd %u...%u",
                                 session,
-                                s->tcp.forward->seq - s->tcp.remote_start,
-                                s->tcp.forward->seq + s->tcp.forward->len - s->tcp.remote_start,
-                                s->tcp.forward->sent);
-
-                    ssize_t sent = send(s->socket,
-                                        s->tcp.forward->data + s->tcp.forward->sent,
-                                        s->tcp.forward->len - s->tcp.forward->sent,
-                                        (unsigned int) (MSG_NOSIGNAL | (s->tcp.forward->psh
-                                                                        ? 0
-                                                                        : MSG_MORE)));
+                                s->tcp.remote_seq - s->tcp.remote_start,
+                                s->tcp.remote_seq + len - s->tcp.remote_start);
+
+                    struct iovec iov[2];
+                    struct msghdr msg;
+                    memset(&msg, 0, sizeof(struct msghdr));
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = (size_t) get_ring_iov(r, s->tcp.remote_seq, len, iov);
+
+                    ssize_t sent = sendmsg(s->socket, &msg,
+                                           (unsigned int) (MSG_NOSIGNAL | (more ? MSG_MORE : 0)));
                     if (sent < 0) {
                         log_android(ANDROID_LOG_ERROR, "%s send error %d: %s",
                                     session, errno, strerror(errno));
@@ -499,34 +584,23 @@ void check_tcp_socket(const struct arguments *args,
                         fwd = 1;
                         buffer_size -= sent;
                         s->tcp.sent += sent;
-                        s->tcp.forward->sent += sent;
+                        s->tcp.unsent += sent;
+                        consume_ring(&s->tcp, (uint32_t) sent);
 
-                        if (s->tcp.forward->len == s->tcp.forward->sent) {
-                            s->tcp.remote_seq = s->tcp.forward->seq + s->tcp.forward->sent;
-
-                            struct segment *p = s->tcp.forward;
-                            s->tcp.forward = s->tcp.forward->next;
-                            ng_free(p->data, __FILE__, __LINE__);
-                            ng_free(p, __FILE__, __LINE__);
-                        } else {
+                        if ((uint32_t) sent < len) {
                             log_android(ANDROID_LOG_WARN,
-                                        "%s partial send %u/%u",
-                                        session, s->tcp.forward->sent, s->tcp.forward->len);
+                                        "%s partial send %u/%u", session, sent, len);
                             break;
                         }
                     }
                 }
 
                 // Log data buffered
-                struct segment *seg = s->tcp.forward;
-                while (seg != NULL) {
-                    log_android(ANDROID_LOG_WARN, "%s queued %u...%u sent %u",
+                for (int i = 0; i < r->ranges; i++)
+                    log_android(ANDROID_LOG_WARN, "%s queued %u...%u",
                                 session,
-                                seg->seq - s->tcp.remote_start,
-                                seg->seq + seg->len - s->tcp.remote_start,
-                                seg->sent);
-                    seg = seg->next;
-                }
+                                r->range[i].seq - s->tcp.remote_start,
+                                r->range[i].end - s->tcp.remote_start);
             }
 
             // Get receive window
@@ -539,7 +613,7 @@ void check_tcp_socket(const struct arguments *args,
 
             // Acknowledge forwarded data
             if (fwd || (prev == 0 && window > 0)) {
-                if (fwd && s->tcp.forward == NULL && s->tcp.state == TCP_CLOSE_WAIT) {
+                if (fwd && s->tcp.forward.queued == 0 && s->tcp.state == TCP_CLOSE_WAIT) {
                     log_android(ANDROID_LOG_WARN, "%s confirm FIN", session);
                     s->tcp.remote_seq++; // remote FIN
                 }
@@ -552,7 +626,7 @@ void check_tcp_socket(const struct arguments *args,
                 // Send window can be changed in the mean time
 
                 uint32_t send_window = get_send_window(&s->tcp);
-                if ((ev->events & EPOLLIN) && send_window > 0) {
+                if ((ev->events & EVENT_IN) && send_window > 0) {
                     s->tcp.time = time(NULL);
 
                     uint32_t buffer_size = (send_window > s->tcp.mss
@@ -569,7 +643,7 @@ void check_tcp_socket(const struct arguments *args,
                     } else if (bytes == 0) {
                         log_android(ANDROID_LOG_WARN, "%s recv eof", session);
 
-                        if (s->tcp.forward == NULL) {
+                        if (s->tcp.forward.queued == 0) {
                             if (write_fin_ack(args, &s->tcp) >= 0) {
                                 log_android(ANDROID_LOG_WARN, "%s FIN sent", session);
                                 s->tcp.local_seq++; // local FIN
@@ -587,6 +661,7 @@ void check_tcp_socket(const struct arguments *args,
                             write_rst(args, &s->tcp);
                         }
 
+                        release_event(&args->worker->loop, s->socket);
                         if (close(s->socket))
                             log_android(ANDROID_LOG_ERROR, "%s close error %d: %s",
                                         session, errno, strerror(errno));
@@ -623,8 +698,7 @@ void check_tcp_socket(const struct arguments *args,
 jboolean handle_tcp(const struct arguments *args,
                     const uint8_t *pkt, size_t length,
                     const uint8_t *payload,
-                    int uid, int allowed, struct allowed *redirect,
-                    const int epoll_fd) {
+                    int uid, int allowed, struct allowed *redirect) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -636,16 +710,11 @@ jboolean handle_tcp(const struct arguments *args,
     const uint16_t datalen = (const uint16_t) (length - (data - pkt));
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_TCP &&
-             cur->tcp.version == version &&
-             cur->tcp.source == tcphdr->source && cur->tcp.dest == tcphdr->dest &&
-             (version == 4 ? cur->tcp.saddr.ip4 == ip4->saddr &&
-                             cur->tcp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->tcp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->tcp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct session_key key;
+    get_packet_key(&key, pkt, IPPROTO_TCP, tcphdr->source, tcphdr->dest);
+    struct ng_session *cur = find_session(args->worker, &key);
+    if (cur != NULL)
+        activate_session(args->worker, cur); // state might change
 
     // Prepare logging
     char source[INET6_ADDRSTRLEN + 1];
@@ -740,6 +809,8 @@ jboolean handle_tcp(const struct arguments *args,
             s->tcp.local_start = s->tcp.local_seq;
             s->tcp.acked = 0;
             s->tcp.last_keep_alive = 0;
+            s->tcp.sndbuf = 0;
+            s->tcp.unsent = 0;
             s->tcp.sent = 0;
             s->tcp.received = 0;
 
@@ -754,26 +825,23 @@ jboolean handle_tcp(const struct arguments *args,
             s->tcp.source = tcphdr->source;
             s->tcp.dest = tcphdr->dest;
             s->tcp.state = TCP_LISTEN;
+            init_tun_header(&s->tcp.header, version, IPPROTO_TCP,
+                            &s->tcp.daddr, &s->tcp.saddr);
             s->tcp.socks5 = SOCKS5_NONE;
-            s->tcp.forward = NULL;
+            memset(&s->tcp.forward, 0, sizeof(struct tcp_ring));
+            s->tcp.forward.push = s->tcp.remote_seq;
             s->next = NULL;
 
             if (datalen) {
                 log_android(ANDROID_LOG_WARN, "%s SYN data", packet);
-                s->tcp.forward = ng_malloc(sizeof(struct segment), "syn segment");
-                s->tcp.forward->seq = s->tcp.remote_seq;
-                s->tcp.forward->len = datalen;
-                s->tcp.forward->sent = 0;
-                s->tcp.forward->psh = tcphdr->psh;
-                s->tcp.forward->data = ng_malloc(datalen, "syn segment data");
-                memcpy(s->tcp.forward->data, data, datalen);
-                s->tcp.forward->next = NULL;
+                queue_tcp(args, tcphdr, packet, &s->tcp, data, datalen);
             }
 
             // Open socket
             s->socket = open_tcp_socket(args, &s->tcp, redirect);
             if (s->socket < 0) {
                 // Remote might retry
+                clear_tcp_data(&s->tcp);
                 ng_free(s, __FILE__, __LINE__);
                 return 0;
             }
@@ -784,15 +852,12 @@ jboolean handle_tcp(const struct arguments *args,
                         s->socket, get_local_port(s->socket));
 
             // Monitor events
-            memset(&s->ev, 0, sizeof(struct epoll_event));
-            s->ev.events = EPOLLOUT | EPOLLERR;
-            s->ev.data.ptr = s;
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
-                log_android(ANDROID_LOG_ERROR, "epoll add tcp error %d: %s",
+            s->events = EVENT_OUT | EVENT_ERR;
+            if (register_event(&args->worker->loop, s->socket, s->events, s))
+                log_android(ANDROID_LOG_ERROR, "event add tcp error %d: %s",
                             errno, strerror(errno));
 
-            s->next = args->ctx->ng_session;
-            args->ctx->ng_session = s;
+            add_session(args->worker, s);
 
             if (!allowed) {
                 log_android(ANDROID_LOG_WARN, "%s resetting blocked session", packet);
@@ -817,19 +882,20 @@ jboolean handle_tcp(const struct arguments *args,
 
             rst.source = tcphdr->source;
             rst.dest = tcphdr->dest;
+            init_tun_header(&rst.header, version, IPPROTO_TCP, &rst.daddr, &rst.saddr);
 
             write_rst(args, &rst);
             return 0;
         }
     } else {
-        char session[250];
-        sprintf(session,
-                "%s %s loc %u rem %u acked %u",
-                packet,
-                strstate(cur->tcp.state),
-                cur->tcp.local_seq - cur->tcp.local_start,
-                cur->tcp.remote_seq - cur->tcp.remote_start,
-                cur->tcp.acked - cur->tcp.local_start);
+        char session[320]; // packet and state
+        snprintf(session, sizeof(session),
+                 "%s %s loc %u rem %u acked %u",
+                 packet,
+                 strstate(cur->tcp.state),
+                 cur->tcp.local_seq - cur->tcp.local_start,
+                 cur->tcp.remote_seq - cur->tcp.remote_start,
+                 cur->tcp.acked - cur->tcp.local_start);
 
         // Session found
         if (cur->tcp.state == TCP_CLOSING || cur->tcp.state == TCP_CLOSE) {
@@ -880,7 +946,7 @@ jboolean handle_tcp(const struct arguments *args,
                     } else if (tcphdr->fin /* +ACK */) {
                         if (cur->tcp.state == TCP_ESTABLISHED) {
                             log_android(ANDROID_LOG_WARN, "%s FIN received", session);
-                            if (cur->tcp.forward == NULL) {
+                            if (cur->tcp.forward.queued == 0) {
                                 cur->tcp.remote_seq++; // remote FIN
                                 if (write_ack(args, &cur->tcp) >= 0)
                                     cur->tcp.state = TCP_CLOSE_WAIT;
@@ -978,61 +1044,80 @@ void queue_tcp(const struct arguments *args,
                const struct tcphdr *tcphdr,
                const char *session, struct tcp_session *cur,
                const uint8_t *data, uint16_t datalen) {
-    uint32_t seq = ntohl(tcphdr->seq);
-    if (compare_u32(seq, cur->remote_seq) < 0)
+    struct tcp_ring *r = &cur->forward;
+    uint32_t seq = ntohl(tcphdr->seq) + (tcphdr->syn ? 1 : 0); // SYN data follows the ISN
+    uint32_t end = seq + datalen;
+
+    if (compare_u32(end, cur->remote_seq) <= 0) {
         log_android(ANDROID_LOG_WARN, "%s already forwarded %u..%u",
                     session,
-                    seq - cur->remote_start, seq + datalen - cur->remote_start);
-    else {
-        struct segment *p = NULL;
-        struct segment *s = cur->forward;
-        while (s != NULL && compare_u32(s->seq, seq) < 0) {
-            p = s;
-            s = s->next;
-        }
+                    seq - cur->remote_start, end - cur->remote_start);
+        return;
+    }
 
-        if (s == NULL || compare_u32(s->seq, seq) > 0) {
-            log_android(ANDROID_LOG_DEBUG, "%s queuing %u...%u",
-                        session,
-                        seq - cur->remote_start, seq + datalen - cur->remote_start);
-            struct segment *n = ng_malloc(sizeof(struct segment), "tcp segment");
-            n->seq = seq;
-            n->len = datalen;
-            n->sent = 0;
-            n->psh = tcphdr->psh;
-            n->data = ng_malloc(datalen, "tcp segment");
-            memcpy(n->data, data, datalen);
-            n->next = s;
-            if (p == NULL)
-                cur->forward = n;
-            else
-                p->next = n;
-        } else if (s != NULL && s->seq == seq) {
-            if (s->len == datalen)
-                log_android(ANDROID_LOG_WARN, "%s segment already queued %u..%u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start);
-            else if (s->len < datalen) {
-                log_android(ANDROID_LOG_WARN, "%s segment smaller %u..%u > %u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start,
-                            s->seq + datalen - cur->remote_start);
-                ng_free(s->data, __FILE__, __LINE__);
-                s->len = datalen;
-                s->data = ng_malloc(datalen, "tcp segment smaller");
-                memcpy(s->data, data, datalen);
-            } else {
-                log_android(ANDROID_LOG_ERROR, "%s segment larger %u..%u < %u",
-                            session,
-                            s->seq - cur->remote_start, s->seq + s->len - cur->remote_start,
-                            s->seq + datalen - cur->remote_start);
-                ng_free(s->data, __FILE__, __LINE__);
-                s->len = datalen;
-                s->data = ng_malloc(datalen, "tcp segment larger");
-                memcpy(s->data, data, datalen);
+    // Skip data already forwarded
+    if (compare_u32(seq, cur->remote_seq) < 0) {
+        log_android(ANDROID_LOG_WARN, "%s partly forwarded %u..%u",
+                    session,
+                    seq - cur->remote_start, end - cur->remote_start);
+        data += cur->remote_seq - seq;
+        seq = cur->remote_seq;
+    }
+
+    // Merge with the queued ranges, overlapping data is the same
+    struct tcp_range merged[TCP_RING_RANGES + 1];
+    struct tcp_range n = {seq, end};
+    int count = 0;
+    int inserted = 0;
+    for (int i = 0; i < r->ranges; i++) {
+        struct tcp_range *x = &r->range[i];
+        if (compare_u32(x->end, n.seq) < 0)
+            merged[count++] = *x;
+        else if (compare_u32(x->seq, n.end) > 0) {
+            if (!inserted) {
+                merged[count++] = n;
+                inserted = 1;
             }
+            merged[count++] = *x;
+        } else {
+            if (compare_u32(x->seq, n.seq) < 0)
+                n.seq = x->seq;
+            if (compare_u32(x->end, n.end) > 0)
+                n.end = x->end;
         }
     }
+    if (!inserted)
+        merged[count++] = n;
+
+    if (count > TCP_RING_RANGES) {
+        log_android(ANDROID_LOG_WARN, "%s too many holes, dropping %u..%u",
+                    session,
+                    seq - cur->remote_start, end - cur->remote_start);
+        return;
+    }
+
+    if (end - cur->remote_seq > r->size && grow_ring(r, end - cur->remote_seq) < 0) {
+        log_android(ANDROID_LOG_ERROR, "%s ring full, dropping %u..%u",
+                    session,
+                    seq - cur->remote_start, end - cur->remote_start);
+        return;
+    }
+
+    log_android(ANDROID_LOG_DEBUG, "%s queuing %u...%u",
+                session,
+                seq - cur->remote_start, end - cur->remote_start);
+
+    write_ring(r, seq, data, end - seq);
+
+    r->queued = 0;
+    for (int i = 0; i < count; i++) {
+        r->range[i] = merged[i];
+        r->queued += merged[i].end - merged[i].seq;
+    }
+    r->ranges = count;
+
+    if (tcphdr->psh && compare_u32(end, r->push) > 0)
+        r->push = end;
 }
 
 int open_tcp_socket(const struct arguments *args,
@@ -1176,76 +1261,18 @@ void write_rst(const struct arguments *args, struct tcp_session *cur) {
 ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
                   const uint8_t *data, size_t datalen,
                   int syn, int ack, int fin, int rst) {
-    size_t len;
-    u_int8_t *buffer;
-    struct tcphdr *tcp;
+    uint32_t buffer[(sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + 8) / 4];
     uint16_t csum;
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
 
-    // Build packet
+    // Build headers, the data is written from where it is
     int optlen = (syn ? 4 + 3 + 1 : 0);
-    uint8_t *options;
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct iphdr));
-        options = buffer + sizeof(struct iphdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        // Build IP4 header
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_TCP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        // Calculate IP4 checksum
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        // Calculate TCP4 checksum
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct tcphdr) + optlen + datalen);
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
-    } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write 6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct ip6_hdr));
-        options = buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        // Build IP6 header
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_TCP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = 0x60;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        // Calculate TCP6 checksum
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
-
+    size_t hlen = build_tun_header(&cur->header, (uint8_t *) buffer,
+                                   sizeof(struct tcphdr) + optlen + datalen, &csum);
+    struct tcphdr *tcp = (struct tcphdr *) ((uint8_t *) buffer + hlen);
+    uint8_t *options = (uint8_t *) tcp + sizeof(struct tcphdr);
+    size_t len = hlen + sizeof(struct tcphdr) + optlen + datalen;
 
     // Build TCP header
     memset(tcp, 0, sizeof(struct tcphdr));
@@ -1301,13 +1328,13 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
                 ntohl(tcp->ack_seq) - cur->remote_start,
                 datalen);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write pcap record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
+    struct iovec iov[2];
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = hlen + sizeof(struct tcphdr) + optlen;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = datalen;
+    ssize_t res = write_tun(args, iov, 2);
+    if (res < 0)
         log_android(ANDROID_LOG_ERROR, "TCP write%s%s%s%s data %d error %d: %s",
                     (tcp->syn ? " SYN" : ""),
                     (tcp->ack ? " ACK" : ""),
@@ -1316,8 +1343,6 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
                     datalen,
                     errno, strerror((errno)));
 
-    ng_free(buffer, __FILE__, __LINE__);
-
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "TCP write %d/%d", res, len);
         return -1;
@@ -19,7 +19,6 @@
 
 #include "netguard.h"
 
-extern FILE *pcap_file;
 
 int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions) {
     int timeout = (ntohs(u->dest) == 53 ? UDP_TIMEOUT_53 : UDP_TIMEOUT_ANY);
@@ -33,6 +32,15 @@ int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions)
 int check_udp_session(const struct arguments *args, struct ng_session *s,
                       int sessions, int maxsessions) {
     time_t now = time(NULL);
+    int timeout = get_udp_timeout(&s->udp, sessions, maxsessions);
+
+    // Nothing to do
+    if (s->udp.state == UDP_ACTIVE) {
+        if (s->udp.time + timeout >= now)
+            return 0;
+    } else if (s->udp.state != UDP_FINISHING &&
+               !s->udp.sent && !s->udp.received && s->udp.time + UDP_KEEP_TIMEOUT >= now)
+        return 0;
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -45,7 +53,6 @@ int check_udp_session(const struct arguments *args, struct ng_session *s,
     }
 
     // Check session timeout
-    int timeout = get_udp_timeout(&s->udp, sessions, maxsessions);
     if (s->udp.state == UDP_ACTIVE && s->udp.time + timeout < now) {
         log_android(ANDROID_LOG_WARN, "UDP idle %d/%d sec state %d from %s/%u to %s/%u",
                     now - s->udp.time, timeout, s->udp.state,
@@ -58,6 +65,7 @@ int check_udp_session(const struct arguments *args, struct ng_session *s,
         log_android(ANDROID_LOG_INFO, "UDP close from %s/%u to %s/%u socket %d",
                     source, ntohs(s->udp.source), dest, ntohs(s->udp.dest), s->socket);
 
+        release_event(&args->worker->loop, s->socket);
         if (close(s->socket))
             log_android(ANDROID_LOG_ERROR, "UDP close %d error %d: %s",
                         s->socket, errno, strerror(errno));
@@ -82,11 +90,160 @@ int check_udp_session(const struct arguments *args, struct ng_session *s,
     return 0;
 }
 
-void check_udp_socket(const struct arguments *args, const struct epoll_event *ev) {
-    struct ng_session *s = (struct ng_session *) ev->data.ptr;
+int udp_offload_support = UDP_OFFLOAD_UNKNOWN;
+
+static int is_udp_soft_error(const struct udp_session *u, int err) {
+    // ICMP errors, which only connected sockets receive, are transient for the flow
+    return (u->connected &&
+            (err == ECONNREFUSED || err == EHOSTUNREACH ||
+             err == ENETUNREACH || err == EHOSTDOWN));
+}
+
+static void forward_udp(const struct arguments *args, struct ng_session *s,
+                        uint8_t *buffer, size_t bytes) {
+    // Socket read data
+    char dest[INET6_ADDRSTRLEN + 1];
+    if (s->udp.version == 4)
+        inet_ntop(AF_INET, &s->udp.daddr.ip4, dest, sizeof(dest));
+    else
+        inet_ntop(AF_INET6, &s->udp.daddr.ip6, dest, sizeof(dest));
+    log_android(ANDROID_LOG_INFO, "UDP recv bytes %d from %s/%u for tun",
+                bytes, dest, ntohs(s->udp.dest));
+
+    // Process DNS response
+    if (ntohs(s->udp.dest) == 53)
+        parse_dns_response(args, s, buffer, &bytes);
+
+    // Forward to tun
+    if (write_udp(args, &s->udp, buffer, bytes) < 0)
+        s->udp.state = UDP_FINISHING;
+    else {
+        // Prevent too many open files
+        if (ntohs(s->udp.dest) == 53)
+            s->udp.state = UDP_FINISHING;
+    }
+}
+
+static int check_udp_gro(const struct arguments *args, struct ng_session *s) {
+    // Read coalesced datagrams and split them back into tun packets
+    struct iovec iov;
+    iov.iov_base = args->worker->gro_buffer;
+    iov.iov_len = UDP_GRO_BUFFER;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t bytes = recvmsg(s->socket, &msg, MSG_DONTWAIT);
+    if (bytes < 0) {
+        if (errno == EINTR)
+            return 1;
+        if (errno == EAGAIN)
+            return 0; // drained
+
+        // Socket error, reported once
+        log_android(ANDROID_LOG_WARN, "UDP recv error %d: %s", errno, strerror(errno));
+        if (is_udp_soft_error(&s->udp, errno))
+            return 1;
+        s->udp.state = UDP_FINISHING;
+        return 0;
+    } else if (bytes == 0) {
+        log_android(ANDROID_LOG_WARN, "UDP recv eof");
+        s->udp.state = UDP_FINISHING;
+        return 0;
+    }
+
+    s->udp.received += bytes;
+
+    if (msg.msg_flags & MSG_TRUNC) {
+        log_android(ANDROID_LOG_WARN, "UDP recv truncated to %d", bytes);
+        return 1;
+    }
+
+    // Without a segment size the read is a single datagram
+    size_t segment = (size_t) bytes;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+            if (gso_size > 0)
+                segment = (size_t) gso_size;
+        }
+
+    if (segment < (size_t) bytes)
+        log_android(ANDROID_LOG_DEBUG, "UDP GRO %d bytes segment %d", bytes, segment);
+
+    for (size_t off = 0; off < (size_t) bytes && s->udp.state == UDP_ACTIVE; off += segment) {
+        size_t len = (off + segment > (size_t) bytes ? (size_t) bytes - off : segment);
+        forward_udp(args, s, args->worker->gro_buffer + off, len);
+    }
+
+    return (s->udp.state == UDP_ACTIVE);
+}
+
+static int check_udp_batch(const struct arguments *args, struct ng_session *s) {
+    // Read a batch of datagrams into the pooled buffers
+    struct iovec iov[UDP_YIELD];
+    struct mmsghdr msgs[UDP_YIELD];
+    memset(msgs, 0, sizeof(msgs));
+    for (int m = 0; m < UDP_YIELD; m++) {
+        iov[m].iov_base = args->worker->udp_buffer + m * UDP_SLOT;
+        iov[m].iov_len = UDP_SLOT;
+        msgs[m].msg_hdr.msg_iov = &iov[m];
+        msgs[m].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(s->socket, msgs, UDP_YIELD, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        if (errno == EINTR)
+            return 1;
+        if (errno == EAGAIN)
+            return 0; // drained
+
+        // Socket error, reported once
+        log_android(ANDROID_LOG_WARN, "UDP recv error %d: %s", errno, strerror(errno));
+        if (is_udp_soft_error(&s->udp, errno))
+            return 1;
+        s->udp.state = UDP_FINISHING;
+        return 0;
+    }
+
+    for (int m = 0; m < count && s->udp.state == UDP_ACTIVE; m++) {
+        uint8_t *buffer = iov[m].iov_base;
+        size_t bytes = msgs[m].msg_len;
+        if (bytes == 0) {
+            log_android(ANDROID_LOG_WARN, "UDP recv eof");
+            s->udp.state = UDP_FINISHING;
+            break;
+        }
+
+        s->udp.received += bytes;
+
+        if (msgs[m].msg_hdr.msg_flags & MSG_TRUNC) {
+            log_android(ANDROID_LOG_WARN, "UDP recv truncated to %d", bytes);
+            continue;
+        }
+
+        forward_udp(args, s, buffer, bytes);
+    }
+
+    // A short batch means the socket was drained
+    return (count == UDP_YIELD && s->udp.state == UDP_ACTIVE);
+}
+
+void check_udp_socket(const struct arguments *args, const struct event *ev) {
+    struct ng_session *s = (struct ng_session *) ev->data;
 
     // Check socket error
-    if (ev->events & EPOLLERR) {
+    if (ev->events & EVENT_ERR) {
         s->udp.time = time(NULL);
 
         int serr = 0;
@@ -98,78 +255,158 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
         else if (serr)
             log_android(ANDROID_LOG_ERROR, "UDP SO_ERROR %d: %s", serr, strerror(serr));
 
-        s->udp.state = UDP_FINISHING;
-    } else {
-        // Check socket read
-        if (ev->events & EPOLLIN) {
-            s->udp.time = time(NULL);
-
-            uint8_t *buffer = ng_malloc(s->udp.mss, "udp recv");
-            ssize_t bytes = recv(s->socket, buffer, s->udp.mss, 0);
-            if (bytes < 0) {
-                // Socket error
-                log_android(ANDROID_LOG_WARN, "UDP recv error %d: %s",
-                            errno, strerror(errno));
+        // Reading SO_ERROR cleared it, a connected socket might have been read meanwhile
+        int soft = (serr == 0 ? s->udp.connected : is_udp_soft_error(&s->udp, serr));
+        if (err < 0 || !soft) {
+            s->udp.state = UDP_FINISHING;
+            return;
+        }
+    }
 
-                if (errno != EINTR && errno != EAGAIN)
-                    s->udp.state = UDP_FINISHING;
-            } else if (bytes == 0) {
-                log_android(ANDROID_LOG_WARN, "UDP recv eof");
-                s->udp.state = UDP_FINISHING;
-
-            } else {
-                // Socket read data
-                char dest[INET6_ADDRSTRLEN + 1];
-                if (s->udp.version == 4)
-                    inet_ntop(AF_INET, &s->udp.daddr.ip4, dest, sizeof(dest));
-                else
-                    inet_ntop(AF_INET6, &s->udp.daddr.ip6, dest, sizeof(dest));
-                log_android(ANDROID_LOG_INFO, "UDP recv bytes %d from %s/%u for tun",
-                            bytes, dest, ntohs(s->udp.dest));
-
-                s->udp.received += bytes;
-
-                // Process DNS response
-                if (ntohs(s->udp.dest) == 53)
-                    parse_dns_response(args, s, buffer, (size_t *) &bytes);
-
-                // Forward to tun
-                if (write_udp(args, &s->udp, buffer, (size_t) bytes) < 0)
+    // Check socket read
+    if (ev->events & EVENT_IN) {
+        s->udp.time = time(NULL);
+
+        // Edge triggered, so read until the socket is drained
+        if (s->udp.offload)
+            while (check_udp_gro(args, s));
+        else
+            while (check_udp_batch(args, s));
+    }
+}
+
+static int send_udp_gso(struct ng_session *s,
+                        const struct mmsghdr *msgs, struct iovec *iov, int count) {
+    // Segments must have the same size, except for the last one, which can be smaller
+    size_t segment = iov[0].iov_len;
+    size_t total = 0;
+    for (int m = 0; m < count; m++) {
+        if (iov[m].iov_len == 0 || iov[m].iov_len > segment ||
+            (m < count - 1 && iov[m].iov_len != segment))
+            return 0;
+        total += iov[m].iov_len;
+    }
+    if (total > s->udp.mss)
+        return 0;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_name = msgs[0].msg_hdr.msg_name;
+    msg.msg_namelen = msgs[0].msg_hdr.msg_namelen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) count;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = (uint16_t) segment;
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+
+    ssize_t res;
+    do
+        res = sendmsg(s->socket, &msg, MSG_NOSIGNAL);
+    while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        if (is_udp_soft_error(&s->udp, errno)) {
+            log_android(ANDROID_LOG_WARN, "UDP GSO error %d: %s", errno, strerror(errno));
+            return 0;
+        }
+
+        // Segment larger than the path MTU, no offload on the route, etc.
+        log_android(ANDROID_LOG_WARN, "UDP GSO error %d: %s, disabling",
+                    errno, strerror(errno));
+        s->udp.offload = 0;
+        return 0;
+    }
+
+    log_android(ANDROID_LOG_DEBUG, "UDP GSO %d segments of %d", count, segment);
+    s->udp.sent += total;
+    return 1;
+}
+
+void flush_udp(const struct arguments *args) {
+    // Datagrams for the same session are sent with one sendmmsg, in order
+    struct worker *w = args->worker;
+    struct mmsghdr msgs[TUN_YIELD];
+    struct iovec iov[TUN_YIELD];
+    struct udp_send *batch[TUN_YIELD];
+
+    for (int i = 0; i < w->udp_pending; i++) {
+        struct ng_session *s = w->udp_queue[i].session;
+        if (s == NULL)
+            continue;
+
+        int count = 0;
+        for (int j = i; j < w->udp_pending; j++) {
+            struct udp_send *q = &w->udp_queue[j];
+            if (q->session != s)
+                continue;
+            iov[count].iov_base = (void *) q->data;
+            iov[count].iov_len = q->datalen;
+            memset(&msgs[count], 0, sizeof(struct mmsghdr));
+            if (!s->udp.connected) {
+                msgs[count].msg_hdr.msg_name = &s->udp.target;
+                msgs[count].msg_hdr.msg_namelen = s->udp.target_len;
+            }
+            msgs[count].msg_hdr.msg_iov = &iov[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            batch[count++] = q;
+            q->session = NULL;
+        }
+
+        int sent = 0;
+        if (s->udp.offload && count > 1 && send_udp_gso(s, msgs, iov, count))
+            sent = count;
+
+        int retried = 0;
+        while (sent < count && s->udp.state == UDP_ACTIVE) {
+            int res = sendmmsg(s->socket, msgs + sent, (unsigned int) (count - sent),
+                               MSG_NOSIGNAL);
+            if (res < 0) {
+                log_android(ANDROID_LOG_ERROR, "UDP sendmmsg error %d: %s",
+                            errno, strerror(errno));
+                if (errno == EINTR)
+                    continue;
+                if (is_udp_soft_error(&s->udp, errno)) {
+                    // Reported once, so send again once
+                    if (!retried++)
+                        continue;
+                } else if (errno != EAGAIN)
                     s->udp.state = UDP_FINISHING;
-                else {
-                    // Prevent too many open files
-                    if (ntohs(s->udp.dest) == 53)
-                        s->udp.state = UDP_FINISHING;
-                }
+                break;
             }
-            ng_free(buffer, __FILE__, __LINE__);
+            for (int m = sent; m < sent + res; m++)
+                s->udp.sent += batch[m]->datalen;
+            sent += res;
         }
+        if (count > 1)
+            log_android(ANDROID_LOG_DEBUG, "UDP sendmmsg %d/%d", sent, count);
     }
+
+    w->udp_pending = 0;
 }
 
 int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload) {
     // Get headers
-    const uint8_t version = (*pkt) >> 4;
-    const struct iphdr *ip4 = (struct iphdr *) pkt;
-    const struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
     const struct udphdr *udphdr = (struct udphdr *) payload;
 
     if (ntohs(udphdr->dest) == 53 && !args->fwd53)
         return 1;
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
-
-    return (cur != NULL);
+    struct session_key key;
+    get_packet_key(&key, pkt, IPPROTO_UDP, udphdr->source, udphdr->dest);
+    return (find_session(args->worker, &key) != NULL);
 }
 
 void block_udp(const struct arguments *args,
@@ -214,17 +451,49 @@ void block_udp(const struct arguments *args,
     s->udp.source = udphdr->source;
     s->udp.dest = udphdr->dest;
     s->udp.state = UDP_BLOCKED;
+    init_tun_header(&s->udp.header, version, IPPROTO_UDP, &s->udp.daddr, &s->udp.saddr);
     s->socket = -1;
 
-    s->next = args->ctx->ng_session;
-    args->ctx->ng_session = s;
+    add_session(args->worker, s);
+}
+
+static int set_udp_target(struct udp_session *u, const struct allowed *redirect) {
+    // Destination or redirect target, returns the IP version of the target
+    memset(&u->target, 0, sizeof(u->target));
+    int rversion;
+    if (redirect == NULL) {
+        rversion = u->version;
+        if (u->version == 4) {
+            u->target.addr4.sin_family = AF_INET;
+            u->target.addr4.sin_addr.s_addr = (__be32) u->daddr.ip4;
+            u->target.addr4.sin_port = u->dest;
+        } else {
+            u->target.addr6.sin6_family = AF_INET6;
+            memcpy(&u->target.addr6.sin6_addr, &u->daddr.ip6, 16);
+            u->target.addr6.sin6_port = u->dest;
+        }
+    } else {
+        rversion = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
+        if (rversion == 4) {
+            u->target.addr4.sin_family = AF_INET;
+            inet_pton(AF_INET, redirect->raddr, &u->target.addr4.sin_addr);
+            u->target.addr4.sin_port = htons(redirect->rport);
+        } else {
+            u->target.addr6.sin6_family = AF_INET6;
+            inet_pton(AF_INET6, redirect->raddr, &u->target.addr6.sin6_addr);
+            u->target.addr6.sin6_port = htons(redirect->rport);
+        }
+    }
+    u->target_len = (socklen_t) (rversion == 4
+                                 ? sizeof(struct sockaddr_in)
+                                 : sizeof(struct sockaddr_in6));
+    return rversion;
 }
 
 jboolean handle_udp(const struct arguments *args,
                     const uint8_t *pkt, size_t length,
                     const uint8_t *payload,
-                    int uid, struct allowed *redirect,
-                    const int epoll_fd) {
+                    int uid, struct allowed *redirect) {
     // Get headers
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -234,16 +503,11 @@ jboolean handle_udp(const struct arguments *args,
     const size_t datalen = length - (data - pkt);
 
     // Search session
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct session_key key;
+    get_packet_key(&key, pkt, IPPROTO_UDP, udphdr->source, udphdr->dest);
+    struct ng_session *cur = find_session(args->worker, &key);
+    if (cur != NULL)
+        activate_session(args->worker, cur); // state might change
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -261,6 +525,37 @@ jboolean handle_udp(const struct arguments *args,
         return 0;
     }
 
+    // Answer repeated DNS queries from the cache of the server the query would go to
+    if (ntohs(udphdr->dest) == 53) {
+        struct udp_session u;
+        memset(&u, 0, sizeof(struct udp_session));
+        u.version = version;
+        if (version == 4) {
+            u.saddr.ip4 = (__be32) ip4->saddr;
+            u.daddr.ip4 = (__be32) ip4->daddr;
+        } else {
+            memcpy(&u.saddr.ip6, &ip6->ip6_src, 16);
+            memcpy(&u.daddr.ip6, &ip6->ip6_dst, 16);
+        }
+        u.source = udphdr->source;
+        u.dest = udphdr->dest;
+        if (cur == NULL)
+            set_udp_target(&u, redirect);
+        else
+            memcpy(&u.target, &cur->udp.target, sizeof(u.target));
+
+        uint8_t response[DNS_CACHE_LENGTH_MAX];
+        size_t rlen = get_dns_response(&args->ctx->dns_cache, (const struct sockaddr *) &u.target,
+                                       data, datalen, response);
+        if (rlen > 0) {
+            log_android(ANDROID_LOG_INFO, "UDP DNS cached from %s/%u to %s/%u data %d",
+                        source, ntohs(udphdr->source), dest, ntohs(udphdr->dest), rlen);
+
+            init_tun_header(&u.header, version, IPPROTO_UDP, &u.daddr, &u.saddr);
+            return (jboolean) (write_udp(args, &u, response, rlen) >= 0);
+        }
+    }
+
     // Create new session if needed
     if (cur == NULL) {
         log_android(ANDROID_LOG_INFO, "UDP new session from %s/%u to %s/%u",
@@ -274,13 +569,6 @@ jboolean handle_udp(const struct arguments *args,
         s->udp.uid = uid;
         s->udp.version = version;
 
-        int rversion;
-        if (redirect == NULL)
-            rversion = s->udp.version;
-        else
-            rversion = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
-        s->udp.mss = (uint16_t) (rversion == 4 ? UDP4_MAXMSG : UDP6_MAXMSG);
-
         s->udp.sent = 0;
         s->udp.received = 0;
 
@@ -295,26 +583,32 @@ jboolean handle_udp(const struct arguments *args,
         s->udp.source = udphdr->source;
         s->udp.dest = udphdr->dest;
         s->udp.state = UDP_ACTIVE;
+        init_tun_header(&s->udp.header, version, IPPROTO_UDP, &s->udp.daddr, &s->udp.saddr);
         s->next = NULL;
 
+        // Resolve target once, the redirect is fixed for the lifetime of the session
+        int rversion = set_udp_target(&s->udp, redirect);
+        if (redirect != NULL)
+            log_android(ANDROID_LOG_WARN, "UDP%d redirect to %s/%u",
+                        rversion, redirect->raddr, redirect->rport);
+        s->udp.mss = (uint16_t) (rversion == 4 ? UDP4_MAXMSG : UDP6_MAXMSG);
+
         // Open UDP socket
-        s->socket = open_udp_socket(args, &s->udp, redirect);
+        s->socket = open_udp_socket(args, &s->udp);
         if (s->socket < 0) {
             ng_free(s, __FILE__, __LINE__);
             return 0;
         }
 
-        log_android(ANDROID_LOG_DEBUG, "UDP socket %d", s->socket);
+        log_android(ANDROID_LOG_DEBUG, "UDP socket %d connected %d",
+                    s->socket, s->udp.connected);
 
         // Monitor events
-        memset(&s->ev, 0, sizeof(struct epoll_event));
-        s->ev.events = EPOLLIN | EPOLLERR;
-        s->ev.data.ptr = s;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
-            log_android(ANDROID_LOG_ERROR, "epoll add udp error %d: %s", errno, strerror(errno));
+        s->events = EVENT_IN | EVENT_ERR | EVENT_ET; // reads drain the socket
+        if (register_event(&args->worker->loop, s->socket, s->events, s))
+            log_android(ANDROID_LOG_ERROR, "event add udp error %d: %s", errno, strerror(errno));
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->worker, s);
 
         cur = s;
     }
@@ -330,62 +624,25 @@ jboolean handle_udp(const struct arguments *args,
 
     cur->udp.time = time(NULL);
 
-    int rversion;
-    struct sockaddr_in addr4;
-    struct sockaddr_in6 addr6;
-    if (redirect == NULL) {
-        rversion = cur->udp.version;
-        if (cur->udp.version == 4) {
-            addr4.sin_family = AF_INET;
-            addr4.sin_addr.s_addr = (__be32) cur->udp.daddr.ip4;
-            addr4.sin_port = cur->udp.dest;
-        } else {
-            addr6.sin6_family = AF_INET6;
-            memcpy(&addr6.sin6_addr, &cur->udp.daddr.ip6, 16);
-            addr6.sin6_port = cur->udp.dest;
-        }
-    } else {
-        rversion = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
-        log_android(ANDROID_LOG_WARN, "UDP%d redirect to %s/%u",
-                    rversion, redirect->raddr, redirect->rport);
-
-        if (rversion == 4) {
-            addr4.sin_family = AF_INET;
-            inet_pton(AF_INET, redirect->raddr, &addr4.sin_addr);
-            addr4.sin_port = htons(redirect->rport);
-        } else {
-            addr6.sin6_family = AF_INET6;
-            inet_pton(AF_INET6, redirect->raddr, &addr6.sin6_addr);
-            addr6.sin6_port = htons(redirect->rport);
-        }
-    }
-
-    if (sendto(cur->socket, data, (socklen_t) datalen, MSG_NOSIGNAL,
-               (rversion == 4 ? (const struct sockaddr *) &addr4
-                              : (const struct sockaddr *) &addr6),
-               (socklen_t) (rversion == 4 ? sizeof(addr4) : sizeof(addr6))) != datalen) {
-        log_android(ANDROID_LOG_ERROR, "UDP sendto error %d: %s", errno, strerror(errno));
-        if (errno != EINTR && errno != EAGAIN) {
-            cur->udp.state = UDP_FINISHING;
-            return 0;
-        }
-    } else
-        cur->udp.sent += datalen;
+    // Queue for sending at the end of the tun batch, the data stays in the tun or worker buffer
+    if (args->worker->udp_pending == TUN_YIELD)
+        flush_udp(args);
+    struct udp_send *q = &args->worker->udp_queue[args->worker->udp_pending++];
+    memset(q, 0, sizeof(struct udp_send));
+    q->session = cur;
+    q->data = data;
+    q->datalen = datalen;
 
     return 1;
 }
 
-int open_udp_socket(const struct arguments *args,
-                    const struct udp_session *cur, const struct allowed *redirect) {
+int open_udp_socket(const struct arguments *args, struct udp_session *cur) {
     int sock;
-    int version;
-    if (redirect == NULL)
-        version = cur->version;
-    else
-        version = (strstr(redirect->raddr, ":") == NULL ? 4 : 6);
+    int broadcast = 0;
 
     // Get UDP socket
-    sock = socket(version == 4 ? PF_INET : PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    sock = socket(cur->target.addr4.sin_family == AF_INET ? PF_INET : PF_INET6,
+                  SOCK_DGRAM, IPPROTO_UDP);
     if (sock < 0) {
         log_android(ANDROID_LOG_ERROR, "UDP socket error %d: %s", errno, strerror(errno));
         return -1;
@@ -400,6 +657,7 @@ int open_udp_socket(const struct arguments *args,
         uint32_t broadcast4 = INADDR_BROADCAST;
         if (memcmp(&cur->daddr.ip4, &broadcast4, sizeof(broadcast4)) == 0) {
             log_android(ANDROID_LOG_WARN, "UDP4 broadcast");
+            broadcast = 1;
             int on = 1;
             if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)))
                 log_android(ANDROID_LOG_ERROR, "UDP setsockopt SO_BROADCAST error %d: %s",
@@ -409,6 +667,7 @@ int open_udp_socket(const struct arguments *args,
         // http://man7.org/linux/man-pages/man7/ipv6.7.html
         if (*((uint8_t *) &cur->daddr.ip6) == 0xFF) {
             log_android(ANDROID_LOG_WARN, "UDP6 broadcast");
+            broadcast = 1;
 
             int loop = 1; // true
             if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)))
@@ -432,77 +691,46 @@ int open_udp_socket(const struct arguments *args,
         }
     }
 
+    // Connect unicast sockets, so the route is looked up once
+    // Broadcast/multicast replies come from other addresses and would be filtered
+    cur->connected = 0;
+    if (!broadcast) {
+        if (connect(sock, (const struct sockaddr *) &cur->target, cur->target_len))
+            log_android(ANDROID_LOG_WARN, "UDP connect error %d: %s", errno, strerror(errno));
+        else
+            cur->connected = 1;
+    }
+
+    // Segmentation offload for bulk flows, the kernel support is probed once
+    cur->offload = 0;
+    if (args->ctx->udp_offload && cur->connected && ntohs(cur->dest) != 53 &&
+        udp_offload_support != UDP_OFFLOAD_UNSUPPORTED) {
+        int on = 1;
+        if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+            log_android(ANDROID_LOG_WARN, "UDP setsockopt UDP_GRO error %d: %s, no offload",
+                        errno, strerror(errno));
+            udp_offload_support = UDP_OFFLOAD_UNSUPPORTED;
+        } else {
+            udp_offload_support = UDP_OFFLOAD_SUPPORTED;
+            cur->offload = 1;
+        }
+    }
+
     return sock;
 }
 
 ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
                   uint8_t *data, size_t datalen) {
-    size_t len;
-    u_int8_t *buffer;
-    struct udphdr *udp;
+    uint32_t buffer[(sizeof(struct ip6_hdr) + sizeof(struct udphdr)) / 4];
     uint16_t csum;
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
 
-    // Build packet
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct iphdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct udphdr), data, datalen);
-
-        // Build IP4 header
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_UDP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        // Calculate IP4 checksum
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        // Calculate UDP4 checksum
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct udphdr) + datalen);
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
-    } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct ip6_hdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct udphdr), data, datalen);
-
-        // Build IP6 header
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = 0;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_UDP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        // Calculate UDP6 checksum
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
+    // Build headers, the data is written from where it is
+    size_t hlen = build_tun_header(&cur->header, (uint8_t *) buffer,
+                                   sizeof(struct udphdr) + datalen, &csum);
+    struct udphdr *udp = (struct udphdr *) ((uint8_t *) buffer + hlen);
+    size_t len = hlen + sizeof(struct udphdr) + datalen;
 
     // Build UDP header
     memset(udp, 0, sizeof(struct udphdr));
@@ -529,17 +757,15 @@ ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
                 "UDP sending to tun %d from %s/%u to %s/%u data %u",
                 args->tun, dest, ntohs(cur->dest), source, ntohs(cur->source), len);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    // Write PCAP record
-    if (res >= 0) {
-        if (pcap_file != NULL)
-            write_pcap_rec(buffer, (size_t) res);
-    } else
+    struct iovec iov[2];
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = hlen + sizeof(struct udphdr);
+    iov[1].iov_base = data;
+    iov[1].iov_len = datalen;
+    ssize_t res = write_tun(args, iov, 2);
+    if (res < 0)
         log_android(ANDROID_LOG_WARN, "UDP write error %d: %s", errno, strerror(errno));
 
-    ng_free(buffer, __FILE__, __LINE__);
-
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
         return -1;
@@ -0,0 +1,162 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// Minimal io_uring without liburing, which is not part of the NDK.
+// Apps might not be allowed to use io_uring (seccomp, SELinux),
+// so setup failures are expected and callers fall back to plain system calls.
+
+int uring_support = URING_UNKNOWN;
+
+int init_uring(struct uring *u, unsigned entries) {
+    memset(u, 0, sizeof(struct uring));
+    u->fd = -1;
+    if (uring_support == URING_UNSUPPORTED)
+        return -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(struct io_uring_params));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_WARN, "io_uring setup error %d: %s", errno, strerror(errno));
+        uring_support = URING_UNSUPPORTED;
+        return -1;
+    }
+    u->fd = fd;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        log_android(ANDROID_LOG_ERROR, "io_uring mmap error %d: %s", errno, strerror(errno));
+        free_uring(u);
+        uring_support = URING_UNSUPPORTED;
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *) u->sq_ptr;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+
+    uint8_t *cq = (uint8_t *) u->cq_ptr;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    u->features = p.features;
+
+    uring_support = URING_SUPPORTED;
+    log_android(ANDROID_LOG_WARN, "io_uring entries %u/%u features %x",
+                p.sq_entries, p.cq_entries, p.features);
+    return 0;
+}
+
+void free_uring(struct uring *u) {
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_size);
+    if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_size);
+    if (u->fd >= 0 && close(u->fd))
+        log_android(ANDROID_LOG_ERROR, "io_uring close error %d: %s", errno, strerror(errno));
+    memset(u, 0, sizeof(struct uring));
+    u->fd = -1;
+}
+
+int register_uring_buffers(struct uring *u, const struct iovec *iov, unsigned count) {
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+        log_android(ANDROID_LOG_WARN, "io_uring register buffers error %d: %s",
+                    errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *get_uring_sqe(struct uring *u) {
+    // Single submitter, the kernel only advances the head
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local - head >= u->sq_entries)
+        return NULL;
+
+    unsigned index = u->sq_local & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[index] = index;
+    u->sq_local++;
+    return sqe;
+}
+
+int submit_uring(struct uring *u, unsigned wait) {
+    unsigned submit = u->sq_local - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    int res;
+    do {
+        res = (int) syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0)
+        log_android(ANDROID_LOG_ERROR, "io_uring enter error %d: %s", errno, strerror(errno));
+    return res;
+}
+
+struct io_uring_cqe *peek_uring_cqe(struct uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void seen_uring_cqe(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int wait_uring(struct uring *u, unsigned wait, int timeout) {
+    // Submits what the kernel did not take yet, timeout in milliseconds, -1 = none
+    unsigned submit = u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    struct uring_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+    struct uring_wait_arg arg;
+    memset(&arg, 0, sizeof(struct uring_wait_arg));
+    arg.ts = (timeout < 0 ? 0 : (uint64_t) (uintptr_t) &ts);
+
+    int res = (int) syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                            &arg, sizeof(struct uring_wait_arg));
+    if (res < 0 && errno == ETIME)
+        return 0;
+    return res;
+}
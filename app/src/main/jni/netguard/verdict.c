@@ -0,0 +1,132 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+
+#include "netguard.h"
+
+// Verdicts of is_address_allowed by uid, version, protocol, destination address and port
+// Java invalidates all verdicts by bumping the generation when the rules change,
+// which can happen from upcalls with a worker lock held, so this is lock free.
+// Hits are logged after the batch of packets, coalesced by key.
+
+void init_verdicts(struct verdict_cache *vc) {
+    vc->slots = ng_calloc(VERDICT_SLOTS, sizeof(struct verdict), "verdicts");
+    vc->generation = 1;
+    vc->log = 0;
+    vc->pending = 0;
+}
+
+void free_verdicts(struct verdict_cache *vc) {
+    ng_free(vc->slots, __FILE__, __LINE__);
+    vc->slots = NULL;
+}
+
+void update_verdicts(struct verdict_cache *vc, int log) {
+    __atomic_store_n(&vc->log, log, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&vc->generation, 1, __ATOMIC_RELEASE) == 0)
+        __atomic_add_fetch(&vc->generation, 1, __ATOMIC_RELEASE); // 0 = empty
+}
+
+void get_verdict_key(struct verdict_key *key,
+                     int version, int protocol, const void *daddr, uint16_t dport, jint uid) {
+    memset(key, 0, sizeof(struct verdict_key));
+    key->uid = uid;
+    key->version = (uint8_t) version;
+    key->protocol = (uint8_t) protocol;
+    key->dport = dport;
+    memcpy(key->daddr, daddr, version == 4 ? 4 : 16);
+}
+
+static struct verdict *get_slot(struct verdict_cache *vc, const struct verdict_key *key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    const uint8_t *k = (const uint8_t *) key;
+    for (size_t i = 0; i < sizeof(struct verdict_key); i++) {
+        hash ^= k[i];
+        hash *= 16777619u;
+    }
+    return &vc->slots[hash & (VERDICT_SLOTS - 1)];
+}
+
+struct verdict *get_verdict(struct verdict_cache *vc,
+                            const struct verdict_key *key, uint32_t *generation) {
+    *generation = __atomic_load_n(&vc->generation, __ATOMIC_ACQUIRE);
+
+    struct verdict *v = get_slot(vc, key);
+    if (v->generation == *generation && v->expires > time(NULL) &&
+        memcmp(&v->key, key, sizeof(struct verdict_key)) == 0)
+        return v;
+    return NULL;
+}
+
+void put_verdict(struct verdict_cache *vc,
+                 const struct verdict_key *key, uint32_t generation,
+                 const struct allowed *allowed) {
+    struct verdict *v = get_slot(vc, key);
+    memcpy(&v->key, key, sizeof(struct verdict_key));
+    v->generation = generation;
+    v->expires = time(NULL) + VERDICT_TTL;
+    v->allowed = (jboolean) (allowed != NULL);
+    if (allowed == NULL)
+        memset(&v->redirect, 0, sizeof(struct allowed));
+    else
+        memcpy(&v->redirect, allowed, sizeof(struct allowed));
+}
+
+void queue_verdict_log(const struct arguments *args, const struct verdict *v,
+                       const char *flags, const char *source, uint16_t sport, const char *data) {
+    struct verdict_cache *vc = &args->worker->verdicts;
+    if (!__atomic_load_n(&vc->log, __ATOMIC_RELAXED))
+        return;
+
+    for (int i = 0; i < vc->pending; i++)
+        if (vc->queue[i].allowed == v->allowed &&
+            memcmp(&vc->queue[i].key, &v->key, sizeof(struct verdict_key)) == 0)
+            return;
+
+    if (vc->pending == VERDICT_LOG)
+        flush_verdict_log(args);
+
+    struct verdict_log *l = &vc->queue[vc->pending++];
+    memcpy(&l->key, &v->key, sizeof(struct verdict_key));
+    l->allowed = v->allowed;
+    strcpy(l->flags, flags);
+    strcpy(l->source, source);
+    l->sport = sport;
+    if (v->allowed && *v->redirect.raddr && v->redirect.rport)
+        sprintf(l->data, "> %s/%u", v->redirect.raddr, v->redirect.rport);
+    else
+        strcpy(l->data, data);
+}
+
+void flush_verdict_log(const struct arguments *args) {
+    struct verdict_cache *vc = &args->worker->verdicts;
+    for (int i = 0; i < vc->pending; i++) {
+        struct verdict_log *l = &vc->queue[i];
+        char dest[INET6_ADDRSTRLEN + 1];
+        inet_ntop(l->key.version == 4 ? AF_INET : AF_INET6, l->key.daddr, dest, sizeof(dest));
+
+        jobject objPacket = create_packet(
+                args, l->key.version, l->key.protocol, l->flags,
+                l->source, l->sport, dest, l->key.dport,
+                l->data, l->key.uid, l->allowed);
+        log_packet(args, objPacket);
+    }
+    vc->pending = 0;
+}
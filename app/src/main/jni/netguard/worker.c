@@ -0,0 +1,285 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+#include "netguard.h"
+
+// Each worker owns the sessions of the flows hashed to it, with its own thread and event loop.
+// Worker 0 runs on the thread calling jni_run and drains the queue filled by the tun reader,
+// packets of the other workers are copied into their queue.
+// All workers write to tun directly.
+
+void init_worker(struct context *ctx, int id) {
+    struct worker *w = &ctx->worker[id];
+    w->id = id;
+    if (w->udp_buffer != NULL)
+        return;
+
+    w->udp_buffer = ng_malloc(UDP_YIELD * UDP_SLOT, "udp buffer");
+    w->gro_buffer = ng_malloc(UDP_GRO_BUFFER, "gro buffer");
+    init_verdicts(&w->verdicts);
+    w->verdicts.log = ctx->worker[0].verdicts.log;
+
+    w->queue.buffer = ng_malloc(PACKET_QUEUE * get_mtu(), "worker queue");
+    w->out.buffer = ng_malloc(PACKET_QUEUE * get_mtu(), "tun queue");
+    w->uid_diag = -1;
+    w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wakefd < 0)
+        log_android(ANDROID_LOG_ERROR, "Worker %d eventfd error %d: %s",
+                    id, errno, strerror(errno));
+}
+
+void free_worker(struct worker *w) {
+    clear(w);
+    free_sessions(w);
+    if (w->udp_buffer == NULL)
+        return;
+
+    ng_free(w->udp_buffer, __FILE__, __LINE__);
+    ng_free(w->gro_buffer, __FILE__, __LINE__);
+    free_verdicts(&w->verdicts);
+    w->udp_buffer = NULL;
+    w->gro_buffer = NULL;
+
+    ng_free(w->queue.buffer, __FILE__, __LINE__);
+    ng_free(w->out.buffer, __FILE__, __LINE__);
+    w->queue.buffer = NULL;
+    w->out.buffer = NULL;
+
+    if (w->wakefd >= 0 && close(w->wakefd))
+        log_android(ANDROID_LOG_ERROR, "Close worker %d eventfd error %d: %s",
+                    w->id, errno, strerror(errno));
+    w->wakefd = -1;
+
+    if (w->uid_diag >= 0 && close(w->uid_diag))
+        log_android(ANDROID_LOG_ERROR, "Close uid diag error %d: %s", errno, strerror(errno));
+    w->uid_diag = -1;
+}
+
+void lock_workers(struct context *ctx) {
+    for (int i = 0; i < WORKERS_MAX; i++)
+        if (pthread_mutex_lock(&ctx->worker[i].lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+}
+
+void unlock_workers(struct context *ctx) {
+    for (int i = WORKERS_MAX - 1; i >= 0; i--)
+        if (pthread_mutex_unlock(&ctx->worker[i].lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+static void *run_worker(void *data) {
+    struct arguments *args = (struct arguments *) data;
+    struct context *ctx = args->ctx;
+    jobject instance = args->instance;
+    int id = args->worker->id;
+
+    JNIEnv *env;
+    if ((*ctx->jvm)->AttachCurrentThread(ctx->jvm, &env, NULL) != JNI_OK) {
+        log_android(ANDROID_LOG_ERROR, "Worker %d attach failed", id);
+        ng_free(args, __FILE__, __LINE__);
+        return NULL;
+    }
+    args->env = env;
+
+    handle_events(args);
+
+    // Stop all workers when this one failed
+    if (!ctx->stopping) {
+        log_android(ANDROID_LOG_ERROR, "Worker %d exited", id);
+        ctx->stopping = 1;
+        if (write(ctx->pipefds[1], "w", 1) < 0)
+            log_android(ANDROID_LOG_WARN, "Write pipe error %d: %s", errno, strerror(errno));
+    }
+
+    (*env)->DeleteGlobalRef(env, instance);
+    ng_delete_alloc(instance, __FILE__, __LINE__);
+
+    if ((*ctx->jvm)->DetachCurrentThread(ctx->jvm) != JNI_OK)
+        log_android(ANDROID_LOG_ERROR, "Worker %d detach failed", id);
+
+    return NULL;
+}
+
+void start_workers(const struct arguments *args) {
+    struct context *ctx = args->ctx;
+    for (int i = 1; i < ctx->nworkers; i++) {
+        struct worker *w = &ctx->worker[i];
+        init_worker(ctx, i);
+        w->queue.head = 0;
+        w->queue.tail = 0;
+        w->queue.dropped = 0;
+
+        struct arguments *wargs = ng_malloc(sizeof(struct arguments), "arguments");
+        memcpy(wargs, args, sizeof(struct arguments));
+        wargs->env = NULL;
+        wargs->instance = jniGlobalRef(args->env, args->instance);
+        ng_add_alloc(wargs->instance, "instance");
+        wargs->worker = w;
+
+        int err = pthread_create(&w->thread, NULL, run_worker, wargs);
+        if (err) {
+            log_android(ANDROID_LOG_ERROR, "Worker %d pthread_create error %d: %s",
+                        i, err, strerror(err));
+            (*args->env)->DeleteGlobalRef(args->env, wargs->instance);
+            ng_delete_alloc(wargs->instance, __FILE__, __LINE__);
+            ng_free(wargs, __FILE__, __LINE__);
+
+            // Packets would be queued for nobody
+            ctx->nworkers = i;
+            break;
+        }
+    }
+}
+
+void stop_workers(struct context *ctx) {
+    if (ctx->nworkers < 2)
+        return;
+
+    ctx->stopping = 1;
+    for (int i = 1; i < ctx->nworkers; i++) {
+        struct worker *w = &ctx->worker[i];
+        wake_worker(w);
+
+        int err = pthread_join(w->thread, NULL);
+        if (err)
+            log_android(ANDROID_LOG_ERROR, "Worker %d pthread_join error %d: %s",
+                        i, err, strerror(err));
+
+        if (w->queue.dropped > 0)
+            log_android(ANDROID_LOG_WARN, "Worker %d dropped %u packets", i, w->queue.dropped);
+    }
+}
+
+int get_shard(const struct context *ctx, const uint8_t *pkt, size_t length) {
+    if (ctx->nworkers < 2)
+        return 0;
+
+    // Protocol, addresses and, if not a fragment, ports of the packet from tun
+    uint8_t protocol;
+    const uint8_t *addr;
+    size_t alen;
+    const uint8_t *payload = NULL;
+    uint8_t version = (*pkt) >> 4;
+    if (version == 4 && length >= sizeof(struct iphdr)) {
+        const struct iphdr *ip4 = (const struct iphdr *) pkt;
+        size_t hlen = ip4->ihl * 4;
+        protocol = ip4->protocol;
+        addr = (const uint8_t *) &ip4->saddr;
+        alen = 8;
+        if ((ntohs(ip4->frag_off) & IP_OFFMASK) == 0 && length >= hlen + 4)
+            payload = pkt + hlen;
+    } else if (version == 6 && length >= sizeof(struct ip6_hdr)) {
+        // Protocol and ports as handle_ip finds them
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr *) pkt;
+        size_t off = get_ip6_payload(pkt, length, &protocol);
+        addr = (const uint8_t *) &ip6->ip6_src;
+        alen = 32;
+        if (length >= off + 4)
+            payload = pkt + off;
+    } else
+        return 0;
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ protocol) * 16777619u;
+    for (size_t i = 0; i < alen; i++)
+        hash = (hash ^ addr[i]) * 16777619u;
+    if (payload != NULL && (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP))
+        for (int i = 0; i < 4; i++)
+            hash = (hash ^ payload[i]) * 16777619u;
+
+    return (int) (hash % (uint32_t) ctx->nworkers);
+}
+
+int queue_packet(struct worker *w, const uint8_t *pkt, size_t length) {
+    struct packet_queue *q = &w->queue;
+    uint32_t head = q->head;
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= PACKET_QUEUE) {
+        q->dropped++;
+        return -1;
+    }
+
+    uint32_t slot = head & (PACKET_QUEUE - 1);
+    memcpy(q->buffer + slot * get_mtu(), pkt, length);
+    q->length[slot] = length;
+    q->time[slot] = get_us();
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void wake_worker(struct worker *w) {
+    uint64_t one = 1;
+    if (write(w->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_android(ANDROID_LOG_WARN, "Worker %d wake error %d: %s",
+                    w->id, errno, strerror(errno));
+}
+
+int check_queue(const struct arguments *args, int sessions, int maxsessions) {
+    struct context *ctx = args->ctx;
+    struct worker *w = args->worker;
+    struct packet_queue *q = &w->queue;
+
+    uint64_t count;
+    if (read(w->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_android(ANDROID_LOG_WARN, "Worker %d read error %d: %s",
+                    w->id, errno, strerror(errno));
+
+    // Packets queued until now, later packets come with another wakeup
+    uint16_t mtu = get_mtu();
+    long long now = get_us();
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = q->tail;
+    while (tail != head) {
+        // In batches fitting the datagram queue, slots are released after sending
+        int wake[WORKERS_MAX];
+        memset(wake, 0, sizeof(wake));
+        int batch = 0;
+        while (tail != head && batch < TUN_YIELD) {
+            uint32_t slot = tail & (PACKET_QUEUE - 1);
+            uint8_t *pkt = q->buffer + slot * mtu;
+
+            uint32_t delay = (uint32_t) (now > q->time[slot] ? now - q->time[slot] : 0);
+            q->delay += delay;
+            if (delay > q->delay_max)
+                q->delay_max = delay;
+            q->dequeued++;
+
+            if (w->id == 0)
+                handle_tun(args, pkt, q->length[slot], sessions, maxsessions, wake);
+            else
+                handle_ip(args, pkt, q->length[slot], sessions, maxsessions);
+            tail++;
+            batch++;
+        }
+
+        for (int i = 1; i < ctx->nworkers; i++)
+            if (wake[i])
+                wake_worker(&ctx->worker[i]);
+
+        // Send datagrams and log cached verdicts after the packets were handled
+        flush_udp(args);
+        flush_verdict_log(args);
+
+        __atomic_store_n(&q->tail, tail, __ATOMIC_SEQ_CST);
+        if (w->id == 0)
+            resume_tun_reader(ctx);
+    }
+
+    return (w->id == 0 ? check_tun(args) : 0);
+}
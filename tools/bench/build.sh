@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds and runs a benchmark of the native code on the host
+# Usage: tools/bench/build.sh session|checksum|uring [arguments]
+set -e
+bench=$1
+shift
+root=$(cd "$(dirname "$0")/../.." && pwd)
+src=$root/app/src/main/jni/netguard
+out=${TMPDIR:-/tmp}/netguard_bench_$bench
+${CC:-cc} -O2 -std=gnu11 -D_GNU_SOURCE -Wall \
+    -I"$root/tools/bench/include" -I"$root/tools/bench" -I"$src" \
+    -o "$out" "$root/tools/bench/${bench}_bench.c" "$root/tools/bench/host.c" "$src"/*.c -lpthread
+"$out" "$@"
@@ -0,0 +1,153 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+// Checksum: compares every variant supported by this CPU, and calc_checksum,
+// with the original loop adding one 16 bit word at a time,
+// for all lengths up to 2 KB at every alignment, for full size packets,
+// and for all ones buffers large enough to flush the vector lanes,
+// then measures the throughput
+
+#include "netguard.h"
+#include "bench.h"
+
+#define CHECK_LENGTH 2048
+#define CHECK_LARGE (3 * CHECKSUM_FLUSH * 64 + 7)
+#define CHECK_STARTS 5
+#define BENCH_BYTES (1LL << 30)
+
+static const uint16_t starts[CHECK_STARTS] = {0x0000, 0x0001, 0x1235, 0x8001, 0xFFFF};
+
+// The checksum before the vector versions, the sum cannot overflow up to the IP packet size
+static uint16_t calc_checksum_words(uint16_t start, const uint8_t *buffer, size_t length) {
+    register uint32_t sum = start;
+    register uint16_t *buf = (uint16_t *) buffer;
+    register size_t len = length;
+
+    while (len > 1) {
+        sum += *buf++;
+        len -= 2;
+    }
+
+    if (len > 0)
+        sum += *((uint8_t *) buf);
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t) sum;
+}
+
+static uint16_t fold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) sum;
+}
+
+static int check_sum(const struct checksum_variant *v, const uint8_t *buffer, size_t length,
+                     uint16_t start, uint16_t expected) {
+    uint16_t actual = (v == NULL
+                       ? calc_checksum(start, buffer, length)
+                       : fold(v->sum(buffer, length, start)));
+    if (actual != expected) {
+        printf("%s align %zu length %zu start %04x sum %04x expected %04x\n",
+               v == NULL ? "calc_checksum" : v->name, (size_t) ((uintptr_t) buffer & 63),
+               length, start, actual, expected);
+        return -1;
+    }
+    return 0;
+}
+
+// NULL checks calc_checksum
+static int check(const struct checksum_variant *v, const uint8_t *buffer) {
+    for (size_t offset = 0; offset < 64; offset++)
+        for (size_t length = 0; length <= CHECK_LENGTH; length++) {
+            uint16_t start = starts[(offset + length) % CHECK_STARTS];
+            uint16_t expected = calc_checksum_words(start, buffer + offset, length);
+            if (check_sum(v, buffer + offset, length, start, expected))
+                return -1;
+        }
+
+    for (size_t offset = 0; offset < 4; offset++)
+        for (int s = 0; s < CHECK_STARTS; s++) {
+            size_t length = 65535 - (size_t) s;
+            uint16_t expected = calc_checksum_words(starts[s], buffer + offset, length);
+            if (check_sum(v, buffer + offset, length, starts[s], expected))
+                return -1;
+        }
+    return 0;
+}
+
+static int check_large(const struct checksum_variant *v) {
+    uint8_t *large = ng_malloc(CHECK_LARGE + 1, "bench");
+    memset(large, 0xFF, CHECK_LARGE + 1);
+    int err = 0;
+    for (size_t offset = 0; offset < 2 && !err; offset++)
+        for (int s = 0; s < CHECK_STARTS && !err; s++) {
+            // The original loop in even blocks it cannot overflow on, each continuing the sum
+            uint16_t expected = starts[s];
+            for (size_t done = 0; done < CHECK_LARGE; done += 32768) {
+                size_t length = (CHECK_LARGE - done < 32768 ? CHECK_LARGE - done : 32768);
+                expected = calc_checksum_words(expected, large + offset + done, length);
+            }
+            err = check_sum(v, large + offset, CHECK_LARGE, starts[s], expected);
+        }
+    ng_free(large, __FILE__, __LINE__);
+    return err;
+}
+
+static void bench(const struct checksum_variant *v, const uint8_t *buffer, size_t length) {
+    long rounds = BENCH_BYTES / length;
+    volatile uint64_t sum = 0;
+    double start = get_ns();
+    for (long i = 0; i < rounds; i++)
+        sum += v->sum(buffer + (i & 1), length, 0);
+    double ns = get_ns() - start;
+    printf("%-6s %6zu bytes %6.2f GB/s\n", v->name, length, (double) rounds * length / ns);
+}
+
+int main() {
+    struct checksum_variant variant[CHECKSUM_VARIANTS];
+    int count = get_checksum_variants(variant);
+
+    uint8_t *buffer = ng_malloc(65536 + 64, "bench");
+    srand(1);
+    for (int i = 0; i < 65536 + 64; i++)
+        buffer[i] = (uint8_t) rand();
+
+    int err = 0;
+    for (int i = 0; i < count; i++)
+        if (check(&variant[i], buffer) || check_large(&variant[i]))
+            err = 1;
+        else
+            printf("%s matches the original checksum\n", variant[i].name);
+    if (check(NULL, buffer) || check_large(NULL))
+        err = 1;
+    else
+        printf("calc_checksum matches the original checksum\n");
+
+    size_t lengths[] = {40, 576, 1500, 65535};
+    for (int i = 0; i < count; i++)
+        for (int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+            bench(&variant[i], buffer, lengths[l]);
+
+    ng_free(buffer, __FILE__, __LINE__);
+    return err;
+}
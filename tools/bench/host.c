@@ -0,0 +1,41 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+// Android libc functions the native sources use, for the host build of the benchmarks
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "bench.h"
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    return 0;
+}
+
+int __system_property_get(const char *name, char *value) {
+    value[0] = 0;
+    return 0;
+}
+
+double get_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
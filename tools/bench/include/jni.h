@@ -0,0 +1,90 @@
+// Host build of the benchmarks only: the types and the part of the JNI function table
+// the native sources use, no virtual machine is available
+#ifndef BENCH_JNI_H
+#define BENCH_JNI_H
+
+#include <stdint.h>
+#include <stdarg.h>
+
+typedef int32_t jint;
+typedef int64_t jlong;
+typedef uint8_t jboolean;
+typedef int8_t jbyte;
+typedef uint16_t jchar;
+typedef int16_t jshort;
+typedef float jfloat;
+typedef double jdouble;
+typedef jint jsize;
+typedef void *jobject;
+typedef jobject jclass;
+typedef jobject jstring;
+typedef jobject jthrowable;
+typedef jobject jarray;
+typedef jarray jintArray;
+typedef jarray jbyteArray;
+typedef jarray jobjectArray;
+typedef jarray jlongArray;
+typedef struct _jfieldID *jfieldID;
+typedef struct _jmethodID *jmethodID;
+#define JNI_OK 0
+#define JNI_VERSION_1_6 0x00010006
+#define JNIEXPORT
+#define JNICALL
+#define JNI_ABORT 2
+struct JNINativeInterface;
+typedef const struct JNINativeInterface *JNIEnv;
+struct JNIInvokeInterface;
+typedef const struct JNIInvokeInterface *JavaVM;
+struct JNIInvokeInterface {
+    jint (*GetEnv)(JavaVM *, void **, jint);
+    jint (*AttachCurrentThread)(JavaVM *, JNIEnv **, void *);
+    jint (*DetachCurrentThread)(JavaVM *);
+};
+struct JNINativeInterface {
+    jobject (*CallObjectMethod)(JNIEnv*, jobject, jmethodID, ...);
+    jboolean (*CallBooleanMethod)(JNIEnv*, jobject, jmethodID, ...);
+    jint (*CallIntMethod)(JNIEnv*, jobject, jmethodID, ...);
+    jlong (*CallLongMethod)(JNIEnv*, jobject, jmethodID, ...);
+    void (*CallVoidMethod)(JNIEnv*, jobject, jmethodID, ...);
+    void (*DeleteGlobalRef)(JNIEnv*, jobject);
+    void (*DeleteLocalRef)(JNIEnv*, jobject);
+    void (*ExceptionClear)(JNIEnv*);
+    void (*ExceptionDescribe)(JNIEnv*);
+    jthrowable (*ExceptionOccurred)(JNIEnv*);
+    jclass (*FindClass)(JNIEnv*, const char*);
+    jfieldID (*GetFieldID)(JNIEnv*, jclass, const char*, const char*);
+    jint* (*GetIntArrayElements)(JNIEnv*, jintArray, jboolean*);
+    jlong* (*GetLongArrayElements)(JNIEnv*, jlongArray, jboolean*);
+    jint (*GetIntField)(JNIEnv*, jobject, jfieldID);
+    jmethodID (*GetMethodID)(JNIEnv*, jclass, const char*, const char*);
+    jclass (*GetObjectClass)(JNIEnv*, jobject);
+    jobject (*GetObjectField)(JNIEnv*, jobject, jfieldID);
+    jfieldID (*GetStaticFieldID)(JNIEnv*, jclass, const char*, const char*);
+    jint (*GetStaticIntField)(JNIEnv*, jclass, jfieldID);
+    const char* (*GetStringUTFChars)(JNIEnv*, jstring, jboolean*);
+    jobject (*NewGlobalRef)(JNIEnv*, jobject);
+    jintArray (*NewIntArray)(JNIEnv*, jsize);
+    jlongArray (*NewLongArray)(JNIEnv*, jsize);
+    jobject (*NewObject)(JNIEnv*, jclass, jmethodID, ...);
+    jstring (*NewStringUTF)(JNIEnv*, const char*);
+    void (*ReleaseIntArrayElements)(JNIEnv*, jintArray, jint*, jint);
+    void (*ReleaseLongArrayElements)(JNIEnv*, jlongArray, jlong*, jint);
+    void (*ReleaseStringUTFChars)(JNIEnv*, jstring, const char*);
+    void (*SetBooleanField)(JNIEnv*, jobject, jfieldID, jboolean);
+    void (*SetIntField)(JNIEnv*, jobject, jfieldID, jint);
+    void (*SetLongField)(JNIEnv*, jobject, jfieldID, jlong);
+    void (*SetObjectField)(JNIEnv*, jobject, jfieldID, jobject);
+    jsize (*GetArrayLength)(JNIEnv*, jarray);
+    jobject (*GetObjectArrayElement)(JNIEnv*, jobjectArray, jsize);
+    void (*GetIntArrayRegion)(JNIEnv*, jintArray, jsize, jsize, jint*);
+    void (*SetIntArrayRegion)(JNIEnv*, jintArray, jsize, jsize, const jint*);
+    void (*SetLongArrayRegion)(JNIEnv*, jlongArray, jsize, jsize, const jlong*);
+    jbyte* (*GetByteArrayElements)(JNIEnv*, jbyteArray, jboolean*);
+    void (*ReleaseByteArrayElements)(JNIEnv*, jbyteArray, jbyte*, jint);
+    jint (*GetJavaVM)(JNIEnv*, JavaVM**);
+    jint (*PushLocalFrame)(JNIEnv*, jint);
+    jobject (*PopLocalFrame)(JNIEnv*, jobject);
+};
+
+
+#endif
@@ -0,0 +1,19 @@
+// Host build of the benchmarks only, bionic declarations missing from glibc
+#include <linux/types.h>
+#include <linux/sockios.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define __packed __attribute__((packed))
+
+#define IPV6_MAXPACKET 65535
+#define IPV6_VERSION 0x60
+
+struct ippseudo {
+    struct in_addr ippseudo_src;
+    struct in_addr ippseudo_dst;
+    uint8_t ippseudo_pad;
+    uint8_t ippseudo_p;
+    uint16_t ippseudo_len;
+};
@@ -0,0 +1,4 @@
+// Host build of the benchmarks only
+#define PROP_VALUE_MAX 92
+
+int __system_property_get(const char *name, char *value);
@@ -0,0 +1,141 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+// Session table: checks lookups against random adds and deletes,
+// then measures the lookup cost from 10 to 10,000 sessions, which should stay flat
+
+#include "netguard.h"
+#include "bench.h"
+
+#define CHECK_SESSIONS 10000
+#define CHECK_ROUNDS 200000
+#define LOOKUPS 5000000
+
+static struct ng_session *new_session(int i) {
+    struct ng_session *s = ng_calloc(1, sizeof(struct ng_session), "bench");
+    s->protocol = IPPROTO_TCP;
+    s->socket = -1;
+    s->tcp.state = TCP_ESTABLISHED;
+    s->tcp.time = time(NULL);
+    s->tcp.version = (i & 1 ? 4 : 6);
+    s->tcp.source = htons((uint16_t) (i & 0xFFFF));
+    s->tcp.dest = htons(443);
+    if (s->tcp.version == 4) {
+        s->tcp.saddr.ip4 = htonl(0x0A000001 + (i >> 16));
+        s->tcp.daddr.ip4 = htonl(0x08080808);
+    } else {
+        memset(&s->tcp.saddr.ip6, i & 0xFF, 16);
+        memset(&s->tcp.daddr.ip6, 0x20, 16);
+    }
+    return s;
+}
+
+static void get_key(const struct ng_session *s, struct session_key *key) {
+    get_session_key(key, (uint8_t) s->tcp.version, IPPROTO_TCP,
+                    &s->tcp.saddr, s->tcp.source, &s->tcp.daddr, s->tcp.dest);
+}
+
+static int check(struct worker *w) {
+    static struct ng_session *session[CHECK_SESSIONS];
+    struct session_key key;
+
+    srand(1);
+    for (int r = 0; r < CHECK_ROUNDS; r++) {
+        int i = rand() % CHECK_SESSIONS;
+        if (session[i] == NULL) {
+            struct ng_session *s = new_session(i);
+            get_key(s, &key);
+            if (find_session(w, &key) != NULL)
+                return -1;
+            add_session(w, s);
+            session[i] = s;
+        } else {
+            get_key(session[i], &key);
+            if (find_session(w, &key) != session[i])
+                return -1;
+            if (rand() & 1) {
+                delete_session(w, session[i]);
+                session[i] = NULL;
+            }
+        }
+    }
+
+    uint32_t count = 0;
+    for (int i = 0; i < CHECK_SESSIONS; i++) {
+        struct ng_session *s = new_session(i);
+        get_key(s, &key);
+        ng_free(s, __FILE__, __LINE__);
+        if (find_session(w, &key) != session[i])
+            return -1;
+        if (session[i] != NULL)
+            count++;
+    }
+    return (count == w->table.count ? 0 : -1);
+}
+
+static void bench(int sessions) {
+    struct worker *w = ng_calloc(1, sizeof(struct worker), "bench");
+    struct session_key *key = ng_malloc(sessions * sizeof(struct session_key), "bench");
+    for (int i = 0; i < sessions; i++) {
+        struct ng_session *s = new_session(i);
+        get_key(s, &key[i]);
+        add_session(w, s);
+    }
+
+    // Hits in a shuffled order, so not every lookup is in the same cache line
+    int step = (sessions > 7 ? 7 : 1);
+    volatile struct ng_session *found;
+    double start = get_ns();
+    for (long i = 0; i < LOOKUPS; i++)
+        found = find_session(w, &key[(i * step) % sessions]);
+    double hit = (get_ns() - start) / LOOKUPS;
+
+    // Misses
+    for (int i = 0; i < sessions; i++)
+        key[i].dest = htons(80);
+    start = get_ns();
+    for (long i = 0; i < LOOKUPS; i++)
+        found = find_session(w, &key[(i * step) % sessions]);
+    double miss = (get_ns() - start) / LOOKUPS;
+    (void) found;
+
+    printf("%6d sessions table %6u hit %5.1f ns miss %5.1f ns\n",
+           sessions, w->table.size, hit, miss);
+
+    clear(w);
+    free_sessions(w);
+    ng_free(key, __FILE__, __LINE__);
+    ng_free(w, __FILE__, __LINE__);
+}
+
+int main() {
+    struct worker *w = ng_calloc(1, sizeof(struct worker), "bench");
+    if (check(w)) {
+        printf("session table check failed\n");
+        return 1;
+    }
+    printf("session table check ok\n");
+    clear(w);
+    free_sessions(w);
+    ng_free(w, __FILE__, __LINE__);
+
+    for (int sessions = 10; sessions <= 10000; sessions *= 10)
+        bench(sessions);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2019 by Marcel Bokhorst (M66B)
+*/
+
+// System calls per packet with and without io_uring:
+// the tun writer writing to a socket pair standing in for tun, with a slow start of the reader,
+// and the event loop backends with sockets becoming ready, changing interest and being replaced
+
+#include "netguard.h"
+#include "bench.h"
+
+#define TUN_PACKETS 200000
+#define TUN_STALL 100 // packets before the reader pauses
+#define EVENT_SOCKETS 1000
+#define EVENT_ROUNDS 20000
+#define EVENT_READY 16 // sockets receiving a datagram per round
+#define EVENT_WRITE 4 // sockets waiting to be writable per round
+
+static int tun[2];
+
+static void *read_tun(void *data) {
+    uint8_t buffer[2000];
+    for (uint32_t i = 0; i < TUN_PACKETS; i++) {
+        if (i == TUN_STALL)
+            usleep(200000);
+        if (recv(tun[1], buffer, sizeof(buffer), 0) < 0) {
+            perror("recv");
+            exit(1);
+        }
+        uint32_t seq;
+        memcpy(&seq, buffer, sizeof(seq));
+        if (seq != i) {
+            printf("packet %u after %u\n", seq, i);
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void bench_tun_writer(int uring) {
+    struct context *ctx = ng_calloc(1, sizeof(struct context), "context");
+    ctx->nworkers = 1;
+    ctx->uring = uring;
+    ctx->writer.wakefd = eventfd(0, EFD_NONBLOCK);
+    pthread_mutex_init(&ctx->writer.lock, NULL);
+    pthread_cond_init(&ctx->writer.space, NULL);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun)) {
+        perror("socketpair");
+        exit(1);
+    }
+    fcntl(tun[0], F_SETFL, O_NONBLOCK);
+
+    struct arguments args;
+    memset(&args, 0, sizeof(struct arguments));
+    args.tun = tun[0];
+    args.ctx = ctx;
+    args.worker = &ctx->worker[0];
+    if (start_tun_writer(&args)) {
+        printf("tun writer not started\n");
+        exit(1);
+    }
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, read_tun, NULL);
+
+    uint8_t payload[1280];
+    memset(payload, 0, sizeof(payload));
+    double start = get_ns();
+    int failed = 0;
+    for (uint32_t i = 0; i < TUN_PACKETS; i++) {
+        // Sizes of acks, small and full packets
+        size_t size = (i % 3 == 0 ? 36 : (i % 3 == 1 ? 512 : sizeof(payload)));
+        struct iovec iov[2] = {{&i, sizeof(i)},
+                               {payload, size}};
+        if (write_tun(&args, iov, 2) < 0)
+            failed++;
+        if (i % TUN_YIELD == TUN_YIELD - 1)
+            flush_tun(&args);
+    }
+    flush_tun(&args);
+    pthread_join(reader, NULL);
+    double ns = get_ns() - start;
+    int used = ctx->writer.use_uring;
+    stop_tun_writer(ctx);
+
+    printf("tun %-8s %7u packets %5.3f syscalls/packet %6.0f ns/packet"
+           " retries %u dropped %u failed %d%s\n",
+           uring ? "io_uring" : "write", ctx->writer.packets,
+           (double) ctx->writer.syscalls / ctx->writer.packets, ns / TUN_PACKETS,
+           ctx->writer.retries, ctx->writer.dropped, failed,
+           uring && !used ? " (io_uring not available)" : "");
+
+    close(tun[0]);
+    close(tun[1]);
+    free_worker(&ctx->worker[0]);
+    ng_free(ctx, __FILE__, __LINE__);
+}
+
+static void bench_events(const struct event_backend *backend) {
+    static int sock[EVENT_SOCKETS][2];
+    static uint32_t interest[EVENT_SOCKETS];
+    struct event_loop loop;
+    if (open_event_loop(&loop, backend)) {
+        printf("events %-8s not available\n", backend->name);
+        close_event_loop(&loop);
+        return;
+    }
+
+    for (int i = 0; i < EVENT_SOCKETS; i++) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sock[i])) {
+            perror("socketpair");
+            exit(1);
+        }
+        interest[i] = EVENT_IN;
+        register_event(&loop, sock[i][0], interest[i], &sock[i]);
+    }
+
+    srand(1);
+    struct event ev[EPOLL_EVENTS];
+    uint32_t events = 0;
+    uint32_t missed = 0;
+    uint8_t byte = 0;
+    double start = get_ns();
+    for (int r = 0; r < EVENT_ROUNDS; r++) {
+        // Replace a socket, like a closed session and a new one
+        int c = rand() % EVENT_SOCKETS;
+        release_event(&loop, sock[c][0]);
+        close(sock[c][0]);
+        close(sock[c][1]);
+        socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sock[c]);
+        interest[c] = EVENT_IN;
+        register_event(&loop, sock[c][0], interest[c], &sock[c]);
+
+        // Data to forward, like TCP sessions with queued data
+        for (int i = 0; i < EVENT_WRITE; i++) {
+            int w = rand() % EVENT_SOCKETS;
+            if (!(interest[w] & EVENT_OUT)) {
+                interest[w] |= EVENT_OUT;
+                modify_event(&loop, sock[w][0], interest[w], &sock[w]);
+            }
+        }
+
+        int expected = 0;
+        for (int i = 0; i < EVENT_READY; i++) {
+            int s = rand() % EVENT_SOCKETS;
+            if (send(sock[s][1], &byte, 1, 0) == 1)
+                expected++;
+        }
+
+        // Until all datagrams were read
+        while (expected > 0) {
+            int ready = wait_events(&loop, ev, EPOLL_EVENTS, 1000);
+            if (ready <= 0) {
+                missed += (uint32_t) expected;
+                break;
+            }
+            events += (uint32_t) ready;
+            for (int i = 0; i < ready; i++) {
+                int s = (int) ((int (*)[2]) ev[i].data - sock);
+                if (ev[i].events & EVENT_IN)
+                    while (recv(sock[s][0], &byte, 1, 0) == 1)
+                        expected--;
+                if ((ev[i].events & EVENT_OUT) && (interest[s] & EVENT_OUT)) {
+                    interest[s] &= ~EVENT_OUT;
+                    modify_event(&loop, sock[s][0], interest[s], &sock[s]);
+                }
+            }
+        }
+    }
+    double ns = get_ns() - start;
+
+    printf("events %-8s %7u events %5.3f syscalls/event %6.0f ns/round missed %u\n",
+           backend->name, events, (double) loop.syscalls / events, ns / EVENT_ROUNDS, missed);
+
+    close_event_loop(&loop);
+    for (int i = 0; i < EVENT_SOCKETS; i++) {
+        close(sock[i][0]);
+        close(sock[i][1]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bench_tun_writer(0);
+    bench_tun_writer(1);
+    bench_events(&epoll_backend);
+    bench_events(&uring_backend);
+    return 0;
+}